@@ -0,0 +1,91 @@
+// arena.c
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    // Payload follows, aligned to ARENA_ALIGN
+};
+
+#define BLOCK_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+Arena *arena_new(void) {
+    return calloc(1, sizeof(Arena));
+}
+
+static char *new_block(Arena *arena, size_t payload) {
+    ArenaBlock *block = malloc(BLOCK_HEADER + payload);
+    if (!block) abort();
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return (char *)block + BLOCK_HEADER;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->bytes_allocated += size;
+    if ((size_t)(arena->end - arena->cur) < size) {
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            // Oversized requests get their own block so the current one stays in use
+            return new_block(arena, size);
+        }
+        arena->cur = new_block(arena, ARENA_BLOCK_SIZE);
+        arena->end = arena->cur + ARENA_BLOCK_SIZE;
+    }
+    void *p = arena->cur;
+    arena->cur += size;
+    return p;
+}
+
+void *arena_memdup(Arena *arena, const void *src, size_t size) {
+    void *p = arena_alloc(arena, size ? size : 1);
+    if (size) memcpy(p, src, size);
+    return p;
+}
+
+char *arena_strdup(Arena *arena, const char *s) {
+    return arena_memdup(arena, s, strlen(s) + 1);
+}
+
+void arena_reset(Arena *arena) {
+    ArenaBlock *keep = NULL;
+    for (ArenaBlock *block = arena->blocks, *next; block; block = next) {
+        next = block->next;
+        // The block being filled; oversized blocks never are
+        if (!keep && arena->end && (char *)block + BLOCK_HEADER + ARENA_BLOCK_SIZE == arena->end) {
+            keep = block;
+        } else {
+            free(block);
+        }
+    }
+    arena->blocks = keep;
+    if (keep) {
+        keep->next = NULL;
+        arena->cur = (char *)keep + BLOCK_HEADER;
+    } else {
+        arena->cur = arena->end = NULL;
+    }
+    arena->bytes_allocated = 0;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+void arena_free(Arena *arena) {
+    if (!arena) return;
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
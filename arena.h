@@ -0,0 +1,27 @@
+// arena.h
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator: individual allocations are never freed, everything is
+// released at once by arena_free.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;
+    char *cur;
+    char *end;
+    size_t bytes_allocated;
+} Arena;
+
+Arena *arena_new(void);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_memdup(Arena *arena, const void *src, size_t size);
+char *arena_strdup(Arena *arena, const char *s);
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+// Drops every allocation but keeps one block for the next ones
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif // ARENA_H
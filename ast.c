@@ -1,10 +1,9 @@
 // ast.c
 #include "ast.h"
-#include <stdlib.h>
 #include <string.h>
 
-ASTNode *ast_node_new(ASTNodeType type, size_t line, size_t column) {
-    ASTNode *node = malloc(sizeof(ASTNode));
+ASTNode *ast_node_new(Arena *arena, ASTNodeType type, size_t line, size_t column) {
+    ASTNode *node = arena_alloc(arena, sizeof(ASTNode));
     node->type = type;
     node->line = line;
     node->column = column;
@@ -12,83 +11,64 @@ ASTNode *ast_node_new(ASTNodeType type, size_t line, size_t column) {
     return node;
 }
 
-void ast_node_list_append(ASTNodeList **list, ASTNode *node) {
-    ASTNodeList *item = malloc(sizeof(ASTNodeList));
+// The head item tracks the tail, so appending is O(1)
+void ast_node_list_append(Arena *arena, ASTNodeList **list, ASTNode *node) {
+    ASTNodeList *item = arena_alloc(arena, sizeof(ASTNodeList));
     item->node = node;
     item->next = NULL;
+    item->tail = item;
     if (*list == NULL) {
         *list = item;
     } else {
-        ASTNodeList *cur = *list;
-        while (cur->next) cur = cur->next;
-        cur->next = item;
+        (*list)->tail->next = item;
+        (*list)->tail = item;
     }
 }
 
-static void free_list(ASTNodeList *list) {
-    while (list) {
-        ASTNodeList *next = list->next;
-        free_ast(list->node);
-        free(list);
-        list = next;
-    }
+// Nodes, lists and strings all live in the program's arena
+void free_ast(ASTNode *program) {
+    if (!program) return;
+    arena_free(program->as.program.arena);
+}
+
+static size_t list_count(const ASTNodeList *list) {
+    size_t n = 0;
+    for (; list; list = list->next) n += ast_node_count(list->node);
+    return n;
 }
 
-void free_ast(ASTNode *node) {
-    if (!node) return;
+size_t ast_node_count(const ASTNode *node) {
+    if (!node) return 0;
     switch (node->type) {
         case AST_PROGRAM:
-            free_list(node->as.program);
-            break;
+            return 1 + list_count(node->as.program.statements);
+        case AST_BLOCK:
+            return 1 + list_count(node->as.block.statements);
         case AST_EXPR_STMT:
-            free_ast(node->as.expr_stmt.expr);
-            break;
+            return 1 + ast_node_count(node->as.expr_stmt.expr);
         case AST_VAR_ASSIGN:
-            free(node->as.var_assign.name);
-            free_ast(node->as.var_assign.value);
-            break;
+            return 1 + ast_node_count(node->as.var_assign.value);
         case AST_IF:
-            free_ast(node->as.if_stmt.cond);
-            free_ast(node->as.if_stmt.then_branch);
-            free_ast(node->as.if_stmt.else_branch);
-            break;
+            return 1 + ast_node_count(node->as.if_stmt.cond) +
+                   ast_node_count(node->as.if_stmt.then_branch) +
+                   ast_node_count(node->as.if_stmt.else_branch);
         case AST_WHILE:
-            free_ast(node->as.while_stmt.cond);
-            free_ast(node->as.while_stmt.body);
-            break;
+            return 1 + ast_node_count(node->as.while_stmt.cond) +
+                   ast_node_count(node->as.while_stmt.body);
         case AST_RETURN:
-            free_ast(node->as.return_stmt.value);
-            break;
+            return 1 + ast_node_count(node->as.return_stmt.value);
         case AST_FUNCTION:
-            free(node->as.func_def.name);
-            for (size_t i = 0; i < node->as.func_def.param_count; i++) {
-                free(node->as.func_def.params[i]);
-            }
-            free(node->as.func_def.params);
-            free_ast(node->as.func_def.body);
-            break;
-        case AST_BLOCK:
-            free_list(node->as.block.statements);
-            break;
+            return 1 + ast_node_count(node->as.func_def.body);
         case AST_BINARY_OP:
-            free_ast(node->as.binary.left);
-            free_ast(node->as.binary.right);
-            break;
-        case AST_LITERAL:
-            if (node->as.literal.is_string) {
-                free(node->as.literal.str);
-            }
-            break;
-        case AST_VAR_REF:
-            free(node->as.var_ref.name);
-            break;
-        case AST_FUNC_CALL:
-            free(node->as.func_call.name);
+            return 1 + ast_node_count(node->as.binary.left) + ast_node_count(node->as.binary.right);
+        case AST_FUNC_CALL: {
+            size_t n = 1;
             for (size_t i = 0; i < node->as.func_call.arg_count; i++) {
-                free_ast(node->as.func_call.args[i]);
+                n += ast_node_count(node->as.func_call.args[i]);
             }
-            free(node->as.func_call.args);
-            break;
+            return n;
+        }
+        default:
+            return 1;
     }
-    free(node);
 }
@@ -4,6 +4,7 @@
 
 #include <stddef.h>
 #include "tokens.h"
+#include "arena.h"
 
 typedef enum {
     AST_PROGRAM,
@@ -23,13 +24,14 @@ typedef enum {
 typedef struct ASTNodeList {
     struct ASTNode *node;
     struct ASTNodeList *next;
+    struct ASTNodeList *tail;   // last item; maintained on the head only
 } ASTNodeList;
 
 typedef struct ASTNode {
     ASTNodeType type;
     size_t line, column;
     union {
-        ASTNodeList *program;
+        struct { ASTNodeList *statements; Arena *arena; } program;
         struct { struct ASTNode *expr; } expr_stmt;
         struct { char *name; struct ASTNode *value; } var_assign;
         struct { struct ASTNode *cond, *then_branch, *else_branch; } if_stmt;
@@ -44,8 +46,12 @@ typedef struct ASTNode {
     } as;
 } ASTNode;
 
-ASTNode *ast_node_new(ASTNodeType type, size_t line, size_t column);
-void ast_node_list_append(ASTNodeList **list, ASTNode *node);
-void free_ast(ASTNode *node);
+// All nodes of a program are allocated from the arena owned by its
+// AST_PROGRAM root; free_ast on the root releases the whole tree.
+ASTNode *ast_node_new(Arena *arena, ASTNodeType type, size_t line, size_t column);
+void ast_node_list_append(Arena *arena, ASTNodeList **list, ASTNode *node);
+void free_ast(ASTNode *program);
+// Nodes in the tree under node, node included
+size_t ast_node_count(const ASTNode *node);
 
 #endif // AST_H
@@ -0,0 +1,353 @@
+// batch.c
+#define _GNU_SOURCE
+#include "batch.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "deque.h"
+#include "phpc.h"
+#include "source.h"
+#include "bccache.h"
+
+// Initial bucket count of the script index, a power of two
+#define SCRIPT_INDEX_INITIAL 16
+
+typedef struct {
+    char *path;
+    Bytecode *bc;
+} Script;
+
+// One line of the job list
+typedef struct {
+    size_t script;
+    char *input;            // NULL without one
+} JobSpec;
+
+// One execution of a line; job i runs line i % spec_count
+typedef struct {
+    char *output;
+    size_t length, capacity;
+    double seconds;
+    char *error;            // runtime error, NULL when the job succeeded
+} Job;
+
+struct Batch;
+
+// Cache-line sized so one worker's deque indices do not share a line with
+// the next one's
+typedef struct __attribute__((aligned(64))) {
+    pthread_t thread;
+    WorkDeque deque;
+    struct Batch *batch;
+    size_t executed, stolen;
+    uint32_t rng;
+} Worker;
+
+typedef struct Batch {
+    Script *scripts;
+    size_t script_count, script_capacity;
+    size_t *script_index;   // open addressing by path: script index + 1, 0 = empty
+    size_t index_size;
+    JobSpec *specs;
+    size_t spec_count, spec_capacity;
+    Job *jobs;
+    size_t job_count;
+    Worker *workers;
+    size_t worker_count;
+    int use_jit;
+} Batch;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a
+static uint64_t hash_string(const char *str) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *str; str++) h = (h ^ (uint8_t)*str) * 1099511628211ULL;
+    return h;
+}
+
+static size_t *script_bucket(size_t *index, size_t size, const Script *scripts, const char *path) {
+    size_t i = hash_string(path) & (size - 1);
+    while (index[i] && strcmp(scripts[index[i] - 1].path, path) != 0) i = (i + 1) & (size - 1);
+    return &index[i];
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static Bytecode *compile_script(const char *path, int opt_level) {
+    char message[ERROR_MESSAGE_MAX];
+    Bytecode *bc;
+    PhpcStatus status;
+    if (has_suffix(path, BCCACHE_EXT)) {
+        status = phpc_load(path, &bc, message, sizeof(message));
+    } else {
+        SourceFile source;
+        if (source_open(&source, path) != 0) {
+            perror(path);
+            return NULL;
+        }
+        status = phpc_compile(source.data, source.length, opt_level, &bc, message, sizeof(message));
+        source_close(&source);
+    }
+    if (status != PHPC_OK) {
+        fprintf(stderr, "%s: %s\n", path, message);
+        return NULL;
+    }
+    return bc;
+}
+
+// Index of the script at path, compiling it on first sight; -1 on failure
+static long find_script(Batch *b, const char *path, int opt_level) {
+    if ((b->script_count + 1) * 2 > b->index_size) {
+        size_t size = b->index_size ? b->index_size * 2 : SCRIPT_INDEX_INITIAL;
+        size_t *index = calloc(size, sizeof(size_t));
+        for (size_t i = 0; i < b->script_count; i++) {
+            *script_bucket(index, size, b->scripts, b->scripts[i].path) = i + 1;
+        }
+        free(b->script_index);
+        b->script_index = index;
+        b->index_size = size;
+    }
+    size_t *bucket = script_bucket(b->script_index, b->index_size, b->scripts, path);
+    if (*bucket) return (long)*bucket - 1;
+    Bytecode *bc = compile_script(path, opt_level);
+    if (!bc) return -1;
+    if (b->script_count == b->script_capacity) {
+        b->script_capacity = b->script_capacity ? b->script_capacity * 2 : 8;
+        b->scripts = realloc(b->scripts, b->script_capacity * sizeof(Script));
+    }
+    b->scripts[b->script_count] = (Script){ strdup(path), bc };
+    *bucket = ++b->script_count;
+    return (long)b->script_count - 1;
+}
+
+static int read_jobs(Batch *b, const char *jobs_path, int opt_level) {
+    FILE *in = fopen(jobs_path, "r");
+    if (!in) {
+        perror("Error opening job list");
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t n;
+    int result = 0;
+    while ((n = getline(&line, &line_capacity, in)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        char *tab = strchr(line, '\t');
+        if (tab) *tab = '\0';
+        long script = find_script(b, line, opt_level);
+        if (script < 0) {
+            result = -1;
+            break;
+        }
+        if (b->spec_count == b->spec_capacity) {
+            b->spec_capacity = b->spec_capacity ? b->spec_capacity * 2 : 64;
+            b->specs = realloc(b->specs, b->spec_capacity * sizeof(JobSpec));
+        }
+        b->specs[b->spec_count++] = (JobSpec){ (size_t)script, tab ? strdup(tab + 1) : NULL };
+    }
+    free(line);
+    fclose(in);
+    if (result == 0 && b->spec_count == 0) {
+        fprintf(stderr, "No jobs in %s\n", jobs_path);
+        result = -1;
+    }
+    return result;
+}
+
+static void collect(void *ctx, const char *data, size_t length) {
+    Job *job = ctx;
+    if (job->length + length > job->capacity) {
+        job->capacity = (job->length + length) * 2;
+        job->output = realloc(job->output, job->capacity);
+    }
+    memcpy(job->output + job->length, data, length);
+    job->length += length;
+}
+
+static void run_job(Worker *w, VM *vm, size_t index) {
+    Batch *b = w->batch;
+    Job *job = &b->jobs[index];
+    const JobSpec *spec = &b->specs[index % b->spec_count];
+    OutputSink sink = { -1, collect, job };
+    VmOptions options = { b->use_jit, &sink, NULL, NULL, NULL, spec->input };
+    double start = now_seconds();
+    int failed = vm_run(vm, b->scripts[spec->script].bc, &options) != 0;
+    job->seconds = now_seconds() - start;
+    if (failed) job->error = strdup(vm_error(vm));
+    w->executed++;
+}
+
+// xorshift32, for picking steal victims
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void *work(void *arg) {
+    Worker *w = arg;
+    Batch *b = w->batch;
+    VM *vm = vm_new();
+    for (;;) {
+        size_t index;
+        if (deque_pop(&w->deque, &index)) {
+            run_job(w, vm, index);
+            continue;
+        }
+        // Out of work: steal the oldest job of another worker, starting at
+        // a random one so thieves spread out
+        int stolen = 0, contended = 0;
+        size_t first = next_random(&w->rng) % b->worker_count;
+        for (size_t k = 0; k < b->worker_count && !stolen; k++) {
+            Worker *victim = &b->workers[(first + k) % b->worker_count];
+            if (victim == w) continue;
+            int r = deque_steal(&victim->deque, &index);
+            if (r > 0) stolen = 1;
+            else if (r < 0) contended = 1;
+        }
+        if (stolen) {
+            w->stolen++;
+            run_job(w, vm, index);
+        } else if (!contended) {
+            // Jobs are only pushed before the workers start, so once every
+            // deque is empty the batch is done
+            break;
+        }
+    }
+    vm_free(vm);
+    return NULL;
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest rank
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t rank = (size_t)(p / 100.0 * (double)n + 0.999999);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void report(const Batch *b, double wall) {
+    size_t failed = 0, least = SIZE_MAX, most = 0, stolen = 0;
+    double *latency = malloc(b->job_count * sizeof(double)), sum = 0;
+    for (size_t i = 0; i < b->job_count; i++) {
+        latency[i] = b->jobs[i].seconds;
+        sum += latency[i];
+        failed += b->jobs[i].error != NULL;
+    }
+    qsort(latency, b->job_count, sizeof(double), by_value);
+    for (size_t i = 0; i < b->worker_count; i++) {
+        const Worker *w = &b->workers[i];
+        if (w->executed < least) least = w->executed;
+        if (w->executed > most) most = w->executed;
+        stolen += w->stolen;
+    }
+    fprintf(stderr, "batch: %zu jobs, %zu scripts, %zu threads, %zu failed\n", b->job_count,
+            b->script_count, b->worker_count, failed);
+    fprintf(stderr, "throughput: %.3f s, %.1f jobs/s\n", wall, (double)b->job_count / wall);
+    fprintf(stderr, "latency ms: mean %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+            sum / (double)b->job_count * 1e3, percentile(latency, b->job_count, 50) * 1e3,
+            percentile(latency, b->job_count, 90) * 1e3, percentile(latency, b->job_count, 99) * 1e3,
+            percentile(latency, b->job_count, 99.9) * 1e3, latency[b->job_count - 1] * 1e3);
+    fprintf(stderr, "workers: %zu to %zu jobs each, %zu stolen\n", least, most, stolen);
+    free(latency);
+}
+
+static void batch_free(Batch *b) {
+    for (size_t i = 0; i < b->script_count; i++) {
+        free(b->scripts[i].path);
+        bytecode_free(b->scripts[i].bc);
+    }
+    for (size_t i = 0; i < b->spec_count; i++) free(b->specs[i].input);
+    for (size_t i = 0; i < b->job_count; i++) {
+        free(b->jobs[i].output);
+        free(b->jobs[i].error);
+    }
+    for (size_t i = 0; i < b->worker_count; i++) deque_free(&b->workers[i].deque);
+    free(b->scripts);
+    free(b->script_index);
+    free(b->specs);
+    free(b->jobs);
+    free(b->workers);
+}
+
+int batch_run(const char *jobs_path, int threads, int repeat, int opt_level, int use_jit) {
+    Batch b;
+    memset(&b, 0, sizeof(b));
+    b.use_jit = use_jit;
+    if (read_jobs(&b, jobs_path, opt_level) != 0) {
+        batch_free(&b);
+        return EXIT_FAILURE;
+    }
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)(cpus < BATCH_THREADS_MAX ? cpus : BATCH_THREADS_MAX) : 1;
+    }
+    b.job_count = b.spec_count * (size_t)repeat;
+    b.jobs = calloc(b.job_count, sizeof(Job));
+    // calloc only guarantees malloc's alignment, short of Worker's
+    void *workers;
+    if (posix_memalign(&workers, 64, (size_t)threads * sizeof(Worker)) != 0) {
+        perror("posix_memalign");
+        batch_free(&b);
+        return EXIT_FAILURE;
+    }
+    memset(workers, 0, (size_t)threads * sizeof(Worker));
+    b.workers = workers;
+    b.worker_count = (size_t)threads;
+
+    // Deal the jobs out round-robin; stealing evens out what that misjudges
+    size_t share = (b.job_count + b.worker_count - 1) / b.worker_count;
+    for (size_t i = 0; i < b.worker_count; i++) {
+        Worker *w = &b.workers[i];
+        w->batch = &b;
+        w->rng = (uint32_t)(i * 2654435761u) | 1;
+        deque_init(&w->deque, share);
+    }
+    for (size_t i = 0; i < b.job_count; i++) deque_push(&b.workers[i % b.worker_count].deque, i);
+
+    double start = now_seconds();
+    size_t started = 0;
+    for (; started < b.worker_count; started++) {
+        if (pthread_create(&b.workers[started].thread, NULL, work, &b.workers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    // Should a thread fail to start, the others steal its jobs
+    if (started == 0) work(&b.workers[0]);
+    for (size_t i = 0; i < started; i++) pthread_join(b.workers[i].thread, NULL);
+    double wall = now_seconds() - start;
+
+    int exit_code = EXIT_SUCCESS;
+    for (size_t i = 0; i < b.job_count; i++) {
+        const Job *job = &b.jobs[i];
+        if (job->length) fwrite(job->output, 1, job->length, stdout);
+        if (job->error) {
+            fprintf(stderr, "job %zu (%s): %s\n", i + 1, b.scripts[b.specs[i % b.spec_count].script].path,
+                    job->error);
+            exit_code = EXIT_FAILURE;
+        }
+    }
+    fflush(stdout);
+    report(&b, wall);
+    batch_free(&b);
+    return exit_code;
+}
@@ -0,0 +1,19 @@
+// batch.h
+#ifndef BATCH_H
+#define BATCH_H
+
+// Most worker threads --threads accepts
+#define BATCH_THREADS_MAX 256
+
+// --batch: runs the jobs listed in jobs_path on a pool of threads, each
+// with its own VM, and reports throughput and latency on stderr. A job is
+// one line: a script path, then optionally a tab and an input string the
+// script sees as $input. Blank lines and lines starting with '#' are
+// skipped. Every distinct script is compiled once, at opt_level, and
+// shared read-only by all workers. The list runs repeat times over; each
+// job's output goes to stdout in list order once all are done.
+// threads 0 uses one per online CPU. Returns the exit status: nonzero
+// when a job failed.
+int batch_run(const char *jobs_path, int threads, int repeat, int opt_level, int use_jit);
+
+#endif // BATCH_H
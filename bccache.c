@@ -0,0 +1,353 @@
+// bccache.c
+#define _POSIX_C_SOURCE 200809L
+#include "bccache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout, all fields in host byte order:
+//   CacheHeader
+//   CacheConst[const_count]   int value, or string offset for VAL_STR
+//   uint32_t[var_count]       variable name string offsets
+//   CacheFunction[func_count]
+//   LineRun[line_count]       source line of each run of code, by offset
+//   char[strings_size]        NUL-terminated strings
+//   uint8_t[code_size]        bytecode, exactly as compiled
+#define BCCACHE_MAGIC "PHPCB\0\r\n"
+#define BCCACHE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // BCCACHE_BYTE_ORDER as stored by the writer
+    uint64_t source_hash;
+    uint32_t opt_level;
+    uint32_t code_size;
+    uint32_t const_count;
+    uint32_t var_count;
+    uint32_t strings_size;
+    uint32_t func_count;
+    uint32_t line_count;
+    uint32_t max_depth;     // operand stack the top level needs
+} CacheHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t value;
+} CacheConst;
+
+typedef struct {
+    uint32_t name;          // string offset
+    uint32_t entry;
+    uint16_t param_count;
+    uint16_t local_count;
+    uint32_t max_depth;
+} CacheFunction;
+
+// Section offsets, in file order
+typedef struct {
+    size_t consts, vars, funcs, lines, strings, code, end;
+} Layout;
+
+static Layout layout(size_t const_count, size_t var_count, size_t func_count,
+                     size_t line_count, size_t strings_size, size_t code_size) {
+    Layout l;
+    l.consts = sizeof(CacheHeader);
+    l.vars = l.consts + const_count * sizeof(CacheConst);
+    l.funcs = l.vars + var_count * sizeof(uint32_t);
+    l.lines = l.funcs + func_count * sizeof(CacheFunction);
+    l.strings = l.lines + line_count * sizeof(LineRun);
+    l.code = l.strings + strings_size;
+    l.end = l.code + code_size;
+    return l;
+}
+
+// 64-bit FNV-1a
+uint64_t bccache_hash(const char *data, size_t length) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint32_t append_string(char *strings, uint32_t *at, const char *s) {
+    uint32_t offset = *at;
+    size_t n = strlen(s) + 1;
+    memcpy(strings + offset, s, n);
+    *at += (uint32_t)n;
+    return offset;
+}
+
+int bccache_write(const Bytecode *bc, const char *path, uint64_t source_hash, int opt_level) {
+    size_t strings_size = 0;
+    for (size_t i = 0; i < bc->const_count; i++) {
+        if (value_type(bc->constants[i]) == VAL_STR) strings_size += strlen(value_as_str(bc->constants[i])) + 1;
+    }
+    for (size_t i = 0; i < bc->var_count; i++) {
+        strings_size += strlen(bc->var_names[i]) + 1;
+    }
+    for (size_t i = 0; i < bc->func_count; i++) {
+        strings_size += strlen(bc->functions[i].name) + 1;
+    }
+
+    Layout l = layout(bc->const_count, bc->var_count, bc->func_count, bc->line_count,
+                      strings_size, bc->code_size);
+    uint8_t *buf = calloc(1, l.end);
+
+    CacheHeader header = {
+        .version = BCCACHE_VERSION,
+        .byte_order = BCCACHE_BYTE_ORDER,
+        .source_hash = source_hash,
+        .opt_level = (uint32_t)opt_level,
+        .code_size = (uint32_t)bc->code_size,
+        .const_count = (uint32_t)bc->const_count,
+        .var_count = (uint32_t)bc->var_count,
+        .strings_size = (uint32_t)strings_size,
+        .func_count = (uint32_t)bc->func_count,
+        .line_count = (uint32_t)bc->line_count,
+        .max_depth = bc->max_depth,
+    };
+    memcpy(header.magic, BCCACHE_MAGIC, sizeof(header.magic));
+    memcpy(buf, &header, sizeof(header));
+
+    CacheConst *consts = (CacheConst *)(buf + l.consts);
+    uint32_t *vars = (uint32_t *)(buf + l.vars);
+    CacheFunction *funcs = (CacheFunction *)(buf + l.funcs);
+    char *strings = (char *)(buf + l.strings);
+    uint32_t string_at = 0;
+    for (size_t i = 0; i < bc->const_count; i++) {
+        consts[i].type = value_type(bc->constants[i]);
+        consts[i].value = consts[i].type == VAL_STR
+            ? append_string(strings, &string_at, value_as_str(bc->constants[i]))
+            : (uint32_t)value_as_int(bc->constants[i]);
+    }
+    for (size_t i = 0; i < bc->var_count; i++) {
+        vars[i] = append_string(strings, &string_at, bc->var_names[i]);
+    }
+    for (size_t i = 0; i < bc->func_count; i++) {
+        const Function *f = &bc->functions[i];
+        funcs[i] = (CacheFunction){ append_string(strings, &string_at, f->name),
+                                    f->entry, f->param_count, f->local_count,
+                                    f->max_depth };
+    }
+    if (bc->line_count) memcpy(buf + l.lines, bc->lines, bc->line_count * sizeof(LineRun));
+    memcpy(buf + l.code, bc->code, bc->code_size);
+
+    // Write to a temporary name and rename, so a concurrent reader never
+    // maps a half-written file
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(buf, 1, l.end, f) == l.end;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    free(tmp);
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+// Balance of the operand stack, within the depths the file declares; see
+// bytecode_stack_depths
+static int verify_depths(const Bytecode *bc) {
+    uint32_t *max_depths = malloc((bc->func_count + 1) * sizeof(uint32_t));
+    int ok = bytecode_stack_depths(bc, max_depths) == 0;
+    if (ok && max_depths[0] > bc->max_depth) ok = 0;
+    for (size_t i = 0; ok && i < bc->func_count; i++) {
+        if (max_depths[i + 1] > bc->functions[i].max_depth) ok = 0;
+    }
+    free(max_depths);
+    return ok;
+}
+
+// Checks that every instruction is complete, every operand indexes into the
+// pools, every jump stays inside its function and lands on an instruction,
+// and the operand stack is balanced, so the VM can trust the code as it
+// trusts freshly compiled code. Regions: 0 is the top level, i + 1 the body
+// of function i; slot operands are bounded by the frame size of their
+// region.
+static int verify_code(const Bytecode *bc) {
+    size_t size = bc->code_size;
+    const uint8_t *code = bc->code;
+    uint32_t *entry_of = calloc(size ? size : 1, sizeof(uint32_t));   // function + 1
+    uint32_t *region = calloc(size ? size : 1, sizeof(uint32_t));
+    uint8_t *starts = calloc(size ? size : 1, 1);
+    int ok = size > 0;
+    for (size_t i = 0; ok && i < bc->func_count; i++) {
+        const Function *f = &bc->functions[i];
+        ok = f->entry > 0 && f->entry < size && !entry_of[f->entry] &&
+             f->local_count >= f->param_count;
+        if (ok) entry_of[f->entry] = (uint32_t)(i + 1);
+    }
+
+    uint32_t current = 0;
+    size_t slot_limit = bc->var_count, last = 0;
+    for (size_t ip = 0; ok && ip < size; ip += opcode_length(code[ip])) {
+        uint8_t op = code[ip];
+        // Quickened forms exist only inside a running VM
+        if (op >= OP_ADD_INT || ip + opcode_length(op) > size) {
+            ok = 0;
+            break;
+        }
+        if (entry_of[ip]) {
+            // No falling into a function from the code before it
+            if (ip > 0 && code[last] != OP_HALT && code[last] != OP_RET) {
+                ok = 0;
+                break;
+            }
+            current = entry_of[ip];
+            slot_limit = bc->functions[current - 1].local_count;
+        }
+        starts[ip] = 1;
+        region[ip] = current;
+        last = ip;
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_ADD_CONST:
+                ok = read_u16(&code[ip + 1]) < bc->const_count;
+                break;
+            case OP_LOAD:
+            case OP_STORE:
+                ok = read_u16(&code[ip + 1]) < bc->const_count &&
+                     value_type(bc->constants[read_u16(&code[ip + 1])]) == VAL_STR;
+                break;
+            case OP_LOAD_SLOT:
+            case OP_STORE_SLOT:
+                ok = read_u16(&code[ip + 1]) < slot_limit;
+                break;
+            case OP_INC_SLOT:
+                ok = read_u16(&code[ip + 1]) < slot_limit &&
+                     read_u16(&code[ip + 3]) < bc->const_count;
+                break;
+            case OP_CALL:
+                ok = read_u16(&code[ip + 1]) < bc->func_count;
+                break;
+            default:
+                break;
+        }
+    }
+    // The threaded VM relies on code ending in OP_HALT or a function's OP_RET
+    if (ok) ok = code[last] == OP_HALT || code[last] == OP_RET;
+    for (size_t i = 0; ok && i < bc->func_count; i++) {
+        ok = starts[bc->functions[i].entry];
+    }
+    for (size_t ip = 0; ok && ip < size; ip += opcode_length(code[ip])) {
+        if (opcode_is_jump(code[ip])) {
+            size_t target = jump_target(code, ip);
+            ok = target < size && starts[target] && region[target] == region[ip];
+        }
+    }
+    if (ok) ok = verify_depths(bc);
+    free(entry_of);
+    free(region);
+    free(starts);
+    return ok;
+}
+
+// Builds the pool tables over the mapping; strings are used in place
+static Bytecode *bytecode_from_mapping(uint8_t *map, size_t size, const CacheHeader *h) {
+    if (h->const_count > MAX_CONSTANTS || h->var_count > MAX_VARS || h->func_count > MAX_FUNCTIONS) {
+        return NULL;
+    }
+    if (h->line_count > h->code_size) return NULL;
+    Layout l = layout(h->const_count, h->var_count, h->func_count, h->line_count,
+                      h->strings_size, h->code_size);
+    if (l.end != size) return NULL;
+    char *strings = (char *)map + l.strings;
+    // A terminated blob means every in-range offset yields a terminated string
+    if (h->strings_size && strings[h->strings_size - 1] != '\0') return NULL;
+
+    const CacheConst *consts = (const CacheConst *)(map + l.consts);
+    const uint32_t *vars = (const uint32_t *)(map + l.vars);
+    const CacheFunction *funcs = (const CacheFunction *)(map + l.funcs);
+    Bytecode *bc = bytecode_new();
+    bc->mapping = map;
+    bc->mapping_size = size;
+    bc->code = map + l.code;
+    bc->code_size = bc->code_capacity = h->code_size;
+    bc->constants = malloc(sizeof(Value) * (h->const_count ? h->const_count : 1));
+    bc->const_count = bc->const_capacity = h->const_count;
+    bc->var_names = malloc(sizeof(char*) * (h->var_count ? h->var_count : 1));
+    bc->var_count = bc->var_capacity = h->var_count;
+    bc->functions = malloc(sizeof(Function) * (h->func_count ? h->func_count : 1));
+    bc->func_count = bc->func_capacity = h->func_count;
+    bc->lines = (LineRun *)(map + l.lines);
+    bc->line_count = bc->line_capacity = h->line_count;
+    bc->max_depth = h->max_depth;
+    int ok = 1;
+    for (size_t i = 0; ok && i < bc->line_count; i++) {
+        ok = bc->lines[i].offset < bc->code_size &&
+             (i == 0 || bc->lines[i].offset > bc->lines[i - 1].offset);
+    }
+    for (size_t i = 0; i < bc->const_count; i++) {
+        if (consts[i].type == VAL_STR && consts[i].value < h->strings_size) {
+            bc->constants[i] = value_str(strings + consts[i].value);
+        } else if (consts[i].type == VAL_INT) {
+            bc->constants[i] = value_int((int)consts[i].value);
+        } else {
+            ok = 0;
+        }
+    }
+    for (size_t i = 0; i < bc->var_count; i++) {
+        if (vars[i] < h->strings_size) {
+            bc->var_names[i] = strings + vars[i];
+        } else {
+            ok = 0;
+        }
+    }
+    for (size_t i = 0; i < bc->func_count; i++) {
+        if (funcs[i].name < h->strings_size) {
+            bc->functions[i] = (Function){ strings + funcs[i].name, funcs[i].entry,
+                                           funcs[i].param_count, funcs[i].local_count,
+                                           funcs[i].max_depth };
+        } else {
+            ok = 0;
+        }
+    }
+    if (!ok || !verify_code(bc)) {
+        bc->mapping = NULL;     // the caller unmaps
+        free(bc->constants);
+        free(bc->var_names);
+        free(bc->functions);
+        free(bc);
+        return NULL;
+    }
+    return bc;
+}
+
+Bytecode *bccache_load(const char *path, uint64_t *source_hash, int *opt_level) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    CacheHeader header;
+    memcpy(&header, map, sizeof(header));
+    Bytecode *bc = NULL;
+    if (memcmp(header.magic, BCCACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == BCCACHE_VERSION &&
+        header.byte_order == BCCACHE_BYTE_ORDER) {
+        bc = bytecode_from_mapping(map, size, &header);
+    }
+    if (!bc) {
+        munmap(map, size);
+        return NULL;
+    }
+    if (source_hash) *source_hash = header.source_hash;
+    if (opt_level) *opt_level = (int)header.opt_level;
+    return bc;
+}
@@ -0,0 +1,24 @@
+// bccache.h
+#ifndef BCCACHE_H
+#define BCCACHE_H
+
+#include <stdint.h>
+#include "bytecode.h"
+
+// Compiled bytecode files (.phpcb). Bump the version whenever the opcode
+// set, an opcode's stack effect, operand encoding or file layout changes;
+// older files are rejected.
+#define BCCACHE_VERSION 6
+#define BCCACHE_EXT ".phpcb"
+
+uint64_t bccache_hash(const char *data, size_t length);
+
+// Writes bc to path atomically. Returns 0 on success, -1 with errno set.
+int bccache_write(const Bytecode *bc, const char *path, uint64_t source_hash, int opt_level);
+
+// Maps a cache file and returns read-only bytecode whose code, strings and
+// line table live in the mapping. Returns NULL if the file is missing, malformed or
+// from another version. source_hash and opt_level may be NULL.
+Bytecode *bccache_load(const char *path, uint64_t *source_hash, int *opt_level);
+
+#endif // BCCACHE_H
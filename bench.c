@@ -0,0 +1,362 @@
+// bench.c
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lexer.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "peephole.h"
+#include "vm.h"
+
+// Timed repetitions of each stage, after one untimed warm-up
+#define DEFAULT_REPS 11
+// Median slowdown, in percent, that --baseline reports as a regression
+#define DEFAULT_THRESHOLD 10.0
+// Baseline medians below this many seconds are too noisy to flag
+#define NOISE_FLOOR 1e-4
+// Nesting of the expression in the arith workload
+#define ARITH_DEPTH 32
+
+typedef enum { STAGE_LEX, STAGE_PARSE, STAGE_COMPILE, STAGE_RUN, STAGE_COUNT } Stage;
+
+static const char *const stage_names[STAGE_COUNT] = { "lex", "parse", "compile", "run" };
+
+// Script text under construction
+typedef struct {
+    char *data;
+    size_t length, capacity;
+} Text;
+
+static void append(Text *t, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(t->data + t->length, t->capacity - t->length, fmt, ap);
+        va_end(ap);
+        if ((size_t)n < t->capacity - t->length) {
+            t->length += (size_t)n;
+            return;
+        }
+        t->capacity = t->capacity * 2 + (size_t)n + 1;
+        t->data = realloc(t->data, t->capacity);
+    }
+}
+
+// Each generator writes a script whose work grows linearly with n
+
+// A deeply nested expression evaluated in a loop; values stay small
+static void gen_arith(Text *t, size_t n) {
+    append(t, "$i = 0;\n$s = 0;\nwhile ($i < %zu) {\n    $x = ", n / 8);
+    for (int d = 0; d < ARITH_DEPTH; d++) append(t, "((");
+    append(t, "$i");
+    for (int d = 0; d < ARITH_DEPTH; d++) append(t, d % 2 ? " * 3) %% 97)" : " + %d) - 1)", d);
+    append(t, ";\n    $s = ($s + $x) %% 1000003;\n    $i = $i + 1;\n}\nprint($s);\n");
+}
+
+// One long while loop of slot arithmetic
+static void gen_loop(Text *t, size_t n) {
+    append(t, "$i = 0;\n$s = 0;\nwhile ($i < %zu) {\n    $s = $s + $i %% 7;\n"
+              "    $i = $i + 1;\n}\nprint($s);\n", n * 2);
+}
+
+// Thousands of variables, each computed from the previous one
+static void gen_vars(Text *t, size_t n) {
+    size_t vars = n / 500 ? n / 500 : 1;
+    append(t, "$i = 0;\nwhile ($i < 100) {\n    $v0 = $i;\n");
+    for (size_t k = 1; k < vars; k++) append(t, "    $v%zu = $v%zu + %zu %% 13;\n", k, k - 1, k);
+    append(t, "    $i = $i + 1;\n}\nprint($v%zu);\n", vars - 1);
+}
+
+// A very long straight-line file; mostly front-end work. Literals repeat
+// to stay within the 16-bit constant pool.
+static void gen_huge(Text *t, size_t n) {
+    append(t, "$a = 1;\n$b = 2;\n");
+    for (size_t k = 0; k < n / 10; k++) {
+        append(t, "$a = $b + %zu * 3;\n$b = $a %% 1000 - 7;\n", k % 1000);
+    }
+    append(t, "print($a);\n");
+}
+
+// Output-bound: many short prints
+static void gen_print(Text *t, size_t n) {
+    append(t, "$i = 0;\nwhile ($i < %zu) {\n    print($i);\n    print(\" \");\n"
+              "    $i = $i + 1;\n}\n", n / 5);
+}
+
+typedef struct {
+    const char *name;
+    void (*generate)(Text *t, size_t n);
+} Workload;
+
+static const Workload workloads[] = {
+    { "arith", gen_arith },
+    { "loop", gen_loop },
+    { "vars", gen_vars },
+    { "huge", gen_huge },
+    { "print", gen_print },
+};
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+// Seconds per repetition of one stage of one workload
+typedef struct {
+    double median, p10, p90, min, max;
+} Stats;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int by_value(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Linear interpolation between the closest ranks of sorted samples
+static double percentile(const double *sorted, int n, double p) {
+    double rank = p / 100.0 * (n - 1);
+    int lo = (int)rank;
+    if (lo + 1 >= n) return sorted[n - 1];
+    return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+static Stats summarize(double *samples, int n) {
+    qsort(samples, (size_t)n, sizeof(double), by_value);
+    return (Stats){ percentile(samples, n, 50), percentile(samples, n, 10),
+                    percentile(samples, n, 90), samples[0], samples[n - 1] };
+}
+
+// Script output is timed but discarded
+static void discard(void *ctx, const char *data, size_t length) {
+    (void)ctx;
+    (void)data;
+    (void)length;
+}
+
+static Bytecode *compile_at_o2(ASTNode *ast) {
+    optimize_ast(ast);
+    Bytecode *bc = compile(ast);
+    peephole_optimize(bc);
+    return bc;
+}
+
+// Times one stage. Stages after lex first do the earlier ones untimed.
+static double time_stage(Stage stage, const Text *script, const OutputSink *sink) {
+    double start = 0, elapsed = 0;
+    switch (stage) {
+    case STAGE_LEX: {
+        start = now_seconds();
+        TokenStream *tokens = lex(script->data, script->length);
+        elapsed = now_seconds() - start;
+        free_tokens(tokens);
+        break;
+    }
+    case STAGE_PARSE: {
+        start = now_seconds();
+        ASTNode *ast = parse(script->data, script->length);
+        elapsed = now_seconds() - start;
+        free_ast(ast);
+        break;
+    }
+    case STAGE_COMPILE: {
+        ASTNode *ast = parse(script->data, script->length);
+        start = now_seconds();
+        Bytecode *bc = compile_at_o2(ast);
+        elapsed = now_seconds() - start;
+        bytecode_free(bc);
+        free_ast(ast);
+        break;
+    }
+    case STAGE_RUN: {
+        ASTNode *ast = parse(script->data, script->length);
+        Bytecode *bc = compile_at_o2(ast);
+        start = now_seconds();
+        run_bytecode(bc, 1, sink, NULL, NULL, NULL);
+        elapsed = now_seconds() - start;
+        bytecode_free(bc);
+        free_ast(ast);
+        break;
+    }
+    default:
+        break;
+    }
+    return elapsed;
+}
+
+// A result of an earlier run, read back from its JSON
+typedef struct {
+    char workload[32];
+    char stage[16];
+    double median;
+} Baseline;
+
+// Reads the "results" lines of a file written by write_json
+static Baseline *read_baseline(const char *path, size_t *count) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("Error reading baseline");
+        exit(EXIT_FAILURE);
+    }
+    Baseline *b = NULL;
+    size_t n = 0, capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), in)) {
+        Baseline r;
+        if (sscanf(line, " {\"workload\": \"%31[^\"]\", \"stage\": \"%15[^\"]\", \"median\": %lf",
+                   r.workload, r.stage, &r.median) != 3) continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            b = realloc(b, capacity * sizeof(Baseline));
+        }
+        b[n++] = r;
+    }
+    fclose(in);
+    if (n == 0) {
+        fprintf(stderr, "No benchmark results in %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    *count = n;
+    return b;
+}
+
+static void write_json(FILE *out, Stats results[][STAGE_COUNT], const size_t *sizes,
+                       double scale, int reps) {
+    fprintf(out, "{\n  \"scale\": %g,\n  \"reps\": %d,\n  \"unit\": \"seconds\",\n  \"results\": [\n",
+            scale, reps);
+    const char *sep = "";
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+        if (!sizes[w]) continue;    // skipped by --only
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const Stats *r = &results[w][s];
+            // One result per line, which read_baseline relies on
+            fprintf(out, "%s    {\"workload\": \"%s\", \"stage\": \"%s\", \"median\": %.9f, "
+                         "\"p10\": %.9f, \"p90\": %.9f, \"min\": %.9f, \"max\": %.9f, "
+                         "\"bytes\": %zu}",
+                    sep, workloads[w].name, stage_names[s], r->median, r->p10, r->p90, r->min,
+                    r->max, sizes[w]);
+            sep = ",\n";
+        }
+    }
+    fputs("\n  ]\n}\n", out);
+}
+
+// Prints the change in every median and returns the number of stages
+// slower than threshold percent
+static int compare(Stats results[][STAGE_COUNT], const size_t *sizes, const Baseline *base,
+                   size_t count, double threshold) {
+    int regressions = 0;
+    fprintf(stderr, "\n%-8s %-8s %12s %12s %8s\n", "workload", "stage", "baseline", "now", "change");
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+        if (!sizes[w]) continue;
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            const Baseline *b = NULL;
+            for (size_t i = 0; i < count && !b; i++) {
+                if (strcmp(base[i].workload, workloads[w].name) == 0 &&
+                    strcmp(base[i].stage, stage_names[s]) == 0) b = &base[i];
+            }
+            if (!b || b->median <= 0) continue;
+            double now = results[w][s].median;
+            double change = 100.0 * (now - b->median) / b->median;
+            int slower = change > threshold && b->median >= NOISE_FLOOR;
+            regressions += slower;
+            fprintf(stderr, "%-8s %-8s %12.6f %12.6f %+7.1f%%%s\n", workloads[w].name,
+                    stage_names[s], b->median, now, change, slower ? "  REGRESSION" : "");
+        }
+    }
+    if (regressions) fprintf(stderr, "%d regression(s) over %.1f%%\n", regressions, threshold);
+    return regressions;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--reps=<n>] [--scale=<factor>] [--only=<workload>] "
+                    "[--json=<file>] [--baseline=<json file>] [--threshold=<percent>]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int reps = DEFAULT_REPS;
+    double scale = 1.0;
+    double threshold = DEFAULT_THRESHOLD;
+    const char *only = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--reps=", 7) == 0) {
+            reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--scale=", 8) == 0) {
+            scale = atof(argv[i] + 8);
+        } else if (strncmp(argv[i], "--only=", 7) == 0 && argv[i][7]) {
+            only = argv[i] + 7;
+        } else if (strncmp(argv[i], "--json=", 7) == 0 && argv[i][7]) {
+            json_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0 && argv[i][11]) {
+            baseline_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = atof(argv[i] + 12);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (reps < 1 || scale <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Read first: the baseline may be the file about to be rewritten
+    size_t count = 0;
+    Baseline *base = baseline_path ? read_baseline(baseline_path, &count) : NULL;
+
+    OutputSink sink = { -1, discard, NULL };
+    Stats results[WORKLOAD_COUNT][STAGE_COUNT];
+    size_t sizes[WORKLOAD_COUNT];
+    double *samples = malloc((size_t)reps * sizeof(double));
+    memset(results, 0, sizeof(results));
+    memset(sizes, 0, sizeof(sizes));
+
+    fprintf(stderr, "%-8s %-8s %10s %12s %12s %12s\n", "workload", "stage", "bytes", "median",
+            "p10", "p90");
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+        if (only && strcmp(only, workloads[w].name) != 0) continue;
+        Text script = { malloc(BUFSIZ), 0, BUFSIZ };
+        workloads[w].generate(&script, (size_t)(1000000 * scale));
+        sizes[w] = script.length;
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            time_stage((Stage)s, &script, &sink);
+            for (int r = 0; r < reps; r++) samples[r] = time_stage((Stage)s, &script, &sink);
+            Stats *st = &results[w][s];
+            *st = summarize(samples, reps);
+            fprintf(stderr, "%-8s %-8s %10zu %12.6f %12.6f %12.6f\n", workloads[w].name,
+                    stage_names[s], sizes[w], st->median, st->p10, st->p90);
+        }
+        free(script.data);
+    }
+    free(samples);
+
+    int exit_code = EXIT_SUCCESS;
+    if (json_path) {
+        FILE *out = fopen(json_path, "w");
+        if (!out) {
+            perror("Error writing results");
+            return EXIT_FAILURE;
+        }
+        write_json(out, results, sizes, scale, reps);
+        if (fclose(out) != 0) {
+            perror("Error writing results");
+            exit_code = EXIT_FAILURE;
+        }
+    } else {
+        write_json(stdout, results, sizes, scale, reps);
+    }
+    if (base) {
+        if (compare(results, sizes, base, count, threshold) > 0) {
+            exit_code = EXIT_FAILURE;
+        }
+        free(base);
+    }
+    return exit_code;
+}
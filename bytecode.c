@@ -1,41 +1,561 @@
 // bytecode.c
+#define _GNU_SOURCE
 #include "bytecode.h"
+#include "error.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define INITIAL_INDEX_SIZE 64
 
 Bytecode *bytecode_new(void) {
-    Bytecode *bc = malloc(sizeof(Bytecode));
-    bc->code = NULL;
-    bc->code_size = 0;
-    bc->const_count = 0;
-    return bc;
+    return calloc(1, sizeof(Bytecode));
 }
 
 void bytecode_free(Bytecode *bc) {
+    if (bc->mapping) {
+        free(bc->constants);
+        free(bc->const_index.buckets);
+        free(bc->var_names);
+        free(bc->var_index.buckets);
+        free(bc->functions);
+        free(bc->func_index.buckets);
+        munmap(bc->mapping, bc->mapping_size);
+        free(bc);
+        return;
+    }
     free(bc->code);
     for (size_t i = 0; i < bc->const_count; i++) {
-        if (bc->constants[i].type == VAL_STR) {
-            free(bc->constants[i].str_val);
+        if (value_type(bc->constants[i]) == VAL_STR) {
+            free(value_as_str(bc->constants[i]));
         }
     }
+    free(bc->constants);
+    free(bc->const_index.buckets);
+    for (size_t i = 0; i < bc->var_count; i++) {
+        free(bc->var_names[i]);
+    }
+    free(bc->var_names);
+    free(bc->var_index.buckets);
+    for (size_t i = 0; i < bc->func_count; i++) {
+        free(bc->functions[i].name);
+    }
+    free(bc->functions);
+    free(bc->func_index.buckets);
+    free(bc->lines);
     free(bc);
 }
 
-int bytecode_new_constant(Bytecode *bc, Value value) {
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_int(int v) {
+    uint32_t h = (uint32_t)v;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_value(Value v) {
+    return value_type(v) == VAL_STR ? hash_string(value_as_str(v)) : hash_int(value_as_int(v));
+}
+
+static int values_equal(Value a, Value b) {
+    if (value_type(a) != value_type(b)) return 0;
+    return value_type(a) == VAL_STR ? strcmp(value_as_str(a), value_as_str(b)) == 0
+                                    : value_as_int(a) == value_as_int(b);
+}
+
+// Rebuilds the index at twice its size; count entries are rehashed via hash_at.
+static void index_grow(HashIndex *index, size_t count,
+                       uint32_t (*hash_at)(const Bytecode *, size_t),
+                       const Bytecode *bc) {
+    size_t size = index->size ? index->size * 2 : INITIAL_INDEX_SIZE;
+    uint32_t *buckets = calloc(size, sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        size_t b = hash_at(bc, i) & (size - 1);
+        while (buckets[b]) b = (b + 1) & (size - 1);
+        buckets[b] = (uint32_t)(i + 1);
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->size = size;
+}
+
+static uint32_t const_hash_at(const Bytecode *bc, size_t i) {
+    return hash_value(bc->constants[i]);
+}
+
+static uint32_t var_hash_at(const Bytecode *bc, size_t i) {
+    return hash_string(bc->var_names[i]);
+}
+
+static uint32_t func_hash_at(const Bytecode *bc, size_t i) {
+    return hash_string(bc->functions[i].name);
+}
+
+// Returns the pool index for value, adding it on first use. Strings are
+// copied, so the caller keeps ownership of the string.
+int bytecode_add_constant(Bytecode *bc, Value value) {
+    if ((bc->const_count + 1) * 2 > bc->const_index.size) {
+        index_grow(&bc->const_index, bc->const_count, const_hash_at, bc);
+    }
+    size_t mask = bc->const_index.size - 1;
+    size_t b = hash_value(value) & mask;
+    while (bc->const_index.buckets[b]) {
+        uint32_t idx = bc->const_index.buckets[b] - 1;
+        if (values_equal(bc->constants[idx], value)) {
+            return (int)idx;
+        }
+        b = (b + 1) & mask;
+    }
     if (bc->const_count >= MAX_CONSTANTS) {
-       fprintf(stderr, "Too many constants");
-        exit(EXIT_FAILURE);
+        error_raise("Too many constants");
+    }
+    if (bc->const_count >= bc->const_capacity) {
+        bc->const_capacity = bc->const_capacity ? bc->const_capacity * 2 : 16;
+        bc->constants = realloc(bc->constants, sizeof(Value) * bc->const_capacity);
+    }
+    if (value_type(value) == VAL_STR) {
+        value = value_str(strdup(value_as_str(value)));
     }
     bc->constants[bc->const_count] = value;
-    return bc->const_count++;
+    bc->const_index.buckets[b] = (uint32_t)(bc->const_count + 1);
+    return (int)bc->const_count++;
+}
+
+// Returns the dense slot index for a variable, assigning a new one on first use.
+int bytecode_resolve_var(Bytecode *bc, const char *name) {
+    if ((bc->var_count + 1) * 2 > bc->var_index.size) {
+        index_grow(&bc->var_index, bc->var_count, var_hash_at, bc);
+    }
+    size_t mask = bc->var_index.size - 1;
+    size_t b = hash_string(name) & mask;
+    while (bc->var_index.buckets[b]) {
+        uint32_t idx = bc->var_index.buckets[b] - 1;
+        if (strcmp(bc->var_names[idx], name) == 0) {
+            return (int)idx;
+        }
+        b = (b + 1) & mask;
+    }
+    if (bc->var_count >= MAX_VARS) {
+        error_raise("Too many variables");
+    }
+    if (bc->var_count >= bc->var_capacity) {
+        bc->var_capacity = bc->var_capacity ? bc->var_capacity * 2 : 16;
+        bc->var_names = realloc(bc->var_names, sizeof(char*) * bc->var_capacity);
+    }
+    bc->var_names[bc->var_count] = strdup(name);
+    bc->var_index.buckets[b] = (uint32_t)(bc->var_count + 1);
+    return (int)bc->var_count++;
+}
+
+// Returns the function's bucket in func_index: its entry, or the empty
+// bucket where it would go
+static size_t func_bucket(const Bytecode *bc, const char *name) {
+    size_t mask = bc->func_index.size - 1;
+    size_t b = hash_string(name) & mask;
+    while (bc->func_index.buckets[b] &&
+           strcmp(bc->functions[bc->func_index.buckets[b] - 1].name, name) != 0) {
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+// Returns the function's index, or -1 if it is not declared
+int bytecode_find_function(const Bytecode *bc, const char *name) {
+    if (!bc->func_index.size) return -1;
+    return (int)bc->func_index.buckets[func_bucket(bc, name)] - 1;
+}
+
+// Declares a function with its entry still unset; returns its index, or
+// -1 if the name is already taken
+int bytecode_add_function(Bytecode *bc, const char *name, uint16_t param_count) {
+    if ((bc->func_count + 1) * 2 > bc->func_index.size) {
+        index_grow(&bc->func_index, bc->func_count, func_hash_at, bc);
+    }
+    size_t b = func_bucket(bc, name);
+    if (bc->func_index.buckets[b]) return -1;
+    if (bc->func_count >= MAX_FUNCTIONS) {
+        error_raise("Too many functions");
+    }
+    if (bc->func_count >= bc->func_capacity) {
+        bc->func_capacity = bc->func_capacity ? bc->func_capacity * 2 : 16;
+        bc->functions = realloc(bc->functions, sizeof(Function) * bc->func_capacity);
+    }
+    bc->functions[bc->func_count] = (Function){ strdup(name), 0, param_count, param_count, 0 };
+    bc->func_index.buckets[b] = (uint32_t)(bc->func_count + 1);
+    return (int)bc->func_count++;
 }
 
 void emit_byte(Bytecode *bc, uint8_t byte) {
-    bc->code = realloc(bc->code, bc->code_size + 1);
+    if (bc->code_size >= bc->code_capacity) {
+        bc->code_capacity = bc->code_capacity ? bc->code_capacity * 2 : 256;
+        bc->code = realloc(bc->code, bc->code_capacity);
+    }
     bc->code[bc->code_size++] = byte;
 }
 
-void emit_op_const(Bytecode *bc, OpCode op, uint8_t const_index) {
+void bytecode_mark_line(Bytecode *bc, size_t line) {
+    LineRun *last = bc->line_count ? &bc->lines[bc->line_count - 1] : NULL;
+    if (last && last->line == line) return;
+    if (last && last->offset == bc->code_size) {
+        // Nothing was emitted for the previous line
+        last->line = (uint32_t)line;
+        if (bc->line_count > 1 && last[-1].line == line) bc->line_count--;
+        return;
+    }
+    if (bc->line_count >= bc->line_capacity) {
+        bc->line_capacity = bc->line_capacity ? bc->line_capacity * 2 : 64;
+        bc->lines = realloc(bc->lines, bc->line_capacity * sizeof(LineRun));
+    }
+    bc->lines[bc->line_count++] = (LineRun){ (uint32_t)bc->code_size, (uint32_t)line };
+}
+
+uint32_t bytecode_line_at(const Bytecode *bc, size_t offset) {
+    size_t lo = 0, hi = bc->line_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bc->lines[mid].offset <= offset) lo = mid + 1; else hi = mid;
+    }
+    return lo ? bc->lines[lo - 1].line : 0;
+}
+
+// Runs that collapse onto one instruction keep the first line; neighbours
+// that end up with the same line merge
+void bytecode_remap_lines(Bytecode *bc, const size_t *new_at) {
+    size_t n = 0;
+    for (size_t i = 0; i < bc->line_count; i++) {
+        LineRun run = { (uint32_t)new_at[bc->lines[i].offset], bc->lines[i].line };
+        if (n && (bc->lines[n - 1].offset == run.offset || bc->lines[n - 1].line == run.line)) continue;
+        bc->lines[n++] = run;
+    }
+    bc->line_count = n;
+}
+
+void emit_u16(Bytecode *bc, uint16_t value) {
+    emit_byte(bc, (uint8_t)(value >> 8));
+    emit_byte(bc, (uint8_t)(value & 0xff));
+}
+
+void emit_op_const(Bytecode *bc, OpCode op, uint16_t const_index) {
     emit_byte(bc, op);
-    emit_byte(bc, const_index);
+    emit_u16(bc, const_index);
+}
+
+// Total encoded size of an instruction (opcode byte plus operands)
+size_t opcode_length(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_LOAD:
+        case OP_STORE:
+        case OP_LOAD_SLOT:
+        case OP_STORE_SLOT:
+        case OP_ADD_CONST:
+        case OP_ADD_CONST_INT:
+        case OP_CALL:
+            return 3;
+        case OP_INC_SLOT:
+        case OP_INC_SLOT_INT:
+        case OP_JMP_LONG:
+        case OP_JMP_IF_FALSE_LONG:
+            return 5;
+        default:
+            return opcode_is_jump(op) ? 2 : 1;
+    }
+}
+
+void opcode_stack_effect(const Bytecode *bc, size_t ip, int *pops, int *pushes) {
+    const uint8_t *code = bc->code;
+    *pops = *pushes = 0;
+    switch (code[ip]) {
+        case OP_CONSTANT: case OP_LOAD: case OP_LOAD_SLOT:
+            *pushes = 1;
+            break;
+        case OP_STORE: case OP_STORE_SLOT: case OP_POP: case OP_RET:
+        case OP_JMP_IF_FALSE: case OP_JMP_IF_FALSE_LONG:
+            *pops = 1;
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_GT: case OP_LT: case OP_GTE: case OP_LTE: case OP_EQ: case OP_NEQ:
+        case OP_CONCAT:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_JMP_IF_NOT_GT: case OP_JMP_IF_NOT_LT: case OP_JMP_IF_NOT_GTE:
+        case OP_JMP_IF_NOT_LTE: case OP_JMP_IF_NOT_EQ: case OP_JMP_IF_NOT_NEQ:
+            *pops = 2;
+            break;
+        case OP_ADD_CONST: case OP_PRINT:
+            *pops = *pushes = 1;
+            break;
+        case OP_CALL:
+            *pops = bc->functions[read_u16(&code[ip + 1])].param_count;
+            *pushes = 1;
+            break;
+        default:            // OP_JMP, OP_JMP_LONG, OP_INC_SLOT, OP_HALT
+            break;
+    }
+}
+
+// One pass over all entry points; region[ip] records which one reached
+// each instruction
+int bytecode_stack_depths(const Bytecode *bc, uint32_t *max_depths) {
+    size_t size = bc->code_size;
+    const uint8_t *code = bc->code;
+    int *depth = malloc((size ? size : 1) * sizeof(int));
+    uint32_t *region = malloc((size ? size : 1) * sizeof(uint32_t));
+    size_t *work = malloc((size ? size : 1) * sizeof(size_t));
+    size_t work_count = 0;
+    for (size_t i = 0; i < size; i++) depth[i] = -1;
+    int ok = size > 0;
+    for (size_t i = 0; ok && i <= bc->func_count; i++) {
+        size_t entry = i ? bc->functions[i - 1].entry : 0;
+        max_depths[i] = 0;
+        ok = entry < size && depth[entry] < 0;
+        if (!ok) break;
+        depth[entry] = 0;
+        region[entry] = (uint32_t)i;
+        work[work_count++] = entry;
+    }
+    while (ok && work_count) {
+        size_t ip = work[--work_count];
+        uint8_t op = code[ip];
+        int d = depth[ip], pops, pushes;
+        opcode_stack_effect(bc, ip, &pops, &pushes);
+        if (d < pops || (op == OP_RET && d != 1)) {
+            ok = 0;
+            break;
+        }
+        int out = d - pops + pushes;
+        if ((uint32_t)out > max_depths[region[ip]]) max_depths[region[ip]] = (uint32_t)out;
+        size_t succ[2];
+        int succ_count = 0;
+        if (opcode_is_jump(op)) succ[succ_count++] = jump_target(code, ip);
+        if (op != OP_JMP && op != OP_JMP_LONG && op != OP_RET && op != OP_HALT) {
+            succ[succ_count++] = ip + opcode_length(op);
+        }
+        for (int i = 0; ok && i < succ_count; i++) {
+            size_t s = succ[i];
+            if (s >= size) {
+                ok = 0;
+            } else if (depth[s] < 0) {
+                depth[s] = out;
+                region[s] = region[ip];
+                work[work_count++] = s;
+            } else {
+                ok = depth[s] == out && region[s] == region[ip];
+            }
+        }
+    }
+    free(depth);
+    free(region);
+    free(work);
+    return ok ? 0 : -1;
+}
+
+static const char *const opcode_names[OP_COUNT] = {
+    [OP_CONSTANT] = "CONSTANT",
+    [OP_LOAD] = "LOAD",
+    [OP_STORE] = "STORE",
+    [OP_LOAD_SLOT] = "LOAD_SLOT",
+    [OP_STORE_SLOT] = "STORE_SLOT",
+    [OP_ADD] = "ADD",
+    [OP_SUB] = "SUB",
+    [OP_MUL] = "MUL",
+    [OP_DIV] = "DIV",
+    [OP_MOD] = "MOD",
+    [OP_GT] = "GT",
+    [OP_LT] = "LT",
+    [OP_GTE] = "GTE",
+    [OP_LTE] = "LTE",
+    [OP_EQ] = "EQ",
+    [OP_NEQ] = "NEQ",
+    [OP_CONCAT] = "CONCAT",
+    [OP_JMP] = "JMP",
+    [OP_JMP_IF_FALSE] = "JMP_IF_FALSE",
+    [OP_JMP_LONG] = "JMP_LONG",
+    [OP_JMP_IF_FALSE_LONG] = "JMP_IF_FALSE_LONG",
+    [OP_CALL] = "CALL",
+    [OP_RET] = "RET",
+    [OP_POP] = "POP",
+    [OP_PRINT] = "PRINT",
+    [OP_HALT] = "HALT",
+    [OP_INC_SLOT] = "INC_SLOT",
+    [OP_ADD_CONST] = "ADD_CONST",
+    [OP_JMP_IF_NOT_GT] = "JMP_IF_NOT_GT",
+    [OP_JMP_IF_NOT_LT] = "JMP_IF_NOT_LT",
+    [OP_JMP_IF_NOT_GTE] = "JMP_IF_NOT_GTE",
+    [OP_JMP_IF_NOT_LTE] = "JMP_IF_NOT_LTE",
+    [OP_JMP_IF_NOT_EQ] = "JMP_IF_NOT_EQ",
+    [OP_JMP_IF_NOT_NEQ] = "JMP_IF_NOT_NEQ",
+    [OP_ADD_INT] = "ADD_INT",
+    [OP_SUB_INT] = "SUB_INT",
+    [OP_MUL_INT] = "MUL_INT",
+    [OP_DIV_INT] = "DIV_INT",
+    [OP_MOD_INT] = "MOD_INT",
+    [OP_GT_INT] = "GT_INT",
+    [OP_LT_INT] = "LT_INT",
+    [OP_GTE_INT] = "GTE_INT",
+    [OP_LTE_INT] = "LTE_INT",
+    [OP_EQ_INT] = "EQ_INT",
+    [OP_NEQ_INT] = "NEQ_INT",
+    [OP_INC_SLOT_INT] = "INC_SLOT_INT",
+    [OP_ADD_CONST_INT] = "ADD_CONST_INT",
+    [OP_JMP_IF_NOT_GT_INT] = "JMP_IF_NOT_GT_INT",
+    [OP_JMP_IF_NOT_LT_INT] = "JMP_IF_NOT_LT_INT",
+    [OP_JMP_IF_NOT_GTE_INT] = "JMP_IF_NOT_GTE_INT",
+    [OP_JMP_IF_NOT_LTE_INT] = "JMP_IF_NOT_LTE_INT",
+    [OP_JMP_IF_NOT_EQ_INT] = "JMP_IF_NOT_EQ_INT",
+    [OP_JMP_IF_NOT_NEQ_INT] = "JMP_IF_NOT_NEQ_INT",
+};
+
+const char *opcode_name(uint8_t op) {
+    return op < OP_COUNT ? opcode_names[op] : "?";
+}
+
+// Jumps carry an offset relative to the end of the instruction: int8 for
+// the short forms, int32 for the _LONG forms
+int opcode_is_jump(uint8_t op) {
+    switch (op) {
+        case OP_JMP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_LONG:
+        case OP_JMP_IF_FALSE_LONG:
+        case OP_JMP_IF_NOT_GT:
+        case OP_JMP_IF_NOT_LT:
+        case OP_JMP_IF_NOT_GTE:
+        case OP_JMP_IF_NOT_LTE:
+        case OP_JMP_IF_NOT_EQ:
+        case OP_JMP_IF_NOT_NEQ:
+        case OP_JMP_IF_NOT_GT_INT:
+        case OP_JMP_IF_NOT_LT_INT:
+        case OP_JMP_IF_NOT_GTE_INT:
+        case OP_JMP_IF_NOT_LTE_INT:
+        case OP_JMP_IF_NOT_EQ_INT:
+        case OP_JMP_IF_NOT_NEQ_INT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int is_long_jump(uint8_t op) {
+    return op == OP_JMP_LONG || op == OP_JMP_IF_FALSE_LONG;
+}
+
+static void write_i32(uint8_t *p, int32_t value) {
+    uint32_t v = (uint32_t)value;
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+size_t jump_target(const uint8_t *code, size_t ip) {
+    if (is_long_jump(code[ip])) {
+        return ip + 5 + read_i32(&code[ip + 1]);
+    }
+    return ip + 2 + (int8_t)code[ip + 1];
+}
+
+// The caller guarantees a short jump's offset fits in int8
+void set_jump_target(uint8_t *code, size_t ip, size_t target) {
+    if (is_long_jump(code[ip])) {
+        write_i32(&code[ip + 1], (int32_t)(target - (ip + 5)));
+    } else {
+        code[ip + 1] = (uint8_t)(int8_t)(target - (ip + 2));
+    }
+}
+
+// Emits a forward jump with a placeholder target; returns the label to patch
+size_t emit_jump(Bytecode *bc, OpCode op) {
+    size_t at = bc->code_size;
+    emit_byte(bc, op == OP_JMP_IF_FALSE ? OP_JMP_IF_FALSE_LONG : OP_JMP_LONG);
+    for (int i = 0; i < 4; i++) emit_byte(bc, 0);
+    return at;
+}
+
+// Points the jump at label `at` to the current end of the code
+void patch_jump(Bytecode *bc, size_t at) {
+    set_jump_target(bc->code, at, bc->code_size);
+}
+
+// Emits a backward jump; its distance is known, so the short form is used when it fits
+void emit_loop(Bytecode *bc, size_t target) {
+    size_t at = bc->code_size;
+    if ((long)target - (long)(at + 2) >= INT8_MIN) {
+        emit_byte(bc, OP_JMP);
+        emit_byte(bc, 0);
+    } else {
+        emit_byte(bc, OP_JMP_LONG);
+        for (int i = 0; i < 4; i++) emit_byte(bc, 0);
+    }
+    set_jump_target(bc->code, at, target);
+}
+
+// Rewrites long jumps whose offset fits in int8 into the short form.
+// Shrinking only brings other jumps' targets closer, so a jump chosen for
+// shrinking keeps fitting; the pass repeats until nothing changes.
+void bytecode_relax_jumps(Bytecode *bc) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        size_t size = bc->code_size;
+        uint8_t *code = bc->code;
+        uint8_t *shrink = calloc(size + 1, 1);
+        for (size_t ip = 0; ip < size; ip += opcode_length(code[ip])) {
+            if (is_long_jump(code[ip])) {
+                long offset = (long)jump_target(code, ip) - (long)(ip + 2);
+                if (offset >= INT8_MIN && offset <= INT8_MAX) {
+                    shrink[ip] = 1;
+                    changed = 1;
+                }
+            }
+        }
+        if (!changed) {
+            free(shrink);
+            break;
+        }
+
+        size_t *new_at = malloc((size + 1) * sizeof(size_t));
+        uint8_t *out = malloc(size ? size : 1);
+        size_t out_size = 0;
+        for (size_t ip = 0; ip < size; ip += opcode_length(code[ip])) {
+            new_at[ip] = out_size;
+            if (shrink[ip]) {
+                out[out_size] = code[ip] == OP_JMP_LONG ? OP_JMP : OP_JMP_IF_FALSE;
+                out_size += 2;
+            } else {
+                memcpy(&out[out_size], &code[ip], opcode_length(code[ip]));
+                out_size += opcode_length(code[ip]);
+            }
+        }
+        new_at[size] = out_size;
+        for (size_t ip = 0; ip < size; ip += opcode_length(code[ip])) {
+            if (opcode_is_jump(code[ip])) {
+                set_jump_target(out, new_at[ip], new_at[jump_target(code, ip)]);
+            }
+        }
+        for (size_t i = 0; i < bc->func_count; i++) {
+            bc->functions[i].entry = (uint32_t)new_at[bc->functions[i].entry];
+        }
+        bytecode_remap_lines(bc, new_at);
+        free(bc->code);
+        bc->code = out;
+        bc->code_size = out_size;
+        bc->code_capacity = size ? size : 1;
+        free(new_at);
+        free(shrink);
+    }
 }
@@ -4,21 +4,21 @@
 
 #include <stdint.h>
 #include <stddef.h> // size_t
+#include "value.h"
 
 
-#define MAX_CONSTANTS 256
+// Constant and slot operands are 16-bit
+#define MAX_CONSTANTS 65536
+#define MAX_VARS 65536
+#define MAX_FUNCTIONS 65536
 
-typedef enum { VAL_INT, VAL_STR } ValueType;
-
-typedef struct {
-    ValueType type;
-    union { int int_val; char *str_val; };
-} Value;
 
 typedef enum {
     OP_CONSTANT,
     OP_LOAD,
     OP_STORE,
+    OP_LOAD_SLOT,
+    OP_STORE_SLOT,
     OP_ADD,
     OP_SUB,
     OP_MUL,
@@ -30,25 +30,145 @@ typedef enum {
     OP_LTE,
     OP_EQ,
     OP_NEQ,
+    OP_CONCAT,          // pop b, a; push a . b
     OP_JMP,
     OP_JMP_IF_FALSE,
-    OP_CALL,
-    OP_RET,
-    OP_PRINT,
-    OP_HALT
+    OP_JMP_LONG,
+    OP_JMP_IF_FALSE_LONG,
+    OP_CALL,            // func: call functions[func], arguments on the stack
+    OP_RET,             // pop the result, drop the frame, push the result
+    OP_POP,
+    OP_PRINT,           // pop a value, print it, push 1
+    OP_HALT,
+
+    // Superinstructions produced by the peephole pass
+    OP_INC_SLOT,        // slot, const: vars[slot] += constants[const]
+    OP_ADD_CONST,       // const: top += constants[const]
+    OP_JMP_IF_NOT_GT,   // offset: pop b, a; jump unless a > b
+    OP_JMP_IF_NOT_LT,
+    OP_JMP_IF_NOT_GTE,
+    OP_JMP_IF_NOT_LTE,
+    OP_JMP_IF_NOT_EQ,
+    OP_JMP_IF_NOT_NEQ,
+
+    // Int forms of the arithmetic and comparisons above. The VM quickens
+    // instructions into them in its own copy of the code at run time; they
+    // are never compiled or cached.
+    OP_ADD_INT,
+    OP_SUB_INT,
+    OP_MUL_INT,
+    OP_DIV_INT,
+    OP_MOD_INT,
+    OP_GT_INT,
+    OP_LT_INT,
+    OP_GTE_INT,
+    OP_LTE_INT,
+    OP_EQ_INT,
+    OP_NEQ_INT,
+    OP_INC_SLOT_INT,
+    OP_ADD_CONST_INT,
+    OP_JMP_IF_NOT_GT_INT,
+    OP_JMP_IF_NOT_LT_INT,
+    OP_JMP_IF_NOT_GTE_INT,
+    OP_JMP_IF_NOT_LTE_INT,
+    OP_JMP_IF_NOT_EQ_INT,
+    OP_JMP_IF_NOT_NEQ_INT,
+
+    OP_COUNT            // number of opcodes, not an instruction
 } OpCode;
 
+// A compiled function. Its frame holds the arguments in slots
+// 0..param_count-1, followed by its other locals.
+typedef struct {
+    char *name;
+    uint32_t entry;         // code offset of the first instruction
+    uint16_t param_count;
+    uint16_t local_count;   // parameters included
+    uint32_t max_depth;     // operand stack values the body needs at most
+} Function;
+
+// Source line table, run-length encoded: code from offset up to the next
+// run's offset was compiled from line
+typedef struct {
+    uint32_t offset;
+    uint32_t line;
+} LineRun;
+
+// Open-addressed hash index: each bucket holds an entry index + 1, 0 = empty
+typedef struct {
+    uint32_t *buckets;
+    size_t size;
+} HashIndex;
+
 typedef struct {
     uint8_t *code;
     size_t code_size;
-    Value constants[MAX_CONSTANTS];
+    size_t code_capacity;
+    Value *constants;   // interned: each int/string appears once
     size_t const_count;
+    size_t const_capacity;
+    HashIndex const_index;
+    char **var_names;   // slot index -> variable name (debugging/dynamic access)
+    size_t var_count;
+    size_t var_capacity;
+    HashIndex var_index;
+    Function *functions;
+    size_t func_count;
+    size_t func_capacity;
+    HashIndex func_index;
+    LineRun *lines;     // in offset order
+    size_t line_count;
+    size_t line_capacity;
+    uint32_t max_depth; // operand stack values the top level needs at most
+    void *mapping;      // backing file when loaded from a cache: code, lines
+    size_t mapping_size; // and strings point into it and are read-only
 } Bytecode;
 
 Bytecode *bytecode_new(void);
 void bytecode_free(Bytecode *bc);
-int bytecode_new_constant(Bytecode *bc, Value value);
+int bytecode_add_constant(Bytecode *bc, Value value);
+int bytecode_resolve_var(Bytecode *bc, const char *name);
+int bytecode_add_function(Bytecode *bc, const char *name, uint16_t param_count);
+int bytecode_find_function(const Bytecode *bc, const char *name);
 void emit_byte(Bytecode *bc, uint8_t byte);
-void emit_op_const(Bytecode *bc, OpCode op, uint8_t const_index);
+void emit_u16(Bytecode *bc, uint16_t value);
+void emit_op_const(Bytecode *bc, OpCode op, uint16_t const_index);
+// Code emitted from here on comes from line
+void bytecode_mark_line(Bytecode *bc, size_t line);
+// 0 when the offset has no line
+uint32_t bytecode_line_at(const Bytecode *bc, size_t offset);
+// Moves the runs after code was rewritten; new_at maps every old
+// instruction offset, and the old code size, to its new offset
+void bytecode_remap_lines(Bytecode *bc, const size_t *new_at);
+size_t opcode_length(uint8_t op);
+int opcode_is_jump(uint8_t op);
+const char *opcode_name(uint8_t op);
+// Operand stack effect of the instruction at ip as (pops, pushes)
+void opcode_stack_effect(const Bytecode *bc, size_t ip, int *pops, int *pushes);
+// Follows the operand stack depth from the top level and every function
+// entry, each starting empty, and stores the deepest it gets in
+// max_depths: [0] for the top level, [i + 1] for function i. Returns -1
+// when an instruction would pop below its frame, two paths reach an
+// instruction at different depths, OP_RET does not find exactly its
+// result, or control leaves the code or crosses into another function.
+int bytecode_stack_depths(const Bytecode *bc, uint32_t *max_depths);
+
+// Jumps are emitted in long form and shrunk afterwards by bytecode_relax_jumps
+size_t emit_jump(Bytecode *bc, OpCode op);
+void patch_jump(Bytecode *bc, size_t at);
+void emit_loop(Bytecode *bc, size_t target);
+void bytecode_relax_jumps(Bytecode *bc);
+size_t jump_target(const uint8_t *code, size_t ip);
+void set_jump_target(uint8_t *code, size_t ip, size_t target);
+
+// Operands are stored big-endian
+static inline uint16_t read_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline int32_t read_i32(const uint8_t *p) {
+    return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                     ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
 
 #endif // BYTECODE_H
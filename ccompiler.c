@@ -0,0 +1,713 @@
+// ccompiler.c
+#include "ccompiler.h"
+#include "bytecode.h"
+#include "rope.h"
+#include "vm.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Variables start out as int 0, and widen to a dynamic Value only when an
+// assignment can store a string in them; numeric code thus compiles to
+// plain ints. Types are inferred to a fixpoint before anything is written.
+typedef enum { CT_INT = 1, CT_STR = 2, CT_ANY = 3 } CType;
+
+typedef struct {
+    Bytecode *names;    // name -> slot, via the variable table
+    uint8_t *types;     // slot -> CType
+    size_t capacity;
+} Scope;
+
+typedef struct {
+    FILE *out;
+    Bytecode *program;  // function table: name -> index
+    ASTNode **defs;     // function index -> AST_FUNCTION
+    Scope *locals;      // function index -> parameters and locals
+    uint8_t *returns;   // function index -> CType of its results
+    Scope globals;
+    Scope *scope;       // scope of the code being walked
+    int func;           // function being walked, -1 at top level
+    int changed;        // inference widened a type this round
+    int indent;
+    int temps;          // temporaries named so far
+} CCompiler;
+
+// Runtime support emitted ahead of the program. Arithmetic wraps and
+// division fails exactly where the VM's does.
+static const char *prelude =
+    "#include <limits.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "enum { T_INT, T_STR, T_BUILT };\n"
+    "// Concatenation results share a growable buffer: appending to the\n"
+    "// string that covers all of it extends it in place\n"
+    "typedef struct { char *data; size_t used, capacity; } Buf;\n"
+    "typedef struct { size_t length; Buf *buf; } Built;\n"
+    "typedef struct { int type; union { int i; const char *s; Built *b; } as; } Value;\n"
+    "\n"
+    "static int call_depth;\n"
+    "\n"
+    "static inline Value vint(int i) { Value v = { T_INT, { 0 } }; v.as.i = i; return v; }\n"
+    "static inline Value vstr(const char *s) { Value v = { T_STR, { 0 } }; v.as.s = s; return v; }\n"
+    "static inline int php_add(int a, int b) { return (int)((unsigned)a + (unsigned)b); }\n"
+    "static inline int php_sub(int a, int b) { return (int)((unsigned)a - (unsigned)b); }\n"
+    "static inline int php_mul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }\n"
+    "static void division_by_zero(void) {\n"
+    "    fputs(\"Division by zero\", stderr);\n"
+    "    exit(1);\n"
+    "}\n"
+    "static inline int php_div(int a, int b) {\n"
+    "    if (b == 0) division_by_zero();\n"
+    "    return b == -1 ? (int)(0u - (unsigned)a) : a / b;\n"
+    "}\n"
+    "static inline int php_mod(int a, int b) {\n"
+    "    if (b == 0) division_by_zero();\n"
+    "    return b == -1 ? 0 : a % b;\n"
+    "}\n"
+    "static inline void print_int(int i) { printf(\"%d\", i); }\n"
+    "static inline void print_str(const char *s) { fputs(s, stdout); }\n"
+    "static inline void print_value(Value v) {\n"
+    "    if (v.type == T_INT) print_int(v.as.i);\n"
+    "    else if (v.type == T_STR) print_str(v.as.s);\n"
+    "    else fwrite(v.as.b->buf->data, 1, v.as.b->length, stdout);\n"
+    "}\n"
+    "static inline const char *text_of(Value v, size_t *length, char *digits) {\n"
+    "    if (v.type == T_BUILT) { *length = v.as.b->length; return v.as.b->buf->data; }\n"
+    "    if (v.type == T_STR) { *length = strlen(v.as.s); return v.as.s; }\n"
+    "    *length = (size_t)sprintf(digits, \"%d\", v.as.i);\n"
+    "    return digits;\n"
+    "}\n"
+    "static Value php_concat(Value a, Value b) {\n"
+    "    char a_digits[12], b_digits[12];\n"
+    "    size_t a_length, b_length;\n"
+    "    const char *a_text = text_of(a, &a_length, a_digits);\n"
+    "    text_of(b, &b_length, b_digits);\n"
+    "    Buf *buf = a.type == T_BUILT && a.as.b->buf->used == a_length ? a.as.b->buf : NULL;\n"
+    "    size_t length = a_length + b_length;\n"
+    "    if (!buf) {\n"
+    "        buf = malloc(sizeof(Buf));\n"
+    "        buf->capacity = length * 2 + 1;\n"
+    "        buf->data = malloc(buf->capacity);\n"
+    "        memcpy(buf->data, a_text, a_length);\n"
+    "        buf->used = a_length;\n"
+    "    } else if (length > buf->capacity) {\n"
+    "        buf->capacity = length * 2;\n"
+    "        buf->data = realloc(buf->data, buf->capacity);\n"
+    "    }\n"
+    "    // b's text may live in this same buffer, so fetch it after growing\n"
+    "    memcpy(buf->data + a_length, text_of(b, &b_length, b_digits), b_length);\n"
+    "    buf->used = length;\n"
+    "    Value v = { T_BUILT, { 0 } };\n"
+    "    v.as.b = malloc(sizeof(Built));\n"
+    "    v.as.b->length = length;\n"
+    "    v.as.b->buf = buf;\n"
+    "    return v;\n"
+    "}\n"
+    "static inline int php_space(char c) { return c == ' ' || (c >= '\\t' && c <= '\\r'); }\n"
+    "// Reads a string the way the VM's string_to_int does\n"
+    "static inline int php_number(const char *p, size_t length, int *whole) {\n"
+    "    const char *end = p + length, *digits;\n"
+    "    unsigned u = 0;\n"
+    "    while (p < end && php_space(*p)) p++;\n"
+    "    int negative = p < end && *p == '-';\n"
+    "    if (p < end && (*p == '-' || *p == '+')) p++;\n"
+    "    for (digits = p; p < end && *p >= '0' && *p <= '9'; p++) u = u * 10 + (unsigned)(*p - '0');\n"
+    "    if (whole) {\n"
+    "        int any = p > digits;\n"
+    "        while (p < end && php_space(*p)) p++;\n"
+    "        *whole = any && p == end;\n"
+    "    }\n"
+    "    return (int)(negative ? 0u - u : u);\n"
+    "}\n"
+    "static inline int php_int(Value v) {\n"
+    "    char digits[12];\n"
+    "    size_t length;\n"
+    "    if (v.type == T_INT) return v.as.i;\n"
+    "    const char *text = text_of(v, &length, digits);\n"
+    "    return php_number(text, length, NULL);\n"
+    "}\n"
+    "// Two strings compare by content, an int and a string by the number the\n"
+    "// string wholly spells, two ints by value\n"
+    "static inline int php_eq(Value a, Value b) {\n"
+    "    if (a.type == T_INT && b.type == T_INT) return a.as.i == b.as.i;\n"
+    "    char a_digits[12], b_digits[12];\n"
+    "    size_t a_length, b_length;\n"
+    "    const char *a_text = text_of(a, &a_length, a_digits);\n"
+    "    const char *b_text = text_of(b, &b_length, b_digits);\n"
+    "    if (a.type == T_INT || b.type == T_INT) {\n"
+    "        int whole, n = a.type == T_INT ? php_number(b_text, b_length, &whole)\n"
+    "                                       : php_number(a_text, a_length, &whole);\n"
+    "        return whole && n == (a.type == T_INT ? a.as.i : b.as.i);\n"
+    "    }\n"
+    "    return a_length == b_length && memcmp(a_text, b_text, a_length) == 0;\n"
+    "}\n"
+    "static inline void enter(const char *name) {\n"
+    "    if (call_depth == FRAMES_MAX) {\n"
+    "        fprintf(stderr, \"Stack overflow calling %s\", name);\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    call_depth++;\n"
+    "}\n";
+
+static void compile_error(const ASTNode *at, const char *fmt, const char *name) {
+    fprintf(stderr, "Compile error at %zu:%zu: ", at->line, at->column);
+    fprintf(stderr, fmt, name);
+    exit(EXIT_FAILURE);
+}
+
+static size_t resolve(Scope *s, const char *name) {
+    size_t slot = (size_t)bytecode_resolve_var(s->names, name);
+    if (slot >= s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 16;
+        s->types = realloc(s->types, capacity);
+        memset(s->types + s->capacity, 0, capacity - s->capacity);
+        s->capacity = capacity;
+    }
+    if (!s->types[slot]) s->types[slot] = CT_INT;
+    return slot;
+}
+
+static void widen(CCompiler *c, uint8_t *type, CType add) {
+    if ((*type | add) != *type) {
+        *type |= add;
+        c->changed = 1;
+    }
+}
+
+static int is_print(const ASTNode *e) {
+    return e->type == AST_FUNC_CALL && strcmp(e->as.func_call.name, "print") == 0 &&
+           e->as.func_call.arg_count == 1;
+}
+
+static CType expr_type(CCompiler *c, ASTNode *e) {
+    switch (e->type) {
+        case AST_LITERAL:
+            return e->as.literal.is_string ? CT_STR : CT_INT;
+        case AST_BINARY_OP:
+            return e->as.binary.op == T_DOT ? CT_STR : CT_INT;
+        case AST_VAR_REF:
+            return c->scope->types[resolve(c->scope, e->as.var_ref.name)];
+        case AST_FUNC_CALL:
+            if (is_print(e)) return CT_INT;
+            return c->returns[bytecode_find_function(c->program, e->as.func_call.name)];
+        default:
+            return CT_INT;
+    }
+}
+
+// Inference
+
+static void infer_list(CCompiler *c, ASTNodeList *list);
+
+static void infer_expr(CCompiler *c, ASTNode *e) {
+    switch (e->type) {
+        case AST_VAR_REF:
+            resolve(c->scope, e->as.var_ref.name);
+            break;
+        case AST_BINARY_OP:
+            infer_expr(c, e->as.binary.left);
+            infer_expr(c, e->as.binary.right);
+            break;
+        case AST_FUNC_CALL: {
+            for (size_t i = 0; i < e->as.func_call.arg_count; i++) infer_expr(c, e->as.func_call.args[i]);
+            if (is_print(e)) break;
+            int f = bytecode_find_function(c->program, e->as.func_call.name);
+            if (f < 0) compile_error(e, "Call to undefined function %s", e->as.func_call.name);
+            if (e->as.func_call.arg_count != c->program->functions[f].param_count) {
+                compile_error(e, "Wrong number of arguments to %s", e->as.func_call.name);
+            }
+            for (size_t i = 0; i < e->as.func_call.arg_count; i++) {
+                widen(c, &c->locals[f].types[i], expr_type(c, e->as.func_call.args[i]));
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void infer_stmt(CCompiler *c, ASTNode *s) {
+    switch (s->type) {
+        case AST_EXPR_STMT:
+            infer_expr(c, s->as.expr_stmt.expr);
+            break;
+        case AST_VAR_ASSIGN: {
+            infer_expr(c, s->as.var_assign.value);
+            size_t slot = resolve(c->scope, s->as.var_assign.name);
+            widen(c, &c->scope->types[slot], expr_type(c, s->as.var_assign.value));
+            break;
+        }
+        case AST_IF:
+            infer_expr(c, s->as.if_stmt.cond);
+            infer_list(c, s->as.if_stmt.then_branch->as.block.statements);
+            if (s->as.if_stmt.else_branch) infer_list(c, s->as.if_stmt.else_branch->as.block.statements);
+            break;
+        case AST_WHILE:
+            infer_expr(c, s->as.while_stmt.cond);
+            infer_list(c, s->as.while_stmt.body->as.block.statements);
+            break;
+        case AST_RETURN:
+            infer_expr(c, s->as.return_stmt.value);
+            if (c->func >= 0) widen(c, &c->returns[c->func], expr_type(c, s->as.return_stmt.value));
+            break;
+        default:
+            break;
+    }
+}
+
+static void infer_list(CCompiler *c, ASTNodeList *list) {
+    for (; list; list = list->next) infer_stmt(c, list->node);
+}
+
+// Emission
+
+static void put_indent(CCompiler *c) {
+    for (int i = 0; i < c->indent; i++) fputs("    ", c->out);
+}
+
+static void put_string_literal(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\' || ch == '?') {
+            fprintf(out, "\\%c", ch);
+        } else if (ch >= 0x20 && ch < 0x7f) {
+            fputc(ch, out);
+        } else {
+            fprintf(out, "\\%03o", ch);
+        }
+    }
+    fputc('"', out);
+}
+
+static void put_var(CCompiler *c, const char *name) {
+    size_t slot = resolve(c->scope, name);
+    fprintf(c->out, "%c%zu", c->func >= 0 ? 'l' : 'g', slot);
+}
+
+static void emit_as(CCompiler *c, ASTNode *e, CType want);
+static void emit_value(CCompiler *c, ASTNode *e);
+static void emit_int(CCompiler *c, ASTNode *e);
+static void emit_print(CCompiler *c, ASTNode *arg);
+
+static const char *type_name(CType t) {
+    return t == CT_INT ? "int" : "Value";
+}
+
+static int has_call(const ASTNode *e) {
+    switch (e->type) {
+        case AST_BINARY_OP:
+            return has_call(e->as.binary.left) || has_call(e->as.binary.right);
+        case AST_FUNC_CALL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// C leaves the order of operands and arguments unspecified while the VM
+// goes left to right. That shows once a call (which may print) meets
+// another operand that prints or fails; literals and variables do neither.
+static int unordered(const ASTNode *first, const ASTNode *then) {
+    int leaf = first->type == AST_LITERAL || first->type == AST_VAR_REF ||
+               then->type == AST_LITERAL || then->type == AST_VAR_REF;
+    return !leaf && (has_call(first) || has_call(then));
+}
+
+typedef void (*EmitFn)(CCompiler *c, ASTNode *e);
+
+// Declares a temporary holding e; the caller has opened a statement
+// expression for it
+static int put_temp(CCompiler *c, ASTNode *e, CType t, EmitFn emit) {
+    int temp = c->temps++;
+    fprintf(c->out, "%s t%d = ", type_name(t), temp);
+    emit(c, e);
+    fputs("; ", c->out);
+    return temp;
+}
+
+static void put_operand(CCompiler *c, ASTNode *e, int temp, EmitFn emit) {
+    if (temp >= 0) fprintf(c->out, "t%d", temp); else emit(c, e);
+}
+
+static void emit_call(CCompiler *c, ASTNode *e) {
+    int f = bytecode_find_function(c->program, e->as.func_call.name);
+    size_t n = e->as.func_call.arg_count;
+    ASTNode **args = e->as.func_call.args;
+    uint8_t *types = c->locals[f].types;
+    int *temps = malloc((n ? n : 1) * sizeof(int));
+    int opened = 0;
+    for (size_t i = 0; i < n; i++) {
+        int later = 0;
+        for (size_t j = i + 1; j < n; j++) later |= unordered(args[i], args[j]);
+        temps[i] = -1;
+        if (!later) continue;
+        if (!opened++) fputs("({ ", c->out);
+        temps[i] = put_temp(c, args[i], types[i], types[i] == CT_INT ? emit_int : emit_value);
+    }
+    fprintf(c->out, "f%d(", f);
+    for (size_t i = 0; i < n; i++) {
+        if (i) fputs(", ", c->out);
+        put_operand(c, args[i], temps[i], types[i] == CT_INT ? emit_int : emit_value);
+    }
+    fputc(')', c->out);
+    if (opened) fputs("; })", c->out);
+    free(temps);
+}
+
+static const char *binary_helper(TokenType op) {
+    switch (op) {
+        case T_PLUS:  return "php_add";
+        case T_MINUS: return "php_sub";
+        case T_STAR:  return "php_mul";
+        case T_SLASH: return "php_div";
+        case T_MOD:   return "php_mod";
+        default:      return NULL;
+    }
+}
+
+static const char *compare_op(TokenType op) {
+    switch (op) {
+        case T_GT:  return ">";
+        case T_LT:  return "<";
+        case T_GTE: return ">=";
+        case T_LTE: return "<=";
+        case T_EQ:  return "==";
+        case T_NEQ: return "!=";
+        default:    return NULL;
+    }
+}
+
+static void put_int(FILE *out, int value) {
+    if (value == INT_MIN) {
+        fputs("(-2147483647 - 1)", out);
+    } else if (value < 0) {
+        fprintf(out, "(%d)", value);
+    } else {
+        fprintf(out, "%d", value);
+    }
+}
+
+// Emits an operand of arithmetic or ordering, reading strings as numbers
+static void emit_number(CCompiler *c, ASTNode *e) {
+    if (expr_type(c, e) == CT_INT) {
+        emit_int(c, e);
+    } else if (e->type == AST_LITERAL) {
+        put_int(c->out, string_to_int(NULL, value_str(e->as.literal.str), NULL));
+    } else {
+        fputs("php_int(", c->out);
+        emit_value(c, e);
+        fputc(')', c->out);
+    }
+}
+
+// Emits e as a C int. Strings read as int give the same bits the VM's
+// value_as_int does; only conditions do that.
+static void emit_int(CCompiler *c, ASTNode *e) {
+    FILE *out = c->out;
+    switch (e->type) {
+        case AST_LITERAL:
+            if (e->as.literal.is_string) {
+                fputs("(int)(intptr_t)", out);
+                put_string_literal(out, e->as.literal.str);
+            } else {
+                put_int(out, e->as.literal.value);
+            }
+            break;
+        case AST_VAR_REF:
+            put_var(c, e->as.var_ref.name);
+            if (expr_type(c, e) != CT_INT) fputs(".as.i", out);
+            break;
+        case AST_BINARY_OP: {
+            TokenType op = e->as.binary.op;
+            ASTNode *l = e->as.binary.left, *r = e->as.binary.right;
+            if (op == T_DOT) {
+                emit_value(c, e);
+                fputs(".as.i", out);
+                break;
+            }
+            if ((op == T_EQ || op == T_NEQ) && ((expr_type(c, l) | expr_type(c, r)) & CT_STR)) {
+                int temp = -1;
+                if (unordered(l, r)) {
+                    fputs("({ ", out);
+                    temp = put_temp(c, l, CT_ANY, emit_value);
+                }
+                fputs(op == T_EQ ? "php_eq(" : "!php_eq(", out);
+                put_operand(c, l, temp, emit_value);
+                fputs(", ", out);
+                emit_value(c, r);
+                fputs(temp >= 0 ? "); })" : ")", out);
+                break;
+            }
+            int temp = -1;
+            if (unordered(l, r)) {
+                fputs("({ ", out);
+                temp = put_temp(c, l, CT_INT, emit_number);
+            }
+            const char *helper = binary_helper(op);
+            fprintf(out, helper ? "%s(" : "(", helper);
+            put_operand(c, l, temp, emit_number);
+            fprintf(out, helper ? ", " : " %s ", helper ? "" : compare_op(e->as.binary.op));
+            emit_number(c, r);
+            fputs(temp >= 0 ? "); })" : ")", out);
+            break;
+        }
+        case AST_FUNC_CALL:
+            if (is_print(e)) {
+                fputc('(', out);
+                emit_print(c, e->as.func_call.args[0]);
+                fputs(", 1)", out);
+            } else {
+                emit_call(c, e);
+                if (expr_type(c, e) != CT_INT) fputs(".as.i", out);
+            }
+            break;
+        default:
+            fputc('0', out);
+            break;
+    }
+}
+
+static void emit_value(CCompiler *c, ASTNode *e) {
+    CType t = expr_type(c, e);
+    if (e->type == AST_LITERAL && e->as.literal.is_string) {
+        fputs("vstr(", c->out);
+        put_string_literal(c->out, e->as.literal.str);
+        fputc(')', c->out);
+    } else if (t == CT_INT) {
+        fputs("vint(", c->out);
+        emit_int(c, e);
+        fputc(')', c->out);
+    } else if (e->type == AST_VAR_REF) {
+        put_var(c, e->as.var_ref.name);
+    } else if (e->type == AST_BINARY_OP) {
+        ASTNode *l = e->as.binary.left, *r = e->as.binary.right;
+        int temp = -1;
+        if (unordered(l, r)) {
+            fputs("({ ", c->out);
+            temp = put_temp(c, l, CT_ANY, emit_value);
+        }
+        fputs("php_concat(", c->out);
+        put_operand(c, l, temp, emit_value);
+        fputs(", ", c->out);
+        emit_value(c, r);
+        fputs(temp >= 0 ? "); })" : ")", c->out);
+    } else {
+        emit_call(c, e);
+    }
+}
+
+static void emit_as(CCompiler *c, ASTNode *e, CType want) {
+    if (want == CT_INT) emit_int(c, e); else emit_value(c, e);
+}
+
+static void emit_print(CCompiler *c, ASTNode *arg) {
+    if (arg->type == AST_LITERAL && arg->as.literal.is_string) {
+        fputs("print_str(", c->out);
+        put_string_literal(c->out, arg->as.literal.str);
+    } else if (expr_type(c, arg) == CT_INT) {
+        fputs("print_int(", c->out);
+        emit_int(c, arg);
+    } else {
+        fputs("print_value(", c->out);
+        emit_value(c, arg);
+    }
+    fputc(')', c->out);
+}
+
+static void emit_list(CCompiler *c, ASTNodeList *list);
+
+static void emit_stmt(CCompiler *c, ASTNode *s) {
+    FILE *out = c->out;
+    switch (s->type) {
+        case AST_EXPR_STMT:
+            put_indent(c);
+            if (is_print(s->as.expr_stmt.expr)) {
+                emit_print(c, s->as.expr_stmt.expr->as.func_call.args[0]);
+            } else {
+                fputs("(void)", out);
+                emit_int(c, s->as.expr_stmt.expr);
+            }
+            fputs(";\n", out);
+            break;
+        case AST_VAR_ASSIGN: {
+            size_t slot = resolve(c->scope, s->as.var_assign.name);
+            put_indent(c);
+            put_var(c, s->as.var_assign.name);
+            fputs(" = ", out);
+            emit_as(c, s->as.var_assign.value, c->scope->types[slot]);
+            fputs(";\n", out);
+            break;
+        }
+        case AST_IF:
+            put_indent(c);
+            fputs("if (", out);
+            emit_int(c, s->as.if_stmt.cond);
+            fputs(") {\n", out);
+            emit_list(c, s->as.if_stmt.then_branch->as.block.statements);
+            if (s->as.if_stmt.else_branch) {
+                put_indent(c);
+                fputs("} else {\n", out);
+                emit_list(c, s->as.if_stmt.else_branch->as.block.statements);
+            }
+            put_indent(c);
+            fputs("}\n", out);
+            break;
+        case AST_WHILE:
+            put_indent(c);
+            fputs("while (", out);
+            emit_int(c, s->as.while_stmt.cond);
+            fputs(") {\n", out);
+            emit_list(c, s->as.while_stmt.body->as.block.statements);
+            put_indent(c);
+            fputs("}\n", out);
+            break;
+        case AST_RETURN:
+            put_indent(c);
+            if (c->func < 0) {
+                // A top-level return ends the script
+                fputs("(void)", out);
+                emit_int(c, s->as.return_stmt.value);
+                fputs(";\n", out);
+                put_indent(c);
+                fputs("return 0;\n", out);
+            } else {
+                fputs("return (result_ = ", out);
+                emit_as(c, s->as.return_stmt.value, c->returns[c->func]);
+                fputs(", call_depth--, result_);\n", out);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void emit_list(CCompiler *c, ASTNodeList *list) {
+    c->indent++;
+    for (; list; list = list->next) {
+        if (list->node->type != AST_FUNCTION) emit_stmt(c, list->node);
+    }
+    c->indent--;
+}
+
+static void emit_signature(CCompiler *c, int f) {
+    const ASTNode *fn = c->defs[f];
+    fprintf(c->out, "static %s f%d(", type_name(c->returns[f]), f);
+    for (size_t i = 0; i < fn->as.func_def.param_count; i++) {
+        fprintf(c->out, "%s%s l%zu", i ? ", " : "", type_name(c->locals[f].types[i]), i);
+    }
+    if (!fn->as.func_def.param_count) fputs("void", c->out);
+    fputc(')', c->out);
+}
+
+static void emit_function(CCompiler *c, int f) {
+    ASTNode *fn = c->defs[f];
+    Scope *s = &c->locals[f];
+    c->scope = s;
+    c->func = f;
+    fprintf(c->out, "// %s\n", fn->as.func_def.name);
+    emit_signature(c, f);
+    fputs(" {\n", c->out);
+    fprintf(c->out, "    %s result_;\n", type_name(c->returns[f]));
+    for (size_t i = fn->as.func_def.param_count; i < s->names->var_count; i++) {
+        fprintf(c->out, "    %s l%zu = %s; // %s\n", type_name(s->types[i]), i,
+                s->types[i] == CT_INT ? "0" : "{ 0 }", s->names->var_names[i]);
+    }
+    fprintf(c->out, "    enter(\"%s\");\n", fn->as.func_def.name);
+    emit_list(c, fn->as.func_def.body->as.block.statements);
+    // Falling off the end returns 0
+    fprintf(c->out, "    return (result_ = %s, call_depth--, result_);\n}\n\n",
+            c->returns[f] == CT_INT ? "0" : "vint(0)");
+}
+
+static void walk_all(CCompiler *c, ASTNode *program,
+                     void (*walk)(CCompiler *, ASTNodeList *)) {
+    c->scope = &c->globals;
+    c->func = -1;
+    walk(c, program->as.program.statements);
+    for (size_t f = 0; f < c->program->func_count; f++) {
+        c->scope = &c->locals[f];
+        c->func = (int)f;
+        walk(c, c->defs[f]->as.func_def.body->as.block.statements);
+    }
+}
+
+static void infer_top(CCompiler *c, ASTNodeList *list) {
+    for (; list; list = list->next) {
+        if (list->node->type != AST_FUNCTION) infer_stmt(c, list->node);
+    }
+}
+
+void emit_c(ASTNode *ast, FILE *out) {
+    CCompiler c = { 0 };
+    c.out = out;
+    c.program = bytecode_new();
+    c.globals.names = bytecode_new();
+
+    // Declare functions and their parameters, as compile() does
+    size_t capacity = 0;
+    for (ASTNodeList *l = ast->as.program.statements; l; l = l->next) {
+        ASTNode *fn = l->node;
+        if (fn->type != AST_FUNCTION) continue;
+        if (fn->as.func_def.param_count > UINT16_MAX ||
+            bytecode_add_function(c.program, fn->as.func_def.name,
+                                  (uint16_t)fn->as.func_def.param_count) < 0) {
+            compile_error(fn, "Cannot redeclare function %s", fn->as.func_def.name);
+        }
+        size_t f = c.program->func_count - 1;
+        if (f >= capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            c.defs = realloc(c.defs, sizeof(ASTNode*) * capacity);
+            c.locals = realloc(c.locals, sizeof(Scope) * capacity);
+            c.returns = realloc(c.returns, capacity);
+        }
+        c.defs[f] = fn;
+        c.locals[f] = (Scope){ bytecode_new(), NULL, 0 };
+        c.returns[f] = CT_INT;
+        for (size_t i = 0; i < fn->as.func_def.param_count; i++) {
+            if (bytecode_resolve_var(c.locals[f].names, fn->as.func_def.params[i]) != (int)i) {
+                compile_error(fn, "Duplicate parameter %s", fn->as.func_def.params[i]);
+            }
+            resolve(&c.locals[f], fn->as.func_def.params[i]);
+        }
+    }
+
+    do {
+        c.changed = 0;
+        walk_all(&c, ast, infer_top);
+    } while (c.changed);
+
+    fprintf(out, "// Generated by phpc --emit-c\n#define FRAMES_MAX %d\n%s\n", FRAMES_MAX, prelude);
+    for (size_t i = 0; i < c.globals.names->var_count; i++) {
+        fprintf(out, "static %s g%zu; // %s\n", type_name(c.globals.types[i]), i,
+                c.globals.names->var_names[i]);
+    }
+    fputc('\n', out);
+    for (size_t f = 0; f < c.program->func_count; f++) {
+        emit_signature(&c, (int)f);
+        fputs(";\n", out);
+    }
+    fputc('\n', out);
+    for (size_t f = 0; f < c.program->func_count; f++) emit_function(&c, (int)f);
+
+    c.scope = &c.globals;
+    c.func = -1;
+    fputs("int main(void) {\n", out);
+    emit_list(&c, ast->as.program.statements);
+    fputs("    return 0;\n}\n", out);
+
+    for (size_t f = 0; f < c.program->func_count; f++) {
+        bytecode_free(c.locals[f].names);
+        free(c.locals[f].types);
+    }
+    free(c.locals);
+    free(c.defs);
+    free(c.returns);
+    bytecode_free(c.globals.names);
+    free(c.globals.types);
+    bytecode_free(c.program);
+}
@@ -0,0 +1,12 @@
+// ccompiler.h
+#ifndef CCOMPILER_H
+#define CCOMPILER_H
+
+#include <stdio.h>
+#include "ast.h"
+
+// Writes a standalone C translation unit with the same output and exit
+// status as running the program on the stack VM
+void emit_c(ASTNode *ast, FILE *out);
+
+#endif // CCOMPILER_H
@@ -1,72 +1,181 @@
 // compiler.c
 #define _GNU_SOURCE
 #include "compiler.h"
+#include "error.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-static void compile_program(ASTNode *program, Bytecode *bc);
-static void compile_statement(ASTNode *stmt, Bytecode *bc);
-static void compile_block(ASTNode *block, Bytecode *bc);
-static void compile_expression(ASTNode *expr, Bytecode *bc);
+// Slot operands index the current frame: the globals at top level, the
+// function's parameters and locals inside a function body.
+typedef struct {
+    Bytecode *bc;
+    int in_function;
+    char **locals;          // slot -> name, while compiling a function
+    size_t local_count;
+    size_t local_capacity;
+} Compiler;
 
+static void compile_program(ASTNode *program, Compiler *c);
+static void compile_function(ASTNode *fn, Compiler *c);
+static void compile_statement(ASTNode *stmt, Compiler *c);
+static void compile_block(ASTNode *block, Compiler *c);
+static void compile_expression(ASTNode *expr, Compiler *c);
+
+__attribute__((noreturn))
+static void compile_error(const ASTNode *at, const char *fmt, const char *name) {
+    char what[ERROR_MESSAGE_MAX];
+    snprintf(what, sizeof(what), fmt, name);
+    error_raise("Compile error at %zu:%zu: %s", at->line, at->column, what);
+}
+
+// Records how deep each function's operand stack gets, so calls can
+// reserve that much; the peephole pass only ever makes it shallower
+static void set_max_depths(Bytecode *bc) {
+    uint32_t *max_depths = malloc((bc->func_count + 1) * sizeof(uint32_t));
+    if (bytecode_stack_depths(bc, max_depths) != 0) {
+        free(max_depths);
+        bytecode_free(bc);
+        error_raise("Compile error: unbalanced operand stack");
+    }
+    bc->max_depth = max_depths[0];
+    for (size_t i = 0; i < bc->func_count; i++) bc->functions[i].max_depth = max_depths[i + 1];
+    free(max_depths);
+}
+
+// Top-level code comes first and ends with OP_HALT; function bodies follow
 Bytecode *compile(ASTNode *ast) {
-    Bytecode *bc = bytecode_new();
-    compile_program(ast, bc);
-    emit_byte(bc, OP_HALT);
+    // On the heap, since the handler reads locals, which add_local moves
+    // after setjmp; c itself does not change
+    Compiler *c = calloc(1, sizeof(Compiler));
+    c->bc = bytecode_new();
+    ErrorTrap trap;
+    error_trap(&trap);
+    if (setjmp(trap.env)) {
+        free(c->locals);
+        bytecode_free(c->bc);
+        free(c);
+        error_rethrow(&trap);
+    }
+    compile_program(ast, c);
+    error_untrap(&trap);
+    Bytecode *bc = c->bc;
+    free(c->locals);
+    free(c);
+    bytecode_relax_jumps(bc);
+    set_max_depths(bc);
     return bc;
 }
 
-static void compile_program(ASTNode *program, Bytecode *bc) {
-    ASTNodeList *cur = program->as.program;
-    while (cur) {
-        compile_statement(cur->node, bc);
-        cur = cur->next;
+static void compile_program(ASTNode *program, Compiler *c) {
+    // Declare every function first so calls resolve to an index even
+    // before the definition
+    for (ASTNodeList *cur = program->as.program.statements; cur; cur = cur->next) {
+        ASTNode *fn = cur->node;
+        if (fn->type != AST_FUNCTION) continue;
+        if (fn->as.func_def.param_count > UINT16_MAX ||
+            bytecode_add_function(c->bc, fn->as.func_def.name,
+                                  (uint16_t)fn->as.func_def.param_count) < 0) {
+            compile_error(fn, "Cannot redeclare function %s", fn->as.func_def.name);
+        }
+    }
+    for (ASTNodeList *cur = program->as.program.statements; cur; cur = cur->next) {
+        if (cur->node->type != AST_FUNCTION) compile_statement(cur->node, c);
+    }
+    emit_byte(c->bc, OP_HALT);
+    for (ASTNodeList *cur = program->as.program.statements; cur; cur = cur->next) {
+        if (cur->node->type == AST_FUNCTION) compile_function(cur->node, c);
+    }
+}
+
+static int find_local(const Compiler *c, const char *name) {
+    for (size_t i = 0; i < c->local_count; i++) {
+        if (strcmp(c->locals[i], name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static int add_local(Compiler *c, const char *name) {
+    if (c->local_count >= MAX_VARS) {
+        error_raise("Too many variables");
+    }
+    if (c->local_count >= c->local_capacity) {
+        c->local_capacity = c->local_capacity ? c->local_capacity * 2 : 16;
+        c->locals = realloc(c->locals, sizeof(char*) * c->local_capacity);
+    }
+    c->locals[c->local_count] = (char *)name;
+    return (int)c->local_count++;
+}
+
+static int resolve_slot(Compiler *c, const char *name) {
+    if (!c->in_function) return bytecode_resolve_var(c->bc, name);
+    int slot = find_local(c, name);
+    return slot >= 0 ? slot : add_local(c, name);
+}
+
+static void compile_function(ASTNode *fn, Compiler *c) {
+    int idx = bytecode_find_function(c->bc, fn->as.func_def.name);
+    c->bc->functions[idx].entry = (uint32_t)c->bc->code_size;
+    c->in_function = 1;
+    c->local_count = 0;
+    for (size_t i = 0; i < fn->as.func_def.param_count; i++) {
+        if (find_local(c, fn->as.func_def.params[i]) >= 0) {
+            compile_error(fn, "Duplicate parameter %s", fn->as.func_def.params[i]);
+        }
+        add_local(c, fn->as.func_def.params[i]);
     }
+    compile_block(fn->as.func_def.body, c);
+    // Falling off the end returns 0
+    emit_op_const(c->bc, OP_CONSTANT, (uint16_t)bytecode_add_constant(c->bc, value_int(0)));
+    emit_byte(c->bc, OP_RET);
+    c->bc->functions[idx].local_count = (uint16_t)c->local_count;
+    c->in_function = 0;
+}
+
+// print() is compiled to OP_PRINT, which leaves 1 on the stack as PHP's
+// print returns 1
+static int is_print(const ASTNode *expr) {
+    return expr->type == AST_FUNC_CALL && strcmp(expr->as.func_call.name, "print") == 0 &&
+           expr->as.func_call.arg_count == 1;
 }
 
-static void compile_statement(ASTNode *stmt, Bytecode *bc) {
+static void compile_statement(ASTNode *stmt, Compiler *c) {
+    Bytecode *bc = c->bc;
+    bytecode_mark_line(bc, stmt->line);
     switch (stmt->type) {
         case AST_EXPR_STMT:
-            compile_expression(stmt->as.expr_stmt.expr, bc);
+            compile_expression(stmt->as.expr_stmt.expr, c);
+            emit_byte(bc, OP_POP);
             break;
         case AST_VAR_ASSIGN: {
-            compile_expression(stmt->as.var_assign.value, bc);
-            Value v = { .type = VAL_STR, .str_val = strdup(stmt->as.var_assign.name) };
-            int idx = bytecode_new_constant(bc, v);
-            emit_op_const(bc, OP_STORE, (uint8_t)idx);
+            compile_expression(stmt->as.var_assign.value, c);
+            int slot = resolve_slot(c, stmt->as.var_assign.name);
+            emit_op_const(bc, OP_STORE_SLOT, (uint16_t)slot);
             break;
         }
         case AST_IF: {
-            compile_expression(stmt->as.if_stmt.cond, bc);
-            size_t jmpIf = bc->code_size;
-            emit_byte(bc, OP_JMP_IF_FALSE);
-            emit_byte(bc, 0);
-            compile_block(stmt->as.if_stmt.then_branch, bc);
-            size_t jmp = bc->code_size;
-            emit_byte(bc, OP_JMP);
-            emit_byte(bc, 0);
-            bc->code[jmpIf+1] = (uint8_t)(bc->code_size - (jmpIf + 2));
+            compile_expression(stmt->as.if_stmt.cond, c);
+            size_t jmpIf = emit_jump(bc, OP_JMP_IF_FALSE);
+            compile_block(stmt->as.if_stmt.then_branch, c);
+            size_t jmp = emit_jump(bc, OP_JMP);
+            patch_jump(bc, jmpIf);
             if (stmt->as.if_stmt.else_branch) {
-                compile_block(stmt->as.if_stmt.else_branch, bc);
+                compile_block(stmt->as.if_stmt.else_branch, c);
             }
-            bc->code[jmp+1] = (uint8_t)(bc->code_size - (jmp + 2));
+            patch_jump(bc, jmp);
             break;
         }
         case AST_WHILE: {
             size_t loopStart = bc->code_size;
-            compile_expression(stmt->as.while_stmt.cond, bc);
-            size_t exitJump = bc->code_size;
-            emit_byte(bc, OP_JMP_IF_FALSE);
-            emit_byte(bc, 0);
-            compile_block(stmt->as.while_stmt.body, bc);
-            emit_byte(bc, OP_JMP);
-            emit_byte(bc, (uint8_t)(loopStart - (bc->code_size + 1)));
-            bc->code[exitJump+1] = (uint8_t)(bc->code_size - (exitJump + 2));
+            compile_expression(stmt->as.while_stmt.cond, c);
+            size_t exitJump = emit_jump(bc, OP_JMP_IF_FALSE);
+            compile_block(stmt->as.while_stmt.body, c);
+            emit_loop(bc, loopStart);
+            patch_jump(bc, exitJump);
             break;
         }
         case AST_RETURN:
-            compile_expression(stmt->as.return_stmt.value, bc);
+            compile_expression(stmt->as.return_stmt.value, c);
             emit_byte(bc, OP_RET);
             break;
         default:
@@ -74,38 +183,34 @@ static void compile_statement(ASTNode *stmt, Bytecode *bc) {
     }
 }
 
-static void compile_block(ASTNode *block, Bytecode *bc) {
+static void compile_block(ASTNode *block, Compiler *c) {
     ASTNodeList *cur = block->as.block.statements;
     while (cur) {
-        compile_statement(cur->node, bc);
+        compile_statement(cur->node, c);
         cur = cur->next;
     }
 }
 
-static void compile_expression(ASTNode *expr, Bytecode *bc) {
+// Expressions mark their lines too, for those spanning several
+static void compile_expression(ASTNode *expr, Compiler *c) {
+    Bytecode *bc = c->bc;
+    bytecode_mark_line(bc, expr->line);
     switch (expr->type) {
         case AST_LITERAL: {
-            Value v;
-            if (expr->as.literal.is_string) {
-                v.type = VAL_STR;
-                v.str_val = strdup(expr->as.literal.str);
-            } else {
-                v.type = VAL_INT;
-                v.int_val = expr->as.literal.value;
-            }
-            int idx = bytecode_new_constant(bc, v);
-            emit_op_const(bc, OP_CONSTANT, (uint8_t)idx);
+            Value v = expr->as.literal.is_string ? value_str(expr->as.literal.str)
+                                                 : value_int(expr->as.literal.value);
+            int idx = bytecode_add_constant(bc, v);
+            emit_op_const(bc, OP_CONSTANT, (uint16_t)idx);
             break;
         }
         case AST_VAR_REF: {
-            Value v = { .type = VAL_STR, .str_val = strdup(expr->as.var_ref.name) };
-            int idx = bytecode_new_constant(bc, v);
-            emit_op_const(bc, OP_LOAD, (uint8_t)idx);
+            int slot = resolve_slot(c, expr->as.var_ref.name);
+            emit_op_const(bc, OP_LOAD_SLOT, (uint16_t)slot);
             break;
         }
         case AST_BINARY_OP:
-            compile_expression(expr->as.binary.left, bc);
-            compile_expression(expr->as.binary.right, bc);
+            compile_expression(expr->as.binary.left, c);
+            compile_expression(expr->as.binary.right, c);
             switch (expr->as.binary.op) {
                 case T_PLUS:  emit_byte(bc, OP_ADD); break;
                 case T_MINUS: emit_byte(bc, OP_SUB); break;
@@ -118,15 +223,29 @@ static void compile_expression(ASTNode *expr, Bytecode *bc) {
                 case T_LTE:   emit_byte(bc, OP_LTE); break;
                 case T_EQ:    emit_byte(bc, OP_EQ);  break;
                 case T_NEQ:   emit_byte(bc, OP_NEQ); break;
+                case T_DOT:   emit_byte(bc, OP_CONCAT); break;
                 default: break;
             }
             break;
-        case AST_FUNC_CALL:
-            if (strcmp(expr->as.func_call.name, "print")==0 && expr->as.func_call.arg_count==1) {
-                compile_expression(expr->as.func_call.args[0], bc);
+        case AST_FUNC_CALL: {
+            if (is_print(expr)) {
+                compile_expression(expr->as.func_call.args[0], c);
                 emit_byte(bc, OP_PRINT);
+                break;
             }
+            int idx = bytecode_find_function(bc, expr->as.func_call.name);
+            if (idx < 0) {
+                compile_error(expr, "Call to undefined function %s", expr->as.func_call.name);
+            }
+            if (expr->as.func_call.arg_count != bc->functions[idx].param_count) {
+                compile_error(expr, "Wrong number of arguments to %s", expr->as.func_call.name);
+            }
+            for (size_t i = 0; i < expr->as.func_call.arg_count; i++) {
+                compile_expression(expr->as.func_call.args[i], c);
+            }
+            emit_op_const(bc, OP_CALL, (uint16_t)idx);
             break;
+        }
         default:
             break;
     }
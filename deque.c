@@ -0,0 +1,61 @@
+// deque.c
+#include "deque.h"
+#include <stdlib.h>
+
+// Orderings follow Le et al., "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP 2013)
+
+void deque_init(WorkDeque *d, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size *= 2;
+    d->top = 0;
+    d->bottom = 0;
+    d->items = malloc(size * sizeof(size_t));
+    d->mask = size - 1;
+}
+
+void deque_free(WorkDeque *d) {
+    free(d->items);
+    d->items = NULL;
+}
+
+int deque_push(WorkDeque *d, size_t item) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if ((size_t)(b - t) > d->mask) return -1;
+    __atomic_store_n(&d->items[(size_t)b & d->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int deque_pop(WorkDeque *d, size_t *item) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *item = __atomic_load_n(&d->items[(size_t)b & d->mask], __ATOMIC_RELAXED);
+    if (t < b) return 1;
+    // The last item: race the thieves for it
+    int won = __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+}
+
+int deque_steal(WorkDeque *d, size_t *item) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return 0;
+    size_t x = __atomic_load_n(&d->items[(size_t)t & d->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    *item = x;
+    return 1;
+}
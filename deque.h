@@ -0,0 +1,31 @@
+// deque.h
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stddef.h>
+
+// Chase-Lev work-stealing deque of job indices, fixed capacity. The owning
+// thread pushes and pops at the bottom; any other thread steals from the
+// top. Lock-free, on GCC __atomic builtins. Thieves write top and the
+// owner writes bottom, so each gets a cache line of its own.
+typedef struct {
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    size_t *items;
+    size_t mask;        // capacity - 1, capacity a power of two
+} WorkDeque;
+
+// Room for capacity items at once
+void deque_init(WorkDeque *d, size_t capacity);
+void deque_free(WorkDeque *d);
+
+// Owner only. Push fails (returns -1) when the deque is full.
+int deque_push(WorkDeque *d, size_t item);
+// Returns 1 with the newest item, 0 when empty
+int deque_pop(WorkDeque *d, size_t *item);
+
+// Any thread. Returns 1 with the oldest item, 0 when empty, -1 when it
+// lost a race for the item and should try again.
+int deque_steal(WorkDeque *d, size_t *item);
+
+#endif // DEQUE_H
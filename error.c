@@ -0,0 +1,45 @@
+// error.c
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static __thread ErrorTrap *innermost;
+
+void error_trap(ErrorTrap *trap) {
+    trap->outer = innermost;
+    trap->message[0] = '\0';
+    innermost = trap;
+}
+
+void error_untrap(ErrorTrap *trap) {
+    innermost = trap->outer;
+}
+
+__attribute__((noreturn))
+static void deliver(const char *message) {
+    ErrorTrap *trap = innermost;
+    if (!trap) {
+        fputs(message, stderr);
+        exit(EXIT_FAILURE);
+    }
+    innermost = trap->outer;
+    snprintf(trap->message, sizeof(trap->message), "%s", message);
+    longjmp(trap->env, 1);
+}
+
+void error_raise(const char *fmt, ...) {
+    char message[ERROR_MESSAGE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+    deliver(message);
+}
+
+void error_rethrow(const ErrorTrap *trap) {
+    char message[ERROR_MESSAGE_MAX];
+    memcpy(message, trap->message, sizeof(message));
+    deliver(message);
+}
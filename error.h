@@ -0,0 +1,39 @@
+// error.h
+#ifndef ERROR_H
+#define ERROR_H
+
+#include <setjmp.h>
+
+// Longest error message kept by a trap, terminator included
+#define ERROR_MESSAGE_MAX 256
+
+// Fatal errors of the front end (syntax errors, compile errors, limits).
+// Without a trap the message goes to stderr and the process exits, as the
+// command line tool expects. An embedder installs a trap instead and gets
+// control back with the message. Traps nest and are per thread:
+//
+//     ErrorTrap trap;
+//     error_trap(&trap);
+//     if (setjmp(trap.env)) { /* trap.message holds the error */ }
+//     ...
+//     error_untrap(&trap);
+//
+// Locals changed after setjmp and read in the handler must be volatile.
+typedef struct ErrorTrap {
+    jmp_buf env;
+    struct ErrorTrap *outer;
+    char message[ERROR_MESSAGE_MAX];
+} ErrorTrap;
+
+void error_trap(ErrorTrap *trap);
+// Removes trap, which must be the innermost one
+void error_untrap(ErrorTrap *trap);
+
+// Jumps to the innermost trap, removing it, or prints and exits
+__attribute__((noreturn, format(printf, 1, 2)))
+void error_raise(const char *fmt, ...);
+// Passes an error caught by trap on to the next trap out
+__attribute__((noreturn))
+void error_rethrow(const ErrorTrap *trap);
+
+#endif // ERROR_H
@@ -0,0 +1,558 @@
+// jit.c
+#define _GNU_SOURCE
+#include "jit.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Baseline template JIT for loops. Each bytecode instruction becomes a
+// fixed x86-64 sequence; the operand stack lives in registers, its depth
+// at every instruction being known statically. Slots are read and written
+// in the frame (rdi). Anything the templates do not cover - strings,
+// printing, calls, name lookups - ends the native run: the live stack is
+// written to the VM stack (rsi) and the interpreter resumes at that
+// instruction. Loads check that the slot holds an int and exit otherwise.
+
+// Native code for one loop, entered at the loop header with an empty
+// operand stack at sp. state is (values pushed << 32) | resume offset;
+// iterations counts passes through the header.
+typedef struct {
+    uint64_t state;
+    uint64_t iterations;
+} JitExit;
+
+typedef JitExit (*JitFn)(Value *fp, Value *sp);
+
+// Runs after which a loop averaging fewer than JIT_MIN_ITERATIONS passes
+// per run - one that side-exits on every iteration, e.g. at a call - goes
+// back to being interpreted
+#define JIT_PROBE_RUNS 1000
+#define JIT_MIN_ITERATIONS 3
+
+typedef struct {
+    uint32_t target;        // loop header offset + 1, 0 for an empty bucket
+    uint32_t count;         // back-edges seen; past the threshold without
+                            // fn means the loop stays interpreted
+    JitFn fn;
+    uint64_t runs;
+    uint64_t iterations;
+} JitLoop;
+
+struct Jit {
+    const Bytecode *bc;
+    JitLoop *loops;         // open-addressed by target
+    size_t loop_count;
+    size_t loop_size;
+    JitLoop *last;          // most recent lookup; a loop repeats its back-edge
+    void **maps;            // executable mappings, for jit_free
+    size_t *map_sizes;
+    size_t map_count;
+};
+
+// Registers holding operand stack depth 0..STACK_REGS-1. rax/rdx are kept
+// free for idiv, rdi/rsi hold fp/sp, rcx counts iterations.
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7,
+       R8 = 8, R9, R10, R11, R12, R13, R14 };
+static const uint8_t stack_reg[] = { R8, R9, R10, R11, RBX, R12, R13, R14 };
+#define STACK_REGS ((int)sizeof(stack_reg))
+static const uint8_t saved_reg[] = { RBX, R12, R13, R14 };
+
+// x86 condition codes
+enum { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf };
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+} Asm;
+
+// A rel32 to patch: at code offset pos, to bytecode offset target
+typedef struct {
+    size_t pos;
+    uint32_t target;
+} Patch;
+
+// A side exit: resume at offset with depth live stack values
+typedef struct {
+    size_t pos;             // rel32 jumping to the stub
+    uint32_t resume;
+    int depth;
+} Exit;
+
+static void emit(Asm *a, uint8_t byte) {
+    if (a->size >= a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 4096;
+        a->code = realloc(a->code, a->capacity);
+    }
+    a->code[a->size++] = byte;
+}
+
+static void emit32(Asm *a, uint32_t v) {
+    for (int i = 0; i < 4; i++) emit(a, (uint8_t)(v >> (8 * i)));
+}
+
+static void patch32(Asm *a, size_t pos, size_t to) {
+    uint32_t rel = (uint32_t)(int32_t)((long)to - (long)(pos + 4));
+    for (int i = 0; i < 4; i++) a->code[pos + i] = (uint8_t)(rel >> (8 * i));
+}
+
+static void rex(Asm *a, int w, int reg, int rm) {
+    uint8_t r = (uint8_t)(0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+    if (r != 0x40) emit(a, r);
+}
+
+// op reg, rm with both registers (32-bit)
+static void op_rr(Asm *a, uint8_t op, int reg, int rm) {
+    rex(a, 0, reg, rm);
+    emit(a, op);
+    emit(a, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// op with a [base + disp32] memory operand; base is rdi or rsi
+static void op_mem(Asm *a, uint8_t op, int reg, int base, int32_t disp) {
+    rex(a, 0, reg, base);
+    emit(a, op);
+    emit(a, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    emit32(a, (uint32_t)disp);
+}
+
+static void mov_imm(Asm *a, int reg, int32_t imm) {
+    rex(a, 0, 0, reg);
+    emit(a, (uint8_t)(0xb8 | (reg & 7)));
+    emit32(a, (uint32_t)imm);
+}
+
+static size_t jump_rel32(Asm *a) {
+    emit(a, 0xe9);
+    emit32(a, 0);
+    return a->size - 4;
+}
+
+static size_t jcc_rel32(Asm *a, int cc) {
+    emit(a, 0x0f);
+    emit(a, (uint8_t)(0x80 | cc));
+    emit32(a, 0);
+    return a->size - 4;
+}
+
+// An int Value is its 32 bits in the low dword and zero in the high dword
+// (see value.h); these address the two halves of a slot
+static int32_t type_disp(size_t slot) {
+    return (int32_t)(slot * sizeof(Value) + 4);
+}
+
+static int32_t int_disp(size_t slot) {
+    return (int32_t)(slot * sizeof(Value));
+}
+
+static int compare_cc(uint8_t op) {
+    switch (op) {
+        case OP_GT: case OP_JMP_IF_NOT_GT:   return CC_G;
+        case OP_LT: case OP_JMP_IF_NOT_LT:   return CC_L;
+        case OP_GTE: case OP_JMP_IF_NOT_GTE: return CC_GE;
+        case OP_LTE: case OP_JMP_IF_NOT_LTE: return CC_LE;
+        case OP_EQ: case OP_JMP_IF_NOT_EQ:   return CC_E;
+        case OP_NEQ: case OP_JMP_IF_NOT_NEQ: return CC_NE;
+        default: return -1;
+    }
+}
+
+// Operand stack effect of a supported instruction as (pops, pushes);
+// returns 0 for instructions that end the native run
+static int stack_effect(const Bytecode *bc, const uint8_t *code, size_t ip, int *pops, int *pushes) {
+    uint8_t op = code[ip];
+    *pops = *pushes = 0;
+    switch (op) {
+        case OP_CONSTANT:
+            if (!value_is_int(bc->constants[read_u16(&code[ip + 1])])) return 0;
+            *pushes = 1;
+            return 1;
+        case OP_LOAD_SLOT:
+            *pushes = 1;
+            return 1;
+        case OP_STORE_SLOT:
+        case OP_POP:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_FALSE_LONG:
+            *pops = 1;
+            return 1;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_GT: case OP_LT: case OP_GTE: case OP_LTE: case OP_EQ: case OP_NEQ:
+            *pops = 2;
+            *pushes = 1;
+            return 1;
+        case OP_JMP_IF_NOT_GT: case OP_JMP_IF_NOT_LT: case OP_JMP_IF_NOT_GTE:
+        case OP_JMP_IF_NOT_LTE: case OP_JMP_IF_NOT_EQ: case OP_JMP_IF_NOT_NEQ:
+            *pops = 2;
+            return 1;
+        case OP_JMP:
+        case OP_JMP_LONG:
+            return 1;
+        case OP_INC_SLOT:
+            return value_is_int(bc->constants[read_u16(&code[ip + 3])]);
+        case OP_ADD_CONST:
+            if (!value_is_int(bc->constants[read_u16(&code[ip + 1])])) return 0;
+            *pops = *pushes = 1;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int falls_through(uint8_t op) {
+    return op != OP_JMP && op != OP_JMP_LONG;
+}
+
+// Computes the stack depth at each instruction of [start, end) reachable
+// from start; -1 marks unreachable ones. Fails on inconsistent depths or
+// stacks deeper than the register file.
+static int *compute_depths(const Bytecode *bc, size_t start, size_t end) {
+    const uint8_t *code = bc->code;
+    size_t n = end - start;
+    int *depth = malloc(n * sizeof(int));
+    size_t *work = malloc(n * sizeof(size_t));
+    size_t work_count = 0;
+    for (size_t i = 0; i < n; i++) depth[i] = -1;
+    depth[0] = 0;
+    work[work_count++] = start;
+    int ok = 1;
+    while (ok && work_count) {
+        size_t ip = work[--work_count];
+        int d = depth[ip - start], pops, pushes;
+        if (!stack_effect(bc, code, ip, &pops, &pushes)) continue;
+        if (d < pops || d - pops + pushes > STACK_REGS) {
+            ok = 0;
+            break;
+        }
+        int out = d - pops + pushes;
+        size_t succ[2];
+        int succ_count = 0;
+        if (opcode_is_jump(code[ip])) succ[succ_count++] = jump_target(code, ip);
+        if (falls_through(code[ip])) succ[succ_count++] = ip + opcode_length(code[ip]);
+        for (int i = 0; i < succ_count; i++) {
+            if (succ[i] < start || succ[i] >= end) continue;
+            int *sd = &depth[succ[i] - start];
+            if (*sd < 0) {
+                *sd = out;
+                work[work_count++] = succ[i];
+            } else if (*sd != out) {
+                ok = 0;
+            }
+        }
+    }
+    free(work);
+    if (!ok) {
+        free(depth);
+        return NULL;
+    }
+    return depth;
+}
+
+typedef struct {
+    Asm a;
+    Patch *patches;
+    size_t patch_count;
+    Exit *exits;
+    size_t exit_count;
+    size_t n;               // region size in bytes, bounds the arrays above
+} Emitter;
+
+static void add_exit(Emitter *e, size_t pos, size_t resume, int depth) {
+    e->exits[e->exit_count++] = (Exit){ pos, (uint32_t)resume, depth };
+}
+
+// Jumps to bytecode offset target: a patched jump inside the loop, an exit
+// outside it
+static void branch_to(Emitter *e, size_t pos, size_t target, size_t start, size_t end, int depth) {
+    if (target >= start && target < end) {
+        e->patches[e->patch_count++] = (Patch){ pos, (uint32_t)target };
+    } else {
+        add_exit(e, pos, target, depth);
+    }
+}
+
+static void emit_instruction(Emitter *e, const Bytecode *bc, size_t ip, int d, size_t start, size_t end) {
+    Asm *a = &e->a;
+    const uint8_t *code = bc->code;
+    uint8_t op = code[ip];
+    int top = d - 1;
+    switch (op) {
+        case OP_CONSTANT:
+            mov_imm(a, stack_reg[d], value_as_int(bc->constants[read_u16(&code[ip + 1])]));
+            break;
+        case OP_LOAD_SLOT: {
+            uint16_t slot = read_u16(&code[ip + 1]);
+            // cmp dword [rdi + type], VAL_INT; jne exit
+            op_mem(a, 0x81, 7, RDI, type_disp(slot));
+            emit32(a, VAL_INT);
+            add_exit(e, jcc_rel32(a, CC_NE), ip, d);
+            op_mem(a, 0x8b, stack_reg[d], RDI, int_disp(slot));
+            break;
+        }
+        case OP_STORE_SLOT: {
+            uint16_t slot = read_u16(&code[ip + 1]);
+            op_mem(a, 0xc7, 0, RDI, type_disp(slot));
+            emit32(a, VAL_INT);
+            op_mem(a, 0x89, stack_reg[top], RDI, int_disp(slot));
+            break;
+        }
+        case OP_INC_SLOT: {
+            uint16_t slot = read_u16(&code[ip + 1]);
+            int32_t k = value_as_int(bc->constants[read_u16(&code[ip + 3])]);
+            // A string in the slot leaves it to the interpreter
+            op_mem(a, 0x81, 7, RDI, type_disp(slot));
+            emit32(a, VAL_INT);
+            add_exit(e, jcc_rel32(a, CC_NE), ip, d);
+            op_mem(a, 0x81, 0, RDI, int_disp(slot));
+            emit32(a, (uint32_t)k);
+            break;
+        }
+        case OP_ADD_CONST:
+            // add r32, imm32
+            op_rr(a, 0x81, 0, stack_reg[top]);
+            emit32(a, (uint32_t)value_as_int(bc->constants[read_u16(&code[ip + 1])]));
+            break;
+        case OP_POP:
+            break;
+        case OP_ADD: op_rr(a, 0x01, stack_reg[top], stack_reg[top - 1]); break;
+        case OP_SUB: op_rr(a, 0x29, stack_reg[top], stack_reg[top - 1]); break;
+        case OP_MUL:
+            rex(a, 0, stack_reg[top - 1], stack_reg[top]);
+            emit(a, 0x0f);
+            emit(a, 0xaf);
+            emit(a, (uint8_t)(0xc0 | ((stack_reg[top - 1] & 7) << 3) | (stack_reg[top] & 7)));
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            // A zero or -1 divisor leaves the instruction to the
+            // interpreter, which fails the run or wraps; idiv would trap
+            op_rr(a, 0x85, stack_reg[top], stack_reg[top]);        // test b, b
+            add_exit(e, jcc_rel32(a, CC_E), ip, d);
+            op_rr(a, 0x83, 7, stack_reg[top]);                     // cmp b, -1
+            emit(a, 0xff);
+            add_exit(e, jcc_rel32(a, CC_E), ip, d);
+            op_rr(a, 0x89, stack_reg[top - 1], RAX);    // mov eax, a
+            emit(a, 0x99);                              // cdq
+            op_rr(a, 0xf7, 7, stack_reg[top]);          // idiv b
+            op_rr(a, 0x89, op == OP_DIV ? RAX : RDX, stack_reg[top - 1]);
+            break;
+        case OP_GT: case OP_LT: case OP_GTE: case OP_LTE: case OP_EQ: case OP_NEQ:
+            op_rr(a, 0x39, stack_reg[top], stack_reg[top - 1]);    // cmp a, b
+            emit(a, 0x0f);
+            emit(a, (uint8_t)(0x90 | compare_cc(op)));            // setcc al
+            emit(a, 0xc0);
+            rex(a, 0, stack_reg[top - 1], RAX);                    // movzx a, al
+            emit(a, 0x0f);
+            emit(a, 0xb6);
+            emit(a, (uint8_t)(0xc0 | ((stack_reg[top - 1] & 7) << 3)));
+            break;
+        case OP_JMP:
+        case OP_JMP_LONG:
+            branch_to(e, jump_rel32(a), jump_target(code, ip), start, end, d);
+            break;
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_FALSE_LONG:
+            op_rr(a, 0x85, stack_reg[top], stack_reg[top]);        // test
+            branch_to(e, jcc_rel32(a, CC_E), jump_target(code, ip), start, end, d - 1);
+            break;
+        default: {
+            // Fused compare-and-branch: jump when the comparison fails
+            op_rr(a, 0x39, stack_reg[top], stack_reg[top - 1]);
+            branch_to(e, jcc_rel32(a, compare_cc(op) ^ 1), jump_target(code, ip), start, end, d - 2);
+            break;
+        }
+    }
+}
+
+// Writes the live stack to the VM stack and returns to the interpreter
+static void emit_exit_stub(Asm *a, const Exit *x, size_t epilogue) {
+    for (int i = 0; i < x->depth; i++) {
+        op_mem(a, 0xc7, 0, RSI, type_disp((size_t)i));
+        emit32(a, VAL_INT);
+        op_mem(a, 0x89, stack_reg[i], RSI, int_disp((size_t)i));
+    }
+    uint64_t result = ((uint64_t)x->depth << 32) | x->resume;
+    emit(a, 0x48);                                  // mov rax, imm64
+    emit(a, 0xb8);
+    emit32(a, (uint32_t)result);
+    emit32(a, (uint32_t)(result >> 32));
+    patch32(a, jump_rel32(a), epilogue);
+}
+
+static JitFn compile_loop(Jit *jit, size_t start, size_t end) {
+    const Bytecode *bc = jit->bc;
+    int *depth = compute_depths(bc, start, end);
+    if (!depth) return NULL;
+
+    size_t n = end - start;
+    Emitter e = { { NULL, 0, 0 }, NULL, 0, NULL, 0, n };
+    // At most one patch and three exits per instruction
+    e.patches = malloc((n + 1) * sizeof(Patch));
+    e.exits = malloc((3 * n + 1) * sizeof(Exit));
+    size_t *label = malloc(n * sizeof(size_t));
+
+    for (size_t i = 0; i < sizeof(saved_reg); i++) {   // push
+        rex(&e.a, 0, 0, saved_reg[i]);
+        emit(&e.a, (uint8_t)(0x50 | (saved_reg[i] & 7)));
+    }
+    op_rr(&e.a, 0x31, RCX, RCX);                        // xor ecx, ecx
+    for (size_t ip = start; ip < end; ip += opcode_length(bc->code[ip])) {
+        int d = depth[ip - start];
+        if (d < 0) continue;
+        label[ip - start] = e.a.size;
+        if (ip == start) {
+            emit(&e.a, 0x48);                           // inc rcx
+            emit(&e.a, 0xff);
+            emit(&e.a, 0xc1);
+        }
+        int pops, pushes;
+        if (!stack_effect(bc, bc->code, ip, &pops, &pushes)) {
+            add_exit(&e, jump_rel32(&e.a), ip, d);
+            continue;
+        }
+        emit_instruction(&e, bc, ip, d, start, end);
+        size_t next = ip + opcode_length(bc->code[ip]);
+        if (falls_through(bc->code[ip]) && next >= end) {
+            add_exit(&e, jump_rel32(&e.a), next, d - pops + pushes);
+        }
+    }
+
+    size_t epilogue = e.a.size;
+    emit(&e.a, 0x48);                                   // mov rdx, rcx
+    emit(&e.a, 0x89);
+    emit(&e.a, 0xca);
+    for (size_t i = sizeof(saved_reg); i-- > 0;) {     // pop
+        rex(&e.a, 0, 0, saved_reg[i]);
+        emit(&e.a, (uint8_t)(0x58 | (saved_reg[i] & 7)));
+    }
+    emit(&e.a, 0xc3);
+    for (size_t i = 0; i < e.exit_count; i++) {
+        patch32(&e.a, e.exits[i].pos, e.a.size);
+        emit_exit_stub(&e.a, &e.exits[i], epilogue);
+    }
+    for (size_t i = 0; i < e.patch_count; i++) {
+        patch32(&e.a, e.patches[i].pos, label[e.patches[i].target - start]);
+    }
+    free(label);
+    free(depth);
+    free(e.patches);
+    free(e.exits);
+
+    // Written while writable, then flipped to read+execute
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = (e.a.size + page - 1) / page * page;
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        free(e.a.code);
+        return NULL;
+    }
+    memcpy(map, e.a.code, e.a.size);
+    free(e.a.code);
+    if (mprotect(map, map_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(map, map_size);
+        return NULL;
+    }
+    jit->maps = realloc(jit->maps, sizeof(void*) * (jit->map_count + 1));
+    jit->map_sizes = realloc(jit->map_sizes, sizeof(size_t) * (jit->map_count + 1));
+    jit->maps[jit->map_count] = map;
+    jit->map_sizes[jit->map_count++] = map_size;
+    JitFn fn;
+    memcpy(&fn, &map, sizeof(fn));
+    return fn;
+}
+
+Jit *jit_new(const Bytecode *bc) {
+    Jit *jit = calloc(1, sizeof(Jit));
+    jit->bc = bc;
+    return jit;
+}
+
+void jit_free(Jit *jit) {
+    if (!jit) return;
+    for (size_t i = 0; i < jit->map_count; i++) munmap(jit->maps[i], jit->map_sizes[i]);
+    free(jit->maps);
+    free(jit->map_sizes);
+    free(jit->loops);
+    free(jit);
+}
+
+static uint32_t hash_offset(uint32_t v) {
+    v ^= v >> 16;
+    v *= 0x7feb352du;
+    v ^= v >> 15;
+    return v;
+}
+
+// Returns the entry for target, adding it on first use
+static JitLoop *find_loop(Jit *jit, size_t target) {
+    uint32_t key = (uint32_t)target + 1;
+    if (jit->last && jit->last->target == key) return jit->last;
+    if ((jit->loop_count + 1) * 2 > jit->loop_size) {
+        size_t size = jit->loop_size ? jit->loop_size * 2 : 16;
+        JitLoop *loops = calloc(size, sizeof(JitLoop));
+        for (size_t i = 0; i < jit->loop_size; i++) {
+            if (!jit->loops[i].target) continue;
+            size_t b = hash_offset(jit->loops[i].target) & (size - 1);
+            while (loops[b].target) b = (b + 1) & (size - 1);
+            loops[b] = jit->loops[i];
+        }
+        free(jit->loops);
+        jit->loops = loops;
+        jit->loop_size = size;
+    }
+    size_t mask = jit->loop_size - 1;
+    size_t b = hash_offset(key) & mask;
+    while (jit->loops[b].target && jit->loops[b].target != key) b = (b + 1) & mask;
+    if (!jit->loops[b].target) {
+        jit->loops[b].target = key;
+        jit->loop_count++;
+    }
+    return jit->last = &jit->loops[b];
+}
+
+int jit_enter(Jit *jit, size_t target, size_t end, Value *fp, Value *sp,
+              size_t *resume, int *pushed) {
+    JitLoop *loop = find_loop(jit, target);
+    if (!loop->fn) {
+        if (loop->count > JIT_THRESHOLD) return 0;
+        if (++loop->count < JIT_THRESHOLD) return 0;
+        loop->fn = compile_loop(jit, target, end);
+        if (!loop->fn) {
+            loop->count++;
+            return 0;
+        }
+    }
+    JitExit x = loop->fn(fp, sp);
+    loop->runs++;
+    loop->iterations += x.iterations;
+    if (loop->runs == JIT_PROBE_RUNS && loop->iterations < JIT_MIN_ITERATIONS * loop->runs) {
+        loop->fn = NULL;
+        loop->count++;
+    }
+    *resume = (uint32_t)x.state;
+    *pushed = (int)(x.state >> 32);
+    return 1;
+}
+
+#else
+
+Jit *jit_new(const Bytecode *bc) {
+    (void)bc;
+    return NULL;
+}
+
+void jit_free(Jit *jit) {
+    (void)jit;
+}
+
+int jit_enter(Jit *jit, size_t target, size_t end, Value *fp, Value *sp,
+              size_t *resume, int *pushed) {
+    (void)jit; (void)target; (void)end; (void)fp; (void)sp; (void)resume; (void)pushed;
+    return 0;
+}
+
+#endif
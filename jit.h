@@ -0,0 +1,25 @@
+// jit.h
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include "bytecode.h"
+
+// Back-edges a loop takes in the interpreter before it is compiled
+#define JIT_THRESHOLD 1000
+
+typedef struct Jit Jit;
+
+// Returns NULL where the JIT is not available (non-x86-64 builds)
+Jit *jit_new(const Bytecode *bc);
+void jit_free(Jit *jit);
+
+// Called on each loop back-edge from the jump ending at end to target.
+// Once the loop [target, end) is hot and compilable, runs it natively with
+// fp as the current frame and sp as the top of the operand stack, and
+// returns 1 with the offset to resume interpreting at and the number of
+// values it left on the stack. Returns 0 while the loop stays interpreted.
+int jit_enter(Jit *jit, size_t target, size_t end, Value *fp, Value *sp,
+              size_t *resume, int *pushed);
+
+#endif // JIT_H
@@ -5,113 +5,299 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define INITIAL_CAPACITY 128
+#define SCALAR_PREFIX 8
+
+// Vectorized scanning kernels. Each returns the index of the first byte in
+// [i, len) that ends the run, or len. Most runs are short, so a few bytes
+// are checked one at a time before switching to vectors. Blocks are only
+// loaded while a whole vector fits before len, since mapped sources are not
+// padded; the tail is finished by the scalar loop that also serves as the
+// portable fallback.
+#if defined(__AVX2__)
+#  define VEC_WIDTH 32
+typedef __m256i vec;
+#  define VLOAD(p)        _mm256_loadu_si256((const __m256i *)(p))
+#  define VSET1(c)        _mm256_set1_epi8((char)(c))
+#  define VEQ(a, b)       _mm256_cmpeq_epi8(a, b)
+#  define VGT(a, b)       _mm256_cmpgt_epi8(a, b)
+#  define VOR(a, b)       _mm256_or_si256(a, b)
+#  define VAND(a, b)      _mm256_and_si256(a, b)
+#  define VMASK(v)        ((uint32_t)_mm256_movemask_epi8(v))
+#  define VMASK_ALL       0xffffffffu
+#elif defined(__SSE2__)
+#  define VEC_WIDTH 16
+typedef __m128i vec;
+#  define VLOAD(p)        _mm_loadu_si128((const __m128i *)(p))
+#  define VSET1(c)        _mm_set1_epi8((char)(c))
+#  define VEQ(a, b)       _mm_cmpeq_epi8(a, b)
+#  define VGT(a, b)       _mm_cmpgt_epi8(a, b)
+#  define VOR(a, b)       _mm_or_si128(a, b)
+#  define VAND(a, b)      _mm_and_si128(a, b)
+#  define VMASK(v)        ((uint32_t)_mm_movemask_epi8(v))
+#  define VMASK_ALL       0xffffu
+#endif
+
+#ifdef VEC_WIDTH
+// Signed byte compares are fine: every range below lies in 0x00-0x7f, and
+// bytes >= 0x80 compare negative and fall outside it
+#  define VIN_RANGE(v, lo, hi) VAND(VGT(v, VSET1((lo) - 1)), VGT(VSET1((hi) + 1), v))
+#endif
+
+static int is_blank(char c) {
+    return c==' '||c=='\t'||c=='\r';
+}
+
+static int is_ident_char(char c) {
+    return isalnum((unsigned char)c)||c=='_'||c=='$';
+}
 
-static void add_token(Token **tokens, size_t *count, size_t *capacity,
-                      TokenType type, const char *text,
-                      size_t line, size_t column) {
-    if (*count >= *capacity) {
-        *capacity *= 2;
-        *tokens = realloc(*tokens, (*capacity) * sizeof(Token));
+static size_t scan_blanks(const char *s, size_t i, size_t len) {
+    for (size_t end = i + SCALAR_PREFIX; i < end; i++) {
+        if (i >= len || !is_blank(s[i])) return i;
     }
-    Token *t = &(*tokens)[(*count)++];
-    t->type = type;
-    if (text) {
-        strncpy(t->text, text, MAX_TOKEN_TEXT-1);
-        t->text[MAX_TOKEN_TEXT-1] = '\0';
-    } else {
-        t->text[0] = '\0';
+#ifdef VEC_WIDTH
+    const vec sp = VSET1(' '), tab = VSET1('\t'), cr = VSET1('\r');
+    for (; i + VEC_WIDTH <= len; i += VEC_WIDTH) {
+        vec v = VLOAD(s + i);
+        uint32_t stop = ~VMASK(VOR(VOR(VEQ(v, sp), VEQ(v, tab)), VEQ(v, cr))) & VMASK_ALL;
+        if (stop) return i + (size_t)__builtin_ctz(stop);
     }
-    t->line = line;
-    t->column = column;
-}
-
-Token *lex(const char *source, size_t *out_count) {
-    size_t capacity = INITIAL_CAPACITY, count = 0;
-    Token *tokens = malloc(capacity * sizeof(Token));
-    size_t i = 0, line = 1, col = 1;
-
-    while (source[i] != '\0') {
-        char c = source[i];
-        if (c==' '||c=='\t'||c=='\r') { i++; col++; continue; }
-        if (c=='\n') { i++; line++; col=1; continue; }
-        if (c=='/'&&source[i+1]=='/') { i+=2; while(source[i]&&source[i]!='\n') i++; continue; }
-        size_t tok_col = col;
-        if (isalpha(c)||c=='$') {
-            char buf[MAX_TOKEN_TEXT]={0}; size_t len=0;
-            while((isalnum(source[i])||source[i]=='_'||source[i]=='$')&&len<MAX_TOKEN_TEXT-1) {
-                buf[len++]=source[i++]; col++;
-            }
-            buf[len]='\0';
-            TokenType type = T_IDENTIFIER;
-            if (!strcmp(buf,"if")) type=T_IF;
-            else if (!strcmp(buf,"else")) type=T_ELSE;
-            else if (!strcmp(buf,"while")) type=T_WHILE;
-            else if (!strcmp(buf,"function")) type=T_FUNCTION;
-            else if (!strcmp(buf,"return")) type=T_RETURN;
-            else if (!strcmp(buf,"print")) type=T_PRINT;
-            add_token(&tokens,&count,&capacity,type,buf,line,tok_col);
-            continue;
-        }
-        if (c == '"') {
-            char buf[MAX_TOKEN_TEXT] = {0};
-            size_t len = 0;
-            i++; col++; // skip opening quote
-            while (source[i] && source[i] != '"' && len < MAX_TOKEN_TEXT-1) {
-                buf[len++] = source[i++];
-                col++;
-            }
-            if (source[i] == '"') { i++; col++; }
-            buf[len] = '\0';
-            add_token(&tokens, &count, &capacity, T_STRING, buf, line, tok_col);
-            continue;
-        }
-        if (isdigit(c)) {
-            char buf[MAX_TOKEN_TEXT]={0}; size_t len=0;
-            while(isdigit(source[i])&&len<MAX_TOKEN_TEXT-1){ buf[len++]=source[i++]; col++; }
-            buf[len]='\0';
-            add_token(&tokens,&count,&capacity,T_NUMBER,buf,line,tok_col);
-            continue;
+#endif
+    while (i < len && is_blank(s[i])) i++;
+    return i;
+}
+
+static size_t scan_ident(const char *s, size_t i, size_t len) {
+    for (size_t end = i + SCALAR_PREFIX; i < end; i++) {
+        if (i >= len || !is_ident_char(s[i])) return i;
+    }
+#ifdef VEC_WIDTH
+    const vec case_bit = VSET1(0x20), under = VSET1('_'), dollar = VSET1('$');
+    for (; i + VEC_WIDTH <= len; i += VEC_WIDTH) {
+        vec v = VLOAD(s + i);
+        vec ok = VOR(VIN_RANGE(VOR(v, case_bit), 'a', 'z'), VIN_RANGE(v, '0', '9'));
+        ok = VOR(ok, VOR(VEQ(v, under), VEQ(v, dollar)));
+        uint32_t stop = ~VMASK(ok) & VMASK_ALL;
+        if (stop) return i + (size_t)__builtin_ctz(stop);
+    }
+#endif
+    while (i < len && is_ident_char(s[i])) i++;
+    return i;
+}
+
+// Stops at the closing quote or a newline (which the caller must count)
+static size_t scan_string(const char *s, size_t i, size_t len) {
+    for (size_t end = i + SCALAR_PREFIX; i < end; i++) {
+        if (i >= len || s[i] == '"' || s[i] == '\n') return i;
+    }
+#ifdef VEC_WIDTH
+    const vec quote = VSET1('"'), nl = VSET1('\n');
+    for (; i + VEC_WIDTH <= len; i += VEC_WIDTH) {
+        vec v = VLOAD(s + i);
+        uint32_t stop = VMASK(VOR(VEQ(v, quote), VEQ(v, nl)));
+        if (stop) return i + (size_t)__builtin_ctz(stop);
+    }
+#endif
+    while (i < len && s[i] != '"' && s[i] != '\n') i++;
+    return i;
+}
+
+// Comment bodies run to the end of the line; memchr is already vectorized
+static size_t scan_line(const char *s, size_t i, size_t len) {
+    const char *nl = i < len ? memchr(s + i, '\n', len - i) : NULL;
+    return nl ? (size_t)(nl - s) : len;
+}
+
+// Keyword recognition by length, then first character, then one memcmp
+static TokenType keyword_type(const char *text, size_t len) {
+    switch (len) {
+        case 2:
+            if (text[0]=='i' && text[1]=='f') return T_IF;
+            break;
+        case 4:
+            if (text[0]=='e' && !memcmp(text,"else",4)) return T_ELSE;
+            break;
+        case 5:
+            if (text[0]=='w' && !memcmp(text,"while",5)) return T_WHILE;
+            if (text[0]=='p' && !memcmp(text,"print",5)) return T_PRINT;
+            break;
+        case 6:
+            if (text[0]=='r' && !memcmp(text,"return",6)) return T_RETURN;
+            break;
+        case 8:
+            if (text[0]=='f' && !memcmp(text,"function",8)) return T_FUNCTION;
+            break;
+    }
+    return T_IDENTIFIER;
+}
+
+static void add_token(TokenStream *ts, Token t) {
+    if (ts->count >= ts->capacity) {
+        ts->capacity *= 2;
+        ts->types = realloc(ts->types, ts->capacity * sizeof(uint8_t));
+        ts->offsets = realloc(ts->offsets, ts->capacity * sizeof(uint32_t));
+        ts->lengths = realloc(ts->lengths, ts->capacity * sizeof(uint32_t));
+    }
+    ts->types[ts->count] = (uint8_t)t.type;
+    ts->offsets[ts->count] = t.offset;
+    ts->lengths[ts->count] = t.length;
+    ts->count++;
+}
+
+static void add_line(TokenStream *ts, size_t offset) {
+    if (ts->line_count >= ts->line_capacity) {
+        ts->line_capacity *= 2;
+        ts->line_starts = realloc(ts->line_starts, ts->line_capacity * sizeof(uint32_t));
+    }
+    ts->line_starts[ts->line_count++] = (uint32_t)offset;
+}
+
+void lexer_init(Lexer *lx, const char *source, size_t length) {
+    lx->source = source;
+    lx->length = length;
+    lx->pos = 0;
+    lx->line = 1;
+    lx->line_start = 0;
+    lx->line_sink = NULL;
+}
+
+// Character at i, or '\0' past the end of the buffer
+static char at(const Lexer *lx, size_t i) {
+    return i < lx->length ? lx->source[i] : '\0';
+}
+
+// Records that a new line begins at offset
+static void newline(Lexer *lx, size_t offset) {
+    lx->line++;
+    lx->line_start = offset;
+    if (lx->line_sink) add_line(lx->line_sink, offset);
+}
+
+static Token make_token(const Lexer *lx, TokenType type, size_t start, size_t length, size_t column_at) {
+    Token t = { type, (uint32_t)start, (uint32_t)length, (uint32_t)lx->line,
+                (uint32_t)(column_at - lx->line_start + 1) };
+    return t;
+}
+
+Token lexer_next(Lexer *lx) {
+    const char *src = lx->source;
+    size_t i = lx->pos, len = lx->length;
+    for (;;) {
+        i = scan_blanks(src, i, len);
+        char c = at(lx, i);
+        if (c=='\n') { i++; newline(lx, i); continue; }
+        if (c=='/'&&at(lx, i+1)=='/') { i = scan_line(src, i+2, len); continue; }
+        break;
+    }
+    size_t start = i;
+    Token t;
+    if (i >= len) {
+        t = make_token(lx, T_EOF, i, 0, i);
+        lx->pos = i;
+        return t;
+    }
+    char c = src[i];
+    if (isalpha((unsigned char)c)||c=='$') {
+        i = scan_ident(src, i, len);
+        t = make_token(lx,keyword_type(src + start, i - start),start,i-start,start);
+    } else if (c == '"') {
+        // Column refers to the opening quote; the slice excludes both quotes
+        t = make_token(lx, T_STRING, start + 1, 0, start);
+        i = scan_string(src, i + 1, len);
+        while (i < len && src[i] == '\n') {
+            newline(lx, i + 1);
+            i = scan_string(src, i + 1, len);
         }
+        t.length = (uint32_t)(i - (start + 1));
+        if (i < len) i++;
+    } else if (isdigit((unsigned char)c)) {
+        while(isdigit((unsigned char)at(lx, i))) i++;
+        t = make_token(lx,T_NUMBER,start,i-start,start);
+    } else {
+        TokenType type = T_ERROR;
+        size_t tok_len = 1;
         switch(c){
-            case '(': add_token(&tokens,&count,&capacity,T_LPAREN,NULL,line,tok_col); i++;col++;break;
-            case ')': add_token(&tokens,&count,&capacity,T_RPAREN,NULL,line,tok_col); i++;col++;break;
-            case '{': add_token(&tokens,&count,&capacity,T_LBRACE,NULL,line,tok_col); i++;col++;break;
-            case '}': add_token(&tokens,&count,&capacity,T_RBRACE,NULL,line,tok_col); i++;col++;break;
-            case ';': add_token(&tokens,&count,&capacity,T_SEMICOLON,NULL,line,tok_col); i++;col++;break;
-            case ',': add_token(&tokens,&count,&capacity,T_COMMA,NULL,line,tok_col); i++;col++;break;
-            case '+': add_token(&tokens,&count,&capacity,T_PLUS,NULL,line,tok_col); i++;col++;break;
-            case '-': add_token(&tokens,&count,&capacity,T_MINUS,NULL,line,tok_col); i++;col++;break;
-            case '*': add_token(&tokens,&count,&capacity,T_STAR,NULL,line,tok_col); i++;col++;break;
-            case '/': add_token(&tokens,&count,&capacity,T_SLASH,NULL,line,tok_col); i++;col++;break;
-            case '%': add_token(&tokens,&count,&capacity,T_MOD,NULL,line,tok_col); i++;col++;break;
+            case '(': type=T_LPAREN; break;
+            case ')': type=T_RPAREN; break;
+            case '{': type=T_LBRACE; break;
+            case '}': type=T_RBRACE; break;
+            case ';': type=T_SEMICOLON; break;
+            case ',': type=T_COMMA; break;
+            case '+': type=T_PLUS; break;
+            case '-': type=T_MINUS; break;
+            case '*': type=T_STAR; break;
+            case '/': type=T_SLASH; break;
+            case '%': type=T_MOD; break;
+            case '.': type=T_DOT; break;
             case '>':
-                if (source[i+1]=='=') { add_token(&tokens,&count,&capacity,T_GTE,NULL,line,tok_col); i+=2; col+=2; }
-                else { add_token(&tokens,&count,&capacity,T_GT,NULL,line,tok_col); i++;col++; }
+                if (at(lx, i+1)=='=') { type=T_GTE; tok_len=2; } else type=T_GT;
                 break;
             case '<':
-                if (source[i+1]=='=') { add_token(&tokens,&count,&capacity,T_LTE,NULL,line,tok_col); i+=2; col+=2; }
-                else { add_token(&tokens,&count,&capacity,T_LT,NULL,line,tok_col); i++;col++; }
+                if (at(lx, i+1)=='=') { type=T_LTE; tok_len=2; } else type=T_LT;
                 break;
             case '=':
-                if (source[i+1]=='=') { add_token(&tokens,&count,&capacity,T_EQ,NULL,line,tok_col); i+=2; col+=2; }
-                else { add_token(&tokens,&count,&capacity,T_ASSIGN,NULL,line,tok_col); i++;col++; }
+                if (at(lx, i+1)=='=') { type=T_EQ; tok_len=2; } else type=T_ASSIGN;
                 break;
             case '!':
-                if (source[i+1]=='=') { add_token(&tokens,&count,&capacity,T_NEQ,NULL,line,tok_col); i+=2; col+=2; }
-                else { add_token(&tokens,&count,&capacity,T_ERROR,NULL,line,tok_col); i++;col++; }
+                if (at(lx, i+1)=='=') { type=T_NEQ; tok_len=2; }
                 break;
             default:
-                add_token(&tokens,&count,&capacity,T_ERROR,NULL,line,tok_col);
-                i++;col++;
+                break;
         }
+        t = make_token(lx,type,start,tok_len,start);
+        i += tok_len;
+    }
+    lx->pos = i;
+    return t;
+}
+
+TokenStream *lex(const char *source, size_t length) {
+    TokenStream *ts = malloc(sizeof(TokenStream));
+    ts->source = source;
+    ts->count = 0;
+    ts->capacity = INITIAL_CAPACITY;
+    ts->types = malloc(ts->capacity * sizeof(uint8_t));
+    ts->offsets = malloc(ts->capacity * sizeof(uint32_t));
+    ts->lengths = malloc(ts->capacity * sizeof(uint32_t));
+    ts->line_count = 0;
+    ts->line_capacity = INITIAL_CAPACITY;
+    ts->line_starts = malloc(ts->line_capacity * sizeof(uint32_t));
+    add_line(ts, 0);
+
+    Lexer lx;
+    lexer_init(&lx, source, length);
+    lx.line_sink = ts;
+    Token t;
+    do {
+        t = lexer_next(&lx);
+        add_token(ts, t);
+    } while (t.type != T_EOF);
+    return ts;
+}
+
+void token_position(const TokenStream *ts, size_t i, size_t *line, size_t *column) {
+    uint32_t offset = ts->offsets[i];
+    if (ts->types[i] == T_STRING) offset--; // report the opening quote
+    // Last line starting at or before offset
+    size_t lo = 0, hi = ts->line_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ts->line_starts[mid] <= offset) lo = mid; else hi = mid;
     }
-    add_token(&tokens,&count,&capacity,T_EOF,NULL,line,col);
-    *out_count = count;
-    return tokens;
+    *line = lo + 1;
+    *column = offset - ts->line_starts[lo] + 1;
 }
 
-void free_tokens(Token *tokens, size_t count) {
-    (void)count;
-    free(tokens);
+void free_tokens(TokenStream *ts) {
+    if (!ts) return;
+    free(ts->types);
+    free(ts->offsets);
+    free(ts->lengths);
+    free(ts->line_starts);
+    free(ts);
 }
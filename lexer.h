@@ -4,7 +4,22 @@
 
 #include "tokens.h"
 
-Token *lex(const char *source, size_t *out_count);
-void free_tokens(Token *tokens, size_t count);
+// Pull lexer: each lexer_next() call scans one token from source, which
+// need not be NUL-terminated and must outlive the lexer.
+typedef struct {
+    const char *source;
+    size_t length;
+    size_t pos;
+    size_t line;
+    size_t line_start;
+    TokenStream *line_sink;  // receives line starts when lexing in batch
+} Lexer;
+
+void lexer_init(Lexer *lx, const char *source, size_t length);
+Token lexer_next(Lexer *lx);
+
+// Batch API: materializes every token. The stream references source.
+TokenStream *lex(const char *source, size_t length);
+void free_tokens(TokenStream *tokens);
 
 #endif // LEXER_H
@@ -1,53 +1,433 @@
 // main.c
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "source.h"
 #include "lexer.h"
 #include "parser.h"
 #include "compiler.h"
+#include "optimizer.h"
+#include "peephole.h"
 #include "vm.h"
+#include "profile.h"
+#include "sampler.h"
+#include "bccache.h"
+#include "regcompiler.h"
+#include "regvm.h"
+#include "ccompiler.h"
+#include "batch.h"
+
+// Optimization levels: 0 none, 1 bytecode peephole, 2 also AST folding
+#define DEFAULT_OPT_LEVEL 2
+
+// Minimum measuring time for --lex-bench
+#define LEX_BENCH_SECONDS 0.5
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <source_file>\n", prog);
+    fprintf(stderr, "Usage: %s [-O<level>] [--vm=stack|register] [--lex-bench] "
+                    "[--no-jit] [--cache] [--emit-bytecode=<file>] [--emit-c=<file>] "
+                    "[--profile[=<json file>]] [--profile-cycles] [--sample[=<folded file>]] "
+                    "[--stats[=<file>]] "
+                    "<source_file|file" BCCACHE_EXT ">\n"
+                    "       %s [-O<level>] [--no-jit] --batch=<job list> [--threads=<n>] "
+                    "[--repeat=<n>]\n", prog, prog);
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// Cache file next to the script: foo.phpc -> foo.phpcb, other -> other.phpcb
+static char *cache_path_for(const char *filename) {
+    size_t n = strlen(filename);
+    char *path = malloc(n + sizeof(BCCACHE_EXT));
+    if (has_suffix(filename, ".phpc")) {
+        snprintf(path, n + sizeof(BCCACHE_EXT), "%sb", filename);
+    } else {
+        snprintf(path, n + sizeof(BCCACHE_EXT), "%s" BCCACHE_EXT, filename);
+    }
+    return path;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --stats: wall and CPU time per phase and the size of what each produced,
+// written once the script ends as "name value" lines. Names only ever get
+// added, so scrapers can rely on them.
+typedef enum { PHASE_READ, PHASE_LEX, PHASE_PARSE, PHASE_COMPILE, PHASE_RUN, PHASE_COUNT } Phase;
+
+static const char *const phase_names[PHASE_COUNT] = { "read", "lex", "parse", "compile", "run" };
+
+typedef struct {
+    int enabled;
+    const char *path;           // stderr when NULL
+    double wall[PHASE_COUNT], cpu[PHASE_COUNT];
+    double wall_start, cpu_start;
+    size_t source_bytes;
+    size_t tokens, token_bytes;
+    size_t ast_nodes, ast_bytes;
+    VmStats vm;
+} RunStats;
+
+static void phase_begin(RunStats *st) {
+    if (!st->enabled) return;
+    st->wall_start = now_seconds();
+    st->cpu_start = cpu_seconds();
+}
+
+static void phase_end(RunStats *st, Phase phase) {
+    if (!st->enabled) return;
+    st->wall[phase] += now_seconds() - st->wall_start;
+    st->cpu[phase] += cpu_seconds() - st->cpu_start;
+}
+
+// The front end's phases stay at zero when the bytecode came from a file
+static int write_stats(const RunStats *st, const Bytecode *bc, int exit_code) {
+    FILE *out = st->path ? fopen(st->path, "w") : stderr;
+    if (!out) {
+        perror("Error writing stats");
+        return -1;
+    }
+    size_t constant_bytes = bc->const_count * sizeof(Value), locals = 0;
+    for (size_t i = 0; i < bc->const_count; i++) {
+        if (!value_is_int(bc->constants[i])) constant_bytes += strlen(value_as_str(bc->constants[i])) + 1;
+    }
+    for (size_t i = 0; i < bc->func_count; i++) locals += bc->functions[i].local_count;
+
+    fprintf(out, "stats.version 1\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(out, "phase.%s.wall_ns %.0f\n", phase_names[p], st->wall[p] * 1e9);
+        fprintf(out, "phase.%s.cpu_ns %.0f\n", phase_names[p], st->cpu[p] * 1e9);
+    }
+    fprintf(out, "source.bytes %zu\n", st->source_bytes);
+    fprintf(out, "tokens.count %zu\n", st->tokens);
+    fprintf(out, "tokens.bytes %zu\n", st->token_bytes);
+    fprintf(out, "ast.nodes %zu\n", st->ast_nodes);
+    fprintf(out, "ast.bytes %zu\n", st->ast_bytes);
+    fprintf(out, "bytecode.bytes %zu\n", bc->code_size);
+    fprintf(out, "constants.count %zu\n", bc->const_count);
+    fprintf(out, "constants.bytes %zu\n", constant_bytes);
+    fprintf(out, "functions.count %zu\n", bc->func_count);
+    fprintf(out, "variables.globals %zu\n", bc->var_count);
+    fprintf(out, "variables.locals %zu\n", locals);
+    fprintf(out, "vm.instructions %llu\n", (unsigned long long)st->vm.instructions);
+    fprintf(out, "vm.peak_stack %zu\n", st->vm.peak_stack);
+    fprintf(out, "vm.peak_frames %zu\n", st->vm.peak_frames);
+    fprintf(out, "exit_code %d\n", exit_code);
+    if (out != stderr && fclose(out) != 0) {
+        perror("Error writing stats");
+        return -1;
+    }
+    return 0;
+}
+
+// --profile and --sample: text reports on stderr, plus JSON or folded
+// stacks when a file is named
+typedef struct {
+    int enabled;
+    int cycles;
+    const char *json_path;
+    int sample;
+    const char *folded_path;
+} ProfileOptions;
+
+static int write_profile(const Profile *profile, const Bytecode *bc, const char *json_path) {
+    profile_write_text(profile, bc, stderr);
+    if (!json_path) return 0;
+    FILE *out = fopen(json_path, "w");
+    if (!out) {
+        perror("Error writing profile");
+        return -1;
+    }
+    profile_write_json(profile, bc, out);
+    if (fclose(out) != 0) {
+        perror("Error writing profile");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_samples(const Sampler *sampler, const char *folded_path) {
+    sampler_write_report(sampler, stderr);
+    if (!folded_path) return 0;
+    FILE *out = fopen(folded_path, "w");
+    if (!out) {
+        perror("Error writing samples");
+        return -1;
+    }
+    sampler_write_folded(sampler, out);
+    if (fclose(out) != 0) {
+        perror("Error writing samples");
+        return -1;
+    }
+    return 0;
+}
+
+static int run_and_free(Bytecode *bc, int use_jit, const ProfileOptions *po, RunStats *st) {
+    Profile *profile = po->enabled ? profile_new(bc->code_size, po->cycles) : NULL;
+    Sampler *sampler = po->sample ? sampler_new(bc) : NULL;
+    phase_begin(st);
+    int exit_code = run_bytecode(bc, use_jit, NULL, profile, sampler, st->enabled ? &st->vm : NULL);
+    phase_end(st, PHASE_RUN);
+    if (st->enabled && write_stats(st, bc, exit_code) != 0 && exit_code == 0) {
+        exit_code = EXIT_FAILURE;
+    }
+    if (profile) {
+        if (write_profile(profile, bc, po->json_path) != 0 && exit_code == 0) {
+            exit_code = EXIT_FAILURE;
+        }
+        profile_free(profile);
+    }
+    if (sampler) {
+        if (write_samples(sampler, po->folded_path) != 0 && exit_code == 0) {
+            exit_code = EXIT_FAILURE;
+        }
+        sampler_free(sampler);
+    }
+    bytecode_free(bc);
+    return exit_code;
+}
+
+// Lexes the source repeatedly and reports throughput on stdout
+static void lex_bench(const SourceFile *source) {
+    size_t tokens = 0;
+    int iterations = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        Lexer lx;
+        lexer_init(&lx, source->data, source->length);
+        tokens = 0;
+        while (lexer_next(&lx).type != T_EOF) tokens++;
+        iterations++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < LEX_BENCH_SECONDS);
+    double bytes = (double)source->length * iterations;
+    printf("lex bytes=%zu tokens=%zu iterations=%d seconds=%.6f gb_per_s=%.3f\n",
+           source->length, tokens, iterations, elapsed, bytes / elapsed / 1e9);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    const char *filename = NULL;
+    int opt_level = DEFAULT_OPT_LEVEL;
+    int register_vm = 0;
+    int lex_only = 0;
+    int use_jit = 1;
+    int use_cache = 0;
+    const char *emit_path = NULL;
+    const char *emit_c_path = NULL;
+    ProfileOptions profiling = { 0, 0, NULL, 0, NULL };
+    RunStats stats;
+    memset(&stats, 0, sizeof(stats));
+    const char *batch_path = NULL;
+    int threads = -1, repeat = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-O", 2) == 0) {
+            opt_level = argv[i][2] ? atoi(argv[i] + 2) : DEFAULT_OPT_LEVEL;
+        } else if (strcmp(argv[i], "--vm=stack") == 0) {
+            register_vm = 0;
+        } else if (strcmp(argv[i], "--vm=register") == 0) {
+            register_vm = 1;
+        } else if (strcmp(argv[i], "--lex-bench") == 0) {
+            lex_only = 1;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            use_jit = 0;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = 1;
+        } else if (strncmp(argv[i], "--emit-bytecode=", 16) == 0 && argv[i][16]) {
+            emit_path = argv[i] + 16;
+        } else if (strncmp(argv[i], "--emit-c=", 9) == 0 && argv[i][9]) {
+            emit_c_path = argv[i] + 9;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profiling.enabled = 1;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10]) {
+            profiling.enabled = 1;
+            profiling.json_path = argv[i] + 10;
+        } else if (strcmp(argv[i], "--profile-cycles") == 0) {
+            profiling.enabled = profiling.cycles = 1;
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            profiling.sample = 1;
+        } else if (strncmp(argv[i], "--sample=", 9) == 0 && argv[i][9]) {
+            profiling.sample = 1;
+            profiling.folded_path = argv[i] + 9;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats.enabled = 1;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0 && argv[i][8]) {
+            stats.enabled = 1;
+            stats.path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0 && argv[i][8]) {
+            batch_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+            repeat = atoi(argv[i] + 9);
+        } else if (argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (batch_path) {
+        // Jobs name their own scripts, and run with no other mode
+        if (filename || register_vm || lex_only || use_cache || emit_path || emit_c_path ||
+            profiling.enabled || profiling.sample || stats.enabled ||
+            threads < -1 || threads > BATCH_THREADS_MAX || repeat == 0 || repeat < -1) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return batch_run(batch_path, threads < 0 ? 0 : threads, repeat < 0 ? 1 : repeat, opt_level,
+                         use_jit);
+    }
+    if (!filename || threads >= 0 || repeat >= 0) {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
+    int bytecode_input = has_suffix(filename, BCCACHE_EXT);
+    if (register_vm && (use_cache || emit_path || bytecode_input)) {
+        fprintf(stderr, "Compiled bytecode runs on the stack VM only\n");
+        return EXIT_FAILURE;
+    }
+    if (emit_c_path && (register_vm || use_cache || emit_path || bytecode_input)) {
+        fprintf(stderr, "--emit-c takes a source file and no other output option\n");
+        return EXIT_FAILURE;
+    }
+    if ((profiling.enabled || profiling.sample || stats.enabled) &&
+        (register_vm || emit_path || emit_c_path || lex_only)) {
+        fprintf(stderr, "--profile, --sample and --stats run a script on the stack VM and take no "
+                        "other mode\n");
+        return EXIT_FAILURE;
+    }
+    if (profiling.cycles && !PROFILE_HAS_CYCLES) {
+        fprintf(stderr, "--profile-cycles needs an x86 processor\n");
+        return EXIT_FAILURE;
+    }
 
-    const char *filename = argv[1];
-    FILE *file = fopen(filename, "r");
-    if (!file) {
+    if (bytecode_input) {
+        phase_begin(&stats);
+        Bytecode *bc = bccache_load(filename, NULL, NULL);
+        phase_end(&stats, PHASE_READ);
+        if (!bc) {
+            fprintf(stderr, "Invalid or outdated bytecode file: %s\n", filename);
+            return EXIT_FAILURE;
+        }
+        return run_and_free(bc, use_jit, &profiling, &stats);
+    }
+
+    SourceFile source;
+    phase_begin(&stats);
+    if (source_open(&source, filename) != 0) {
         perror("Error opening file");
         return EXIT_FAILURE;
     }
-    fseek(file, 0, SEEK_END);
-    long fsize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    phase_end(&stats, PHASE_READ);
+    stats.source_bytes = source.length;
+    if (lex_only) {
+        lex_bench(&source);
+        source_close(&source);
+        return EXIT_SUCCESS;
+    }
 
-    char *source = malloc(fsize + 1);
-    if (fread(source, 1, fsize, file) != (size_t)fsize) {
-        perror("Error reading file");
-        fclose(file);
-        free(source);
-        return EXIT_FAILURE;
+    // Warm start: a cache compiled from identical source at the same level
+    // skips the front end entirely
+    char *cache_path = NULL;
+    uint64_t source_hash = 0;
+    if (use_cache || emit_path) {
+        source_hash = bccache_hash(source.data, source.length);
+    }
+    if (use_cache && !emit_path) {
+        cache_path = cache_path_for(filename);
+        uint64_t cached_hash;
+        int cached_level;
+        phase_begin(&stats);
+        Bytecode *bc = bccache_load(cache_path, &cached_hash, &cached_level);
+        phase_end(&stats, PHASE_READ);
+        if (bc && cached_hash == source_hash && cached_level == opt_level) {
+            source_close(&source);
+            free(cache_path);
+            return run_and_free(bc, use_jit, &profiling, &stats);
+        }
+        if (bc) bytecode_free(bc);
     }
-    source[fsize] = '\0';
-    fclose(file);
 
-    size_t token_count;
-    Token *tokens = lex(source, &token_count);
-    ASTNode *ast = parse(tokens, token_count);
-    Bytecode *bc = compile(ast);
+    if (stats.enabled) {
+        // parse() lexes as it goes; this separate pass measures the lexer
+        // on its own
+        phase_begin(&stats);
+        TokenStream *tokens = lex(source.data, source.length);
+        phase_end(&stats, PHASE_LEX);
+        stats.tokens = tokens->count;
+        stats.token_bytes = sizeof(TokenStream) +
+                            tokens->capacity * (sizeof(uint8_t) + 2 * sizeof(uint32_t)) +
+                            tokens->line_capacity * sizeof(uint32_t);
+        free_tokens(tokens);
+    }
 
-    int exit_code = run_bytecode(bc);
+    phase_begin(&stats);
+    ASTNode *ast = parse(source.data, source.length);
+    phase_end(&stats, PHASE_PARSE);
+    if (stats.enabled) {
+        stats.ast_nodes = ast_node_count(ast);
+        stats.ast_bytes = ast->as.program.arena->bytes_allocated;
+    }
+    // The AST holds its own copies of all identifiers and literals
+    source_close(&source);
+    phase_begin(&stats);
+    if (opt_level >= 2) optimize_ast(ast);
+
+    if (emit_c_path) {
+        // "-" writes the C source to stdout
+        FILE *out = strcmp(emit_c_path, "-") == 0 ? stdout : fopen(emit_c_path, "w");
+        if (!out) {
+            perror("Error writing C file");
+            free_ast(ast);
+            return EXIT_FAILURE;
+        }
+        emit_c(ast, out);
+        int failed = out == stdout ? fflush(out) != 0 : fclose(out) != 0;
+        if (failed) perror("Error writing C file");
+        free_ast(ast);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    int exit_code;
+    if (register_vm) {
+        RegProgram *rp = reg_compile(ast);
+        exit_code = run_regprogram(rp, NULL);
+        regprogram_free(rp);
+    } else {
+        Bytecode *bc = compile(ast);
+        if (opt_level >= 1) peephole_optimize(bc);
+        phase_end(&stats, PHASE_COMPILE);
+        if (cache_path && bccache_write(bc, cache_path, source_hash, opt_level) != 0) {
+            perror("Warning: cannot write bytecode cache");
+        }
+        if (emit_path) {
+            exit_code = EXIT_SUCCESS;
+            if (bccache_write(bc, emit_path, source_hash, opt_level) != 0) {
+                perror("Error writing bytecode file");
+                exit_code = EXIT_FAILURE;
+            }
+            bytecode_free(bc);
+        } else {
+            exit_code = run_and_free(bc, use_jit, &profiling, &stats);
+        }
+    }
+    free(cache_path);
 
-    bytecode_free(bc);
     free_ast(ast);
-    free_tokens(tokens, token_count);
-    free(source);
 
     return exit_code;
 }
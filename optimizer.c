@@ -0,0 +1,214 @@
+// optimizer.c
+#include "optimizer.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+static ASTNode *optimize_expression(Arena *arena, ASTNode *expr);
+static ASTNode *optimize_statement(Arena *arena, ASTNode *stmt);
+static void optimize_list(Arena *arena, ASTNodeList **list);
+
+static int is_int_literal(const ASTNode *n) {
+    return n->type == AST_LITERAL && !n->as.literal.is_string;
+}
+
+static int is_int_value(const ASTNode *n, int value) {
+    return is_int_literal(n) && n->as.literal.value == value;
+}
+
+// Whether n certainly evaluates to an int. Arithmetic turns strings into
+// ints, so x + 0 is only x when x is one already.
+static int yields_int(const ASTNode *n) {
+    if (n->type == AST_LITERAL) return !n->as.literal.is_string;
+    return n->type == AST_BINARY_OP && n->as.binary.op != T_DOT;
+}
+
+// Function calls are the only expressions with side effects
+static int has_side_effects(const ASTNode *n) {
+    switch (n->type) {
+        case AST_FUNC_CALL: return 1;
+        case AST_BINARY_OP:
+            return has_side_effects(n->as.binary.left) || has_side_effects(n->as.binary.right);
+        default: return 0;
+    }
+}
+
+// Evaluates a op b the way the VM would. Returns 0 when the result is
+// left for runtime (division by zero, INT_MIN / -1); + - * wrap.
+static int fold(TokenType op, int a, int b, int *out) {
+    switch (op) {
+        case T_PLUS:  *out = (int)((unsigned)a + (unsigned)b); return 1;
+        case T_MINUS: *out = (int)((unsigned)a - (unsigned)b); return 1;
+        case T_STAR:  *out = (int)((unsigned)a * (unsigned)b); return 1;
+        case T_SLASH:
+        case T_MOD:
+            if (b == 0 || (a == INT_MIN && b == -1)) return 0;
+            *out = op == T_SLASH ? a / b : a % b;
+            return 1;
+        case T_GT:  *out = a > b;  return 1;
+        case T_LT:  *out = a < b;  return 1;
+        case T_GTE: *out = a >= b; return 1;
+        case T_LTE: *out = a <= b; return 1;
+        case T_EQ:  *out = a == b; return 1;
+        case T_NEQ: *out = a != b; return 1;
+        default: return 0;
+    }
+}
+
+// Text of a literal as the VM's concatenation would render it
+static const char *literal_text(const ASTNode *n, char *digits, size_t size) {
+    if (n->as.literal.is_string) return n->as.literal.str;
+    snprintf(digits, size, "%d", n->as.literal.value);
+    return digits;
+}
+
+static char *concat_literals(Arena *arena, const ASTNode *l, const ASTNode *r) {
+    char l_digits[16], r_digits[16];
+    const char *a = literal_text(l, l_digits, sizeof(l_digits));
+    const char *b = literal_text(r, r_digits, sizeof(r_digits));
+    size_t a_length = strlen(a), b_length = strlen(b);
+    char *text = arena_alloc(arena, a_length + b_length + 1);
+    memcpy(text, a, a_length);
+    memcpy(text + a_length, b, b_length + 1);
+    return text;
+}
+
+// Dropped nodes stay in the program's arena until the whole tree is freed
+static ASTNode *optimize_binary(Arena *arena, ASTNode *expr) {
+    ASTNode *l = expr->as.binary.left = optimize_expression(arena, expr->as.binary.left);
+    ASTNode *r = expr->as.binary.right = optimize_expression(arena, expr->as.binary.right);
+    TokenType op = expr->as.binary.op;
+
+    int folded;
+    if (is_int_literal(l) && is_int_literal(r) &&
+        fold(op, l->as.literal.value, r->as.literal.value, &folded)) {
+        l->as.literal.value = folded;
+        l->line = expr->line;
+        l->column = expr->column;
+        return l;
+    }
+
+    if (op == T_DOT && l->type == AST_LITERAL && r->type == AST_LITERAL) {
+        l->as.literal.str = concat_literals(arena, l, r);
+        l->as.literal.is_string = 1;
+        l->line = expr->line;
+        l->column = expr->column;
+        return l;
+    }
+
+    // Algebraic identities
+    switch (op) {
+        case T_PLUS:
+            if (is_int_value(r, 0) && yields_int(l)) return l;
+            if (is_int_value(l, 0) && yields_int(r)) return r;
+            break;
+        case T_MINUS:
+            if (is_int_value(r, 0) && yields_int(l)) return l;
+            break;
+        case T_STAR:
+            if (is_int_value(r, 1) && yields_int(l)) return l;
+            if (is_int_value(l, 1) && yields_int(r)) return r;
+            if (is_int_value(r, 0) && !has_side_effects(l)) return r;
+            if (is_int_value(l, 0) && !has_side_effects(r)) return l;
+            break;
+        case T_SLASH:
+            if (is_int_value(r, 1) && yields_int(l)) return l;
+            break;
+        default:
+            break;
+    }
+    return expr;
+}
+
+static ASTNode *optimize_expression(Arena *arena, ASTNode *expr) {
+    switch (expr->type) {
+        case AST_BINARY_OP:
+            return optimize_binary(arena, expr);
+        case AST_FUNC_CALL:
+            for (size_t i = 0; i < expr->as.func_call.arg_count; i++) {
+                expr->as.func_call.args[i] = optimize_expression(arena, expr->as.func_call.args[i]);
+            }
+            return expr;
+        default:
+            return expr;
+    }
+}
+
+// Returns the replacement statement: the node itself, a block whose
+// statements are spliced into the enclosing list, or NULL to drop it.
+static ASTNode *optimize_statement(Arena *arena, ASTNode *stmt) {
+    switch (stmt->type) {
+        case AST_EXPR_STMT:
+            stmt->as.expr_stmt.expr = optimize_expression(arena, stmt->as.expr_stmt.expr);
+            return stmt;
+        case AST_VAR_ASSIGN:
+            stmt->as.var_assign.value = optimize_expression(arena, stmt->as.var_assign.value);
+            return stmt;
+        case AST_RETURN:
+            stmt->as.return_stmt.value = optimize_expression(arena, stmt->as.return_stmt.value);
+            return stmt;
+        case AST_IF: {
+            ASTNode *cond = stmt->as.if_stmt.cond = optimize_expression(arena, stmt->as.if_stmt.cond);
+            optimize_list(arena, &stmt->as.if_stmt.then_branch->as.block.statements);
+            if (stmt->as.if_stmt.else_branch) {
+                optimize_list(arena, &stmt->as.if_stmt.else_branch->as.block.statements);
+            }
+            if (!is_int_literal(cond)) return stmt;
+            ASTNode *taken;
+            if (cond->as.literal.value) {
+                taken = stmt->as.if_stmt.then_branch;
+            } else {
+                taken = stmt->as.if_stmt.else_branch;
+            }
+            return taken;
+        }
+        case AST_WHILE: {
+            ASTNode *cond = stmt->as.while_stmt.cond = optimize_expression(arena, stmt->as.while_stmt.cond);
+            if (is_int_value(cond, 0)) {
+                return NULL;
+            }
+            optimize_list(arena, &stmt->as.while_stmt.body->as.block.statements);
+            return stmt;
+        }
+        case AST_FUNCTION:
+            optimize_list(arena, &stmt->as.func_def.body->as.block.statements);
+            return stmt;
+        default:
+            return stmt;
+    }
+}
+
+static void optimize_list(Arena *arena, ASTNodeList **list) {
+    ASTNodeList **link = list;
+    ASTNodeList *last = NULL;
+    while (*link) {
+        ASTNodeList *item = *link;
+        ASTNode *result = optimize_statement(arena, item->node);
+        if (result && result->type == AST_BLOCK) {
+            // Splice the surviving branch's statements in place of the if
+            ASTNodeList *stmts = result->as.block.statements;
+            if (stmts) {
+                ASTNodeList *tail = stmts->tail;
+                tail->next = item->next;
+                *link = stmts;
+                // Spliced statements were already optimized; skip past them
+                last = tail;
+                link = &tail->next;
+                continue;
+            }
+            result = NULL;
+        }
+        if (!result) {
+            *link = item->next;
+            continue;
+        }
+        item->node = result;
+        last = item;
+        link = &item->next;
+    }
+    if (*list) (*list)->tail = last;
+}
+
+void optimize_ast(ASTNode *program) {
+    optimize_list(program->as.program.arena, &program->as.program.statements);
+}
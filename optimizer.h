@@ -0,0 +1,10 @@
+// optimizer.h
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "ast.h"
+
+// Folds constant expressions and removes statically dead branches in place
+void optimize_ast(ASTNode *program);
+
+#endif // OPTIMIZER_H
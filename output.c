@@ -0,0 +1,119 @@
+// output.c
+#define _POSIX_C_SOURCE 200809L
+#include "output.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Strings at least this long are not copied; they go out in one writev
+// together with whatever is buffered ahead of them
+#define OUTPUT_DIRECT_MIN (OUTPUT_BUFFER_SIZE / 2)
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void output_init(Output *out, const OutputSink *sink) {
+    out->sink = sink ? *sink : (OutputSink){ .fd = STDOUT_FILENO };
+    out->length = 0;
+    out->failed = 0;
+}
+
+// Writes head then tail, resuming after short writes and signals
+static void write_fd(Output *out, const char *head, size_t head_len,
+                     const char *tail, size_t tail_len) {
+    struct iovec iov[2] = { { (void*)head, head_len }, { (void*)tail, tail_len } };
+    struct iovec *v = iov;
+    int count = 2;
+    if (!head_len) { v++; count--; }
+    if (!tail_len) count--;
+    while (count > 0) {
+        ssize_t written = writev(out->sink.fd, v, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            out->failed = 1;
+            return;
+        }
+        size_t left = (size_t)written;
+        while (count > 0 && left >= v->iov_len) {
+            left -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (char*)v->iov_base + left;
+            v->iov_len -= left;
+        }
+    }
+}
+
+static void emit(Output *out, const char *head, size_t head_len,
+                 const char *tail, size_t tail_len) {
+    if (out->failed) return;
+    if (out->sink.write) {
+        if (head_len) out->sink.write(out->sink.ctx, head, head_len);
+        if (tail_len) out->sink.write(out->sink.ctx, tail, tail_len);
+    } else {
+        write_fd(out, head, head_len, tail, tail_len);
+    }
+}
+
+void output_flush(Output *out) {
+    if (!out->length) return;
+    emit(out, out->buf, out->length, NULL, 0);
+    out->length = 0;
+}
+
+void output_str(Output *out, const char *s) {
+    output_bytes(out, s, strlen(s));
+}
+
+void output_bytes(Output *out, const char *s, size_t n) {
+    if (n <= OUTPUT_BUFFER_SIZE - out->length) {
+        memcpy(out->buf + out->length, s, n);
+        out->length += n;
+    } else if (n >= OUTPUT_DIRECT_MIN) {
+        emit(out, out->buf, out->length, s, n);
+        out->length = 0;
+    } else {
+        output_flush(out);
+        memcpy(out->buf, s, n);
+        out->length = n;
+    }
+}
+
+void output_int(Output *out, int value) {
+    if (OUTPUT_BUFFER_SIZE - out->length < INT_DIGITS_MAX) output_flush(out);
+    out->length += format_int(out->buf + out->length, value);
+}
+
+// Converts two digits per step from the right; no format parsing
+size_t format_int(char *digits, int value) {
+    char scratch[INT_DIGITS_MAX];
+    char *end = scratch + INT_DIGITS_MAX, *p = end;
+    unsigned u = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    while (u >= 100) {
+        unsigned pair = u % 100;
+        u /= 100;
+        p -= 2;
+        memcpy(p, &digit_pairs[pair * 2], 2);
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[u * 2], 2);
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (value < 0) *--p = '-';
+    memcpy(digits, p, (size_t)(end - p));
+    return (size_t)(end - p);
+}
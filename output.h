@@ -0,0 +1,38 @@
+// output.h
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+// Bytes of script output gathered before a write
+#define OUTPUT_BUFFER_SIZE 16384
+
+// Longest int in decimal, "-2147483648"
+#define INT_DIGITS_MAX 11
+
+// Where script output goes: the write callback when set, the fd otherwise
+typedef struct {
+    int fd;
+    void (*write)(void *ctx, const char *data, size_t length);
+    void *ctx;
+} OutputSink;
+
+typedef struct {
+    OutputSink sink;
+    size_t length;
+    int failed;             // a write failed; later output is dropped
+    char buf[OUTPUT_BUFFER_SIZE];
+} Output;
+
+// sink may be NULL for stdout
+void output_init(Output *out, const OutputSink *sink);
+void output_int(Output *out, int value);
+void output_str(Output *out, const char *s);
+void output_bytes(Output *out, const char *s, size_t length);
+void output_flush(Output *out);
+
+// Writes value in decimal to digits, which holds INT_DIGITS_MAX bytes, and
+// returns the length; no terminator is added
+size_t format_int(char *digits, int value);
+
+#endif // OUTPUT_H
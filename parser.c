@@ -1,24 +1,30 @@
 // parser.c
-#define _GNU_SOURCE
 #include "parser.h"
+#include "lexer.h"
+#include "error.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+// Tokens are pulled from the lexer on demand; only a two-token lookahead
+// window is ever held in memory.
 typedef struct {
-    Token *tokens;
-    size_t count;
-    size_t pos;
+    Lexer lx;
+    Token la[2];
+    Arena *arena;
 } Parser;
 
-static Token *peek(Parser *p) {
-    return p->pos < p->count ? &p->tokens[p->pos] : NULL;
+static TokenType peek(Parser *p) {
+    return p->la[0].type;
 }
-static Token *advance(Parser *p) {
-    return p->pos < p->count ? &p->tokens[p->pos++] : NULL;
+static Token advance(Parser *p) {
+    Token t = p->la[0];
+    p->la[0] = p->la[1];
+    if (p->la[0].type != T_EOF) p->la[1] = lexer_next(&p->lx);
+    return t;
 }
 static int match(Parser *p, TokenType tt) {
-    if (peek(p)->type == tt) {
+    if (peek(p) == tt) {
         advance(p);
         return 1;
     }
@@ -26,66 +32,114 @@ static int match(Parser *p, TokenType tt) {
 }
 static void expect(Parser *p, TokenType tt, const char *msg) {
     if (!match(p, tt)) {
-        Token *t = peek(p);
-       fprintf(stderr, "Parse error at %zu:%zu: %s", t->line, t->column, msg);
-        exit(EXIT_FAILURE);
+        Token t = p->la[0];
+        error_raise("Parse error at %u:%u: %s", t.line, t.column, msg);
     }
 }
 static int get_prec(TokenType op) {
     switch (op) {
-        case T_STAR: case T_SLASH: case T_MOD: return 3;
-        case T_PLUS: case T_MINUS: return 2;
+        case T_STAR: case T_SLASH: case T_MOD: return 4;
+        case T_PLUS: case T_MINUS: return 3;
+        case T_DOT: return 2;
         case T_GT: case T_LT: case T_GTE:
         case T_LTE: case T_EQ: case T_NEQ: return 1;
         default: return 0;
     }
 }
 
+static const char *text_of(Parser *p, Token t) {
+    return p->lx.source + t.offset;
+}
+
+// Creates a node positioned at token t
+static ASTNode *node_at(Parser *p, ASTNodeType type, Token t) {
+    return ast_node_new(p->arena, type, t.line, t.column);
+}
+
+// Makes room for one more item in an arena array holding count of them.
+// The capacity follows from count (4, then doubling), and outgrown copies
+// stay in the arena, so nothing leaks when a parse error unwinds.
+static void *grow_items(Parser *p, void *items, size_t count, size_t item_size) {
+    if (count > 0 && (count < 4 || (count & (count - 1)) != 0)) return items;
+    void *grown = arena_alloc(p->arena, (count ? count * 2 : 4) * item_size);
+    if (count) memcpy(grown, items, count * item_size);
+    return grown;
+}
+
+// Copies a token's text into the arena as a NUL-terminated string
+static char *token_strdup(Parser *p, Token t) {
+    return arena_strndup(p->arena, text_of(p, t), t.length);
+}
+
+static int token_int(Parser *p, Token t) {
+    const char *text = text_of(p, t);
+    unsigned value = 0;
+    for (uint32_t i = 0; i < t.length; i++) {
+        value = value * 10 + (unsigned)(text[i] - '0');
+    }
+    return (int)value;
+}
+
 static ASTNode *parse_program(Parser *p);
 static ASTNode *parse_statement(Parser *p);
 static ASTNode *parse_block(Parser *p);
 static ASTNode *parse_expression(Parser *p, int min_prec);
 static ASTNode *parse_primary(Parser *p);
 
-ASTNode *parse(Token *tokens, size_t count) {
-    Parser p = { tokens, count, 0 };
-    return parse_program(&p);
+ASTNode *parse(const char *source, size_t length) {
+    Parser p;
+    lexer_init(&p.lx, source, length);
+    p.la[0] = lexer_next(&p.lx);
+    p.la[1] = p.la[0].type == T_EOF ? p.la[0] : lexer_next(&p.lx);
+    p.arena = arena_new();
+    // The tree so far goes with an error
+    ErrorTrap trap;
+    error_trap(&trap);
+    if (setjmp(trap.env)) {
+        arena_free(p.arena);
+        error_rethrow(&trap);
+    }
+    ASTNode *root = parse_program(&p);
+    error_untrap(&trap);
+    return root;
 }
 
 static ASTNode *parse_program(Parser *p) {
-    ASTNode *root = ast_node_new(AST_PROGRAM, 0, 0);
-    while (peek(p)->type != T_EOF) {
-        if (peek(p)->type == T_FUNCTION) {
+    ASTNode *root = ast_node_new(p->arena, AST_PROGRAM, 0, 0);
+    root->as.program.arena = p->arena;
+    while (peek(p) != T_EOF) {
+        if (peek(p) == T_FUNCTION) {
             advance(p);
-            Token *name = advance(p);
+            Token name = advance(p);
             expect(p, T_LPAREN, "Expected '(' after function name");
             char **params = NULL; size_t pc=0;
             if (!match(p, T_RPAREN)) {
                 do {
-                    Token *t = advance(p);
-                    params = realloc(params, sizeof(char*)*(pc+1));
-                    params[pc++] = strdup(t->text);
+                    Token t = advance(p);
+                    params = grow_items(p, params, pc, sizeof(char*));
+                    params[pc++] = token_strdup(p, t);
                 } while(match(p, T_COMMA));
                 expect(p, T_RPAREN, "Expected ')' after params");
             }
             ASTNode *body = parse_block(p);
-            ASTNode *fn = ast_node_new(AST_FUNCTION, name->line, name->column);
-            fn->as.func_def.name = strdup(name->text);
+            ASTNode *fn = node_at(p, AST_FUNCTION, name);
+            fn->as.func_def.name = token_strdup(p, name);
             fn->as.func_def.params = params;
             fn->as.func_def.param_count = pc;
             fn->as.func_def.body = body;
-            ast_node_list_append(&root->as.program, fn);
+            ast_node_list_append(p->arena, &root->as.program.statements, fn);
         } else {
             ASTNode *stmt = parse_statement(p);
-            ast_node_list_append(&root->as.program, stmt);
+            ast_node_list_append(p->arena, &root->as.program.statements, stmt);
         }
     }
     return root;
 }
 
 static ASTNode *parse_statement(Parser *p) {
-    Token *t = peek(p);
-    if (t->type == T_IF) {
+    Token t = p->la[0];
+    TokenType type = t.type;
+    if (type == T_IF) {
         advance(p);
         expect(p, T_LPAREN, "Expected '(' after if");
         ASTNode *cond = parse_expression(p, 0);
@@ -95,95 +149,95 @@ static ASTNode *parse_statement(Parser *p) {
         if (match(p, T_ELSE)) {
             else_br = parse_block(p);
         }
-        ASTNode *n = ast_node_new(AST_IF, t->line, t->column);
+        ASTNode *n = node_at(p, AST_IF, t);
         n->as.if_stmt.cond = cond;
         n->as.if_stmt.then_branch = then_br;
         n->as.if_stmt.else_branch = else_br;
         return n;
     }
-    if (t->type == T_WHILE) {
+    if (type == T_WHILE) {
         advance(p);
         expect(p, T_LPAREN, "Expected '(' after while");
         ASTNode *cond = parse_expression(p, 0);
         expect(p, T_RPAREN, "Expected ')' after condition");
         ASTNode *body = parse_block(p);
-        ASTNode *n = ast_node_new(AST_WHILE, t->line, t->column);
+        ASTNode *n = node_at(p, AST_WHILE, t);
         n->as.while_stmt.cond = cond;
         n->as.while_stmt.body = body;
         return n;
     }
-    if (t->type == T_RETURN) {
+    if (type == T_RETURN) {
         advance(p);
         ASTNode *val = parse_expression(p, 0);
         expect(p, T_SEMICOLON, "Expected ';' after return value");
-        ASTNode *n = ast_node_new(AST_RETURN, t->line, t->column);
+        ASTNode *n = node_at(p, AST_RETURN, t);
         n->as.return_stmt.value = val;
         return n;
     }
-    if (t->type == T_IDENTIFIER && t->text[0]=='$' &&
-        p->pos + 1 < p->count && p->tokens[p->pos + 1].type == T_ASSIGN) {
-        Token *name = advance(p); // consume identifier
+    if (type == T_IDENTIFIER && text_of(p, t)[0]=='$' && p->la[1].type == T_ASSIGN) {
+        Token name = advance(p); // consume identifier
         advance(p); // consume '='
         ASTNode *v = parse_expression(p, 0);
         expect(p, T_SEMICOLON, "Expected ';' after assignment");
-        ASTNode *n = ast_node_new(AST_VAR_ASSIGN, name->line, name->column);
-        n->as.var_assign.name = strdup(name->text);
+        ASTNode *n = node_at(p, AST_VAR_ASSIGN, name);
+        n->as.var_assign.name = token_strdup(p, name);
         n->as.var_assign.value = v;
         return n;
     }
     ASTNode *expr = parse_expression(p, 0);
     expect(p, T_SEMICOLON, "Expected ';' after expression");
-    ASTNode *n = ast_node_new(AST_EXPR_STMT, expr->line, expr->column);
+    ASTNode *n = ast_node_new(p->arena, AST_EXPR_STMT, expr->line, expr->column);
     n->as.expr_stmt.expr = expr;
     return n;
 }
 
 static ASTNode *parse_block(Parser *p) {
     expect(p, T_LBRACE, "Expected '{'");
-    ASTNode *node = ast_node_new(AST_BLOCK, 0, 0);
+    ASTNode *node = ast_node_new(p->arena, AST_BLOCK, 0, 0);
     while (!match(p, T_RBRACE)) {
         ASTNode *s = parse_statement(p);
-        ast_node_list_append(&node->as.block.statements, s);
+        ast_node_list_append(p->arena, &node->as.block.statements, s);
     }
     return node;
 }
 
 static ASTNode *parse_primary(Parser *p) {
-    Token *t = peek(p);
+    Token t = p->la[0];
+    TokenType type = t.type;
     if (match(p, T_NUMBER)) {
-        ASTNode *n = ast_node_new(AST_LITERAL, t->line, t->column);
+        ASTNode *n = node_at(p, AST_LITERAL, t);
         n->as.literal.is_string = 0;
-        n->as.literal.value = atoi(t->text);
+        n->as.literal.value = token_int(p, t);
         return n;
     }
     if (match(p, T_STRING)) {
-        ASTNode *n = ast_node_new(AST_LITERAL, t->line, t->column);
+        ASTNode *n = node_at(p, AST_LITERAL, t);
         n->as.literal.is_string = 1;
-        n->as.literal.str = strdup(t->text);
+        n->as.literal.str = token_strdup(p, t);
         return n;
     }
-    if (t->type == T_IDENTIFIER || t->type == T_PRINT) {
+    if (type == T_IDENTIFIER || type == T_PRINT) {
         advance(p);
-        if (peek(p)->type==T_LPAREN) {
-            char *name=strdup(t->text);
+        if (peek(p)==T_LPAREN) {
+            char *name=token_strdup(p, t);
             advance(p);
             ASTNode **args=NULL; size_t ac=0;
             if (!match(p, T_RPAREN)) {
                 do {
                     ASTNode *a = parse_expression(p, 0);
-                    args = realloc(args, sizeof(ASTNode*)*(ac+1));
+                    args = grow_items(p, args, ac, sizeof(ASTNode*));
                     args[ac++] = a;
                 } while(match(p, T_COMMA));
                 expect(p, T_RPAREN, "Expected ')' after args");
             }
-            ASTNode *n = ast_node_new(AST_FUNC_CALL, t->line, t->column);
+            ASTNode *n = node_at(p, AST_FUNC_CALL, t);
             n->as.func_call.name = name;
             n->as.func_call.args = args;
             n->as.func_call.arg_count = ac;
             return n;
         }
-        ASTNode *n = ast_node_new(AST_VAR_REF, t->line, t->column);
-        n->as.var_ref.name = strdup(t->text);
+        ASTNode *n = node_at(p, AST_VAR_REF, t);
+        n->as.var_ref.name = token_strdup(p, t);
         return n;
     }
     if (match(p, T_LPAREN)) {
@@ -191,20 +245,19 @@ static ASTNode *parse_primary(Parser *p) {
         expect(p, T_RPAREN, "Expected ')'");
         return n;
     }
-    fprintf(stderr, "Unexpected token '%s' at %zu:%zu", t->text, t->line, t->column);
-    exit(EXIT_FAILURE);
+    error_raise("Unexpected token '%.*s' at %u:%u", (int)t.length, text_of(p, t), t.line, t.column);
 }
 
 static ASTNode *parse_expression(Parser *p, int min_prec) {
     ASTNode *lhs = parse_primary(p);
     while (1) {
-        Token *t = peek(p);
-        int prec = get_prec(t->type);
+        Token t = p->la[0];
+        TokenType op = t.type;
+        int prec = get_prec(op);
         if (prec == 0 || prec < min_prec) break;
-        TokenType op = t->type;
         advance(p);
         ASTNode *rhs = parse_expression(p, prec+1);
-        ASTNode *n = ast_node_new(AST_BINARY_OP, t->line, t->column);
+        ASTNode *n = node_at(p, AST_BINARY_OP, t);
         n->as.binary.op = op;
         n->as.binary.left = lhs;
         n->as.binary.right = rhs;
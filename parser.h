@@ -5,6 +5,7 @@
 #include "tokens.h"
 #include "ast.h"
 
-ASTNode *parse(Token *tokens, size_t count);
+// Lexes and parses source (not necessarily NUL-terminated) in one pass
+ASTNode *parse(const char *source, size_t length);
 
 #endif // PARSER_H
@@ -0,0 +1,135 @@
+// peephole.c
+#include "peephole.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Fuses common compiler output into superinstructions:
+//   LOAD_SLOT s; CONSTANT k; ADD; STORE_SLOT s  ->  INC_SLOT s k
+//   CONSTANT k; ADD                             ->  ADD_CONST k
+//   <compare>; JMP_IF_FALSE off                 ->  JMP_IF_NOT_<compare> off
+// A sequence is only fused when no jump or call lands inside it. Jumps are then
+// re-targeted and line runs moved through an old-offset -> new-offset map,
+// which sends the inner instructions of a fused sequence to the fused one.
+// The code only shrinks, so every offset still fits its operand, and long
+// jumps that now fit are relaxed to the short form. Compare-and-branch
+// fusion is limited to short JMP_IF_FALSE; the fused forms have no long
+// encoding.
+
+typedef struct {
+    const uint8_t *code;
+    size_t size;
+    const uint8_t *is_target;
+} Scan;
+
+// Checks that the instructions starting at ip have the given opcodes and
+// that none but the first is a jump target. Fills starts[] with their offsets.
+static int match(const Scan *s, size_t ip, const uint8_t *ops, size_t n, size_t *starts) {
+    for (size_t i = 0; i < n; i++) {
+        if (ip >= s->size || s->code[ip] != ops[i]) return 0;
+        if (i > 0 && s->is_target[ip]) return 0;
+        starts[i] = ip;
+        ip += opcode_length(s->code[ip]);
+    }
+    return 1;
+}
+
+static uint8_t fused_compare_jump(uint8_t op) {
+    switch (op) {
+        case OP_GT:  return OP_JMP_IF_NOT_GT;
+        case OP_LT:  return OP_JMP_IF_NOT_LT;
+        case OP_GTE: return OP_JMP_IF_NOT_GTE;
+        case OP_LTE: return OP_JMP_IF_NOT_LTE;
+        case OP_EQ:  return OP_JMP_IF_NOT_EQ;
+        case OP_NEQ: return OP_JMP_IF_NOT_NEQ;
+        default:     return 0;
+    }
+}
+
+void peephole_optimize(Bytecode *bc) {
+    const uint8_t *code = bc->code;
+    size_t size = bc->code_size;
+    uint8_t *is_target = calloc(size + 1, 1);
+    for (size_t ip = 0; ip < size; ip += opcode_length(code[ip])) {
+        if (opcode_is_jump(code[ip])) {
+            is_target[jump_target(code, ip)] = 1;
+        }
+    }
+    for (size_t i = 0; i < bc->func_count; i++) {
+        is_target[bc->functions[i].entry] = 1;
+    }
+
+    Scan s = { code, size, is_target };
+    uint8_t *out = malloc(size ? size : 1);
+    size_t *new_at = malloc((size + 1) * sizeof(size_t));
+    // For each jump written to out: its new position and old target
+    size_t *fix_pos = malloc((size / 2 + 1) * sizeof(size_t));
+    size_t *fix_target = malloc((size / 2 + 1) * sizeof(size_t));
+    size_t out_size = 0, fix_count = 0;
+
+    static const uint8_t inc_slot[] = { OP_LOAD_SLOT, OP_CONSTANT, OP_ADD, OP_STORE_SLOT };
+    static const uint8_t add_const[] = { OP_CONSTANT, OP_ADD };
+    size_t at[4];
+
+    size_t ip = 0;
+    while (ip < size) {
+        uint8_t op = code[ip];
+        new_at[ip] = out_size;
+
+        if (match(&s, ip, inc_slot, 4, at) &&
+            read_u16(&code[at[0] + 1]) == read_u16(&code[at[3] + 1])) {
+            for (int i = 1; i < 4; i++) new_at[at[i]] = out_size;
+            out[out_size++] = OP_INC_SLOT;
+            memcpy(&out[out_size], &code[at[0] + 1], 2);
+            memcpy(&out[out_size + 2], &code[at[1] + 1], 2);
+            out_size += 4;
+            ip = at[3] + 3;
+            continue;
+        }
+        if (match(&s, ip, add_const, 2, at)) {
+            new_at[at[1]] = out_size;
+            out[out_size++] = OP_ADD_CONST;
+            memcpy(&out[out_size], &code[at[0] + 1], 2);
+            out_size += 2;
+            ip = at[1] + 1;
+            continue;
+        }
+        uint8_t fused = fused_compare_jump(op);
+        if (fused && ip + 1 < size && code[ip + 1] == OP_JMP_IF_FALSE && !is_target[ip + 1]) {
+            fix_pos[fix_count] = out_size;
+            fix_target[fix_count++] = jump_target(code, ip + 1);
+            new_at[ip + 1] = out_size;
+            out[out_size] = fused;
+            out_size += 2;
+            ip += 3;
+            continue;
+        }
+
+        size_t len = opcode_length(op);
+        memcpy(&out[out_size], &code[ip], len);
+        if (opcode_is_jump(op)) {
+            fix_pos[fix_count] = out_size;
+            fix_target[fix_count++] = jump_target(code, ip);
+        }
+        out_size += len;
+        ip += len;
+    }
+    new_at[size] = out_size;
+
+    for (size_t i = 0; i < fix_count; i++) {
+        set_jump_target(out, fix_pos[i], new_at[fix_target[i]]);
+    }
+    for (size_t i = 0; i < bc->func_count; i++) {
+        bc->functions[i].entry = (uint32_t)new_at[bc->functions[i].entry];
+    }
+    bytecode_remap_lines(bc, new_at);
+
+    free(bc->code);
+    bc->code = out;
+    bc->code_size = out_size;
+    bc->code_capacity = size ? size : 1;
+    free(new_at);
+    free(fix_pos);
+    free(fix_target);
+    free(is_target);
+    bytecode_relax_jumps(bc);
+}
@@ -0,0 +1,9 @@
+// peephole.h
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "bytecode.h"
+
+void peephole_optimize(Bytecode *bc);
+
+#endif // PEEPHOLE_H
@@ -0,0 +1,41 @@
+// phpc.c
+#include "phpc.h"
+#include <stdio.h>
+#include "error.h"
+#include "parser.h"
+#include "optimizer.h"
+#include "compiler.h"
+#include "peephole.h"
+#include "bccache.h"
+
+PhpcStatus phpc_compile(const char *source, size_t length, int opt_level, Bytecode **out,
+                        char *message, size_t message_size) {
+    // Changed after setjmp and read by the handler
+    ASTNode *volatile ast = NULL;
+    volatile PhpcStatus failure = PHPC_ERROR_SYNTAX;
+    ErrorTrap trap;
+    error_trap(&trap);
+    if (setjmp(trap.env)) {
+        // parse() and compile() free their own partial results
+        free_ast(ast);
+        if (message) snprintf(message, message_size, "%s", trap.message);
+        *out = NULL;
+        return failure;
+    }
+    ast = parse(source, length);
+    failure = PHPC_ERROR_COMPILE;
+    if (opt_level >= 2) optimize_ast(ast);
+    Bytecode *bc = compile(ast);
+    error_untrap(&trap);
+    free_ast(ast);
+    if (opt_level >= 1) peephole_optimize(bc);
+    *out = bc;
+    return PHPC_OK;
+}
+
+PhpcStatus phpc_load(const char *path, Bytecode **out, char *message, size_t message_size) {
+    *out = bccache_load(path, NULL, NULL);
+    if (*out) return PHPC_OK;
+    if (message) snprintf(message, message_size, "Invalid or outdated bytecode file: %s", path);
+    return PHPC_ERROR_FILE;
+}
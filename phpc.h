@@ -0,0 +1,39 @@
+// phpc.h
+#ifndef PHPC_H
+#define PHPC_H
+
+#include <stddef.h>
+#include "bytecode.h"
+#include "vm.h"
+
+// Embedding interface of libphpc. A script is compiled once into Bytecode
+// and run any number of times, from any number of VMs:
+//
+//     Bytecode *bc;
+//     char message[ERROR_MESSAGE_MAX];
+//     if (phpc_compile(src, len, 2, &bc, message, sizeof(message)) != PHPC_OK) ...
+//     VM *vm = vm_new();
+//     VmOptions options = { 1, &sink, NULL, NULL, NULL, NULL };
+//     for (...) if (vm_run(vm, bc, &options) != 0) ... vm_error(vm) ...
+//     vm_free(vm);
+//     bytecode_free(bc);
+//
+// Nothing here prints or exits; failures come back as a status and a
+// message. Bytecode is read-only while running, so VMs on different
+// threads may share it; a VM runs one script at a time.
+
+typedef enum {
+    PHPC_OK,
+    PHPC_ERROR_SYNTAX,      // the source does not parse
+    PHPC_ERROR_COMPILE,     // undefined names, bad calls, size limits
+    PHPC_ERROR_FILE         // a bytecode file is missing, malformed or outdated
+} PhpcStatus;
+
+// Compiles source (not necessarily NUL-terminated) at the given -O level.
+// On failure *out is NULL and message, when not NULL, holds the reason.
+PhpcStatus phpc_compile(const char *source, size_t length, int opt_level, Bytecode **out,
+                        char *message, size_t message_size);
+// Loads a file written by --emit-bytecode or --cache
+PhpcStatus phpc_load(const char *path, Bytecode **out, char *message, size_t message_size);
+
+#endif // PHPC_H
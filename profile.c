@@ -0,0 +1,137 @@
+// profile.c
+#include "profile.h"
+#include <stdlib.h>
+
+// Rows of the text report's offset and pair tables
+#define PROFILE_TOP 20
+
+typedef struct {
+    uint64_t count;
+    size_t key;         // opcode, offset, or first * OP_COUNT + second
+} Entry;
+
+Profile *profile_new(size_t code_size, int count_cycles) {
+    Profile *p = calloc(1, sizeof(Profile));
+    // One past the end for the trailing OP_HALT of predecoded code
+    p->at = calloc(code_size + 1, sizeof(uint64_t));
+    p->code_size = code_size;
+    p->count_cycles = count_cycles && PROFILE_HAS_CYCLES;
+    p->last = -1;
+    return p;
+}
+
+void profile_free(Profile *p) {
+    if (!p) return;
+    free(p->at);
+    free(p);
+}
+
+void profile_stop(Profile *p) {
+#if PROFILE_HAS_CYCLES
+    if (p->count_cycles && p->last >= 0) p->cycles[p->last] += __rdtsc() - p->last_tsc;
+#endif
+    p->last = -1;
+}
+
+static int by_count(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// The nonzero counts, hottest first
+static Entry *sorted(const uint64_t *counts, size_t n, size_t *found) {
+    Entry *e = malloc((n ? n : 1) * sizeof(Entry));
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (counts[i]) e[m++] = (Entry){ counts[i], i };
+    }
+    qsort(e, m, sizeof(Entry), by_count);
+    *found = m;
+    return e;
+}
+
+static uint64_t total(const Profile *p) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < OP_COUNT; i++) sum += p->ops[i];
+    return sum;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+void profile_write_text(const Profile *p, const Bytecode *bc, FILE *out) {
+    uint64_t n = total(p);
+    size_t m;
+    fprintf(out, "profile: %llu instructions\n\n", (unsigned long long)n);
+
+    Entry *e = sorted(p->ops, OP_COUNT, &m);
+    fprintf(out, "%-20s %14s %7s", "opcode", "count", "%");
+    if (p->count_cycles) fprintf(out, " %16s %10s", "cycles", "cycles/op");
+    fputc('\n', out);
+    for (size_t i = 0; i < m; i++) {
+        fprintf(out, "%-20s %14llu %7.2f", opcode_name((uint8_t)e[i].key),
+                (unsigned long long)e[i].count, percent(e[i].count, n));
+        if (p->count_cycles) {
+            uint64_t c = p->cycles[e[i].key];
+            fprintf(out, " %16llu %10.1f", (unsigned long long)c, (double)c / (double)e[i].count);
+        }
+        fputc('\n', out);
+    }
+    free(e);
+
+    e = sorted(p->at, p->code_size + 1, &m);
+    fprintf(out, "\nhottest offsets\n%8s  %-20s %14s %7s\n", "offset", "opcode", "count", "%");
+    for (size_t i = 0; i < m && i < PROFILE_TOP; i++) {
+        uint8_t op = e[i].key < bc->code_size ? bc->code[e[i].key] : OP_HALT;
+        fprintf(out, "%8zu  %-20s %14llu %7.2f\n", e[i].key, opcode_name(op),
+                (unsigned long long)e[i].count, percent(e[i].count, n));
+    }
+    free(e);
+
+    e = sorted(&p->pairs[0][0], (size_t)OP_COUNT * OP_COUNT, &m);
+    fprintf(out, "\nhottest pairs\n%-41s %14s %7s\n", "first -> second", "count", "%");
+    for (size_t i = 0; i < m && i < PROFILE_TOP; i++) {
+        char pair[64];
+        snprintf(pair, sizeof(pair), "%s -> %s", opcode_name((uint8_t)(e[i].key / OP_COUNT)),
+                 opcode_name((uint8_t)(e[i].key % OP_COUNT)));
+        fprintf(out, "%-41s %14llu %7.2f\n", pair, (unsigned long long)e[i].count,
+                percent(e[i].count, n));
+    }
+    free(e);
+}
+
+void profile_write_json(const Profile *p, const Bytecode *bc, FILE *out) {
+    size_t m;
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"opcodes\": [", (unsigned long long)total(p));
+    Entry *e = sorted(p->ops, OP_COUNT, &m);
+    for (size_t i = 0; i < m; i++) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %llu", i ? "," : "",
+                opcode_name((uint8_t)e[i].key), (unsigned long long)e[i].count);
+        if (p->count_cycles) fprintf(out, ", \"cycles\": %llu", (unsigned long long)p->cycles[e[i].key]);
+        fputc('}', out);
+    }
+    free(e);
+
+    // Offsets in code order
+    fputs("\n  ],\n  \"offsets\": [", out);
+    const char *sep = "";
+    for (size_t i = 0; i <= p->code_size; i++) {
+        if (!p->at[i]) continue;
+        uint8_t op = i < bc->code_size ? bc->code[i] : OP_HALT;
+        fprintf(out, "%s\n    {\"offset\": %zu, \"opcode\": \"%s\", \"count\": %llu}", sep, i,
+                opcode_name(op), (unsigned long long)p->at[i]);
+        sep = ",";
+    }
+
+    fputs("\n  ],\n  \"pairs\": [", out);
+    e = sorted(&p->pairs[0][0], (size_t)OP_COUNT * OP_COUNT, &m);
+    for (size_t i = 0; i < m; i++) {
+        fprintf(out, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", i ? "," : "",
+                opcode_name((uint8_t)(e[i].key / OP_COUNT)), opcode_name((uint8_t)(e[i].key % OP_COUNT)),
+                (unsigned long long)e[i].count);
+    }
+    free(e);
+    fputs("\n  ]\n}\n", out);
+}
@@ -0,0 +1,61 @@
+// profile.h
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "bytecode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define PROFILE_HAS_CYCLES 1
+#else
+#  define PROFILE_HAS_CYCLES 0
+#endif
+
+// What a stack VM run executed (--profile): counts per opcode, per code
+// offset and per pair of consecutive opcodes, and optionally the cycles
+// from one dispatch to the next charged to the opcode that ran between.
+// Instructions are counted as compiled, before quickening.
+typedef struct Profile {
+    uint64_t *at;                           // code offset -> count
+    size_t code_size;
+    uint64_t ops[OP_COUNT];
+    uint64_t pairs[OP_COUNT][OP_COUNT];     // [first][second]
+    uint64_t cycles[OP_COUNT];
+    int count_cycles;
+    int last;                               // previous opcode, -1 at first
+    uint64_t last_tsc;
+} Profile;
+
+// count_cycles needs PROFILE_HAS_CYCLES
+Profile *profile_new(size_t code_size, int count_cycles);
+void profile_free(Profile *p);
+
+// Records the instruction at offset about to run and returns its opcode.
+// Predecoded code has an OP_HALT just past the end.
+static inline uint8_t profile_step(Profile *p, const uint8_t *code, size_t offset) {
+    uint8_t op = offset < p->code_size ? code[offset] : OP_HALT;
+#if PROFILE_HAS_CYCLES
+    if (p->count_cycles) {
+        uint64_t now = __rdtsc();
+        if (p->last >= 0) p->cycles[p->last] += now - p->last_tsc;
+        p->last_tsc = now;
+    }
+#endif
+    p->at[offset]++;
+    p->ops[op]++;
+    if (p->last >= 0) p->pairs[p->last][op]++;
+    p->last = op;
+    return op;
+}
+
+// Charges the time since the last step; called once the run stops
+void profile_stop(Profile *p);
+
+// Human-readable summary of the hottest opcodes, offsets and pairs
+void profile_write_text(const Profile *p, const Bytecode *bc, FILE *out);
+// Every nonzero count, as one JSON object
+void profile_write_json(const Profile *p, const Bytecode *bc, FILE *out);
+
+#endif // PROFILE_H
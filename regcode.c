@@ -0,0 +1,25 @@
+// regcode.c
+#include "regcode.h"
+#include <stdlib.h>
+
+RegProgram *regprogram_new(void) {
+    RegProgram *rp = calloc(1, sizeof(RegProgram));
+    rp->pool = bytecode_new();
+    return rp;
+}
+
+void regprogram_free(RegProgram *rp) {
+    free(rp->code);
+    bytecode_free(rp->pool);
+    free(rp);
+}
+
+// Appends an instruction and returns its index (for patching jump targets)
+size_t emit_reg(RegProgram *rp, RegOpCode op, uint32_t a, uint32_t b, uint32_t c) {
+    if (rp->code_size >= rp->code_capacity) {
+        rp->code_capacity = rp->code_capacity ? rp->code_capacity * 2 : 64;
+        rp->code = realloc(rp->code, sizeof(RegInsn) * rp->code_capacity);
+    }
+    rp->code[rp->code_size] = (RegInsn){ op, a, b, c };
+    return rp->code_size++;
+}
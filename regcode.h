@@ -0,0 +1,61 @@
+// regcode.h
+#ifndef REGCODE_H
+#define REGCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bytecode.h"
+
+// Three-address instructions over a register file laid out as
+//   [variables | constants | temporaries]
+// Constants are copied into their registers when the frame is set up, so
+// every operand is a plain register index.
+typedef enum {
+    ROP_MOVE,           // a = b
+    ROP_ADD,            // a = b + c
+    ROP_SUB,
+    ROP_MUL,
+    ROP_DIV,
+    ROP_MOD,
+    ROP_GT,
+    ROP_LT,
+    ROP_GTE,
+    ROP_LTE,
+    ROP_EQ,
+    ROP_NEQ,
+    ROP_CONCAT,         // a = b . c
+    ROP_JMP,            // goto a
+    ROP_JMP_IF_FALSE,   // if (!b) goto a
+    ROP_JMP_IF_NOT_GT,  // if (!(b > c)) goto a
+    ROP_JMP_IF_NOT_LT,
+    ROP_JMP_IF_NOT_GTE,
+    ROP_JMP_IF_NOT_LTE,
+    ROP_JMP_IF_NOT_EQ,
+    ROP_JMP_IF_NOT_NEQ,
+    ROP_PRINT,          // print a
+    ROP_HALT
+} RegOpCode;
+
+typedef struct {
+    uint32_t op;
+    uint32_t a, b, c;   // registers, or an absolute instruction index for jump targets
+} RegInsn;
+
+typedef struct {
+    RegInsn *code;
+    size_t code_size;
+    size_t code_capacity;
+    Bytecode *pool;     // constant pool and variable names; pool->code is unused
+    uint32_t reg_count;
+} RegProgram;
+
+RegProgram *regprogram_new(void);
+void regprogram_free(RegProgram *rp);
+size_t emit_reg(RegProgram *rp, RegOpCode op, uint32_t a, uint32_t b, uint32_t c);
+
+// Variable slot n lives in register n; constant k follows the variables
+static inline uint32_t reg_of_const(const RegProgram *rp, int idx) {
+    return (uint32_t)(rp->pool->var_count + idx);
+}
+
+#endif // REGCODE_H
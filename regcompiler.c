@@ -0,0 +1,253 @@
+// regcompiler.c
+#include "regcompiler.h"
+#include "error.h"
+#include <string.h>
+
+typedef struct {
+    RegProgram *rp;
+    uint32_t temp_top;  // next free temporary register
+} RegCompiler;
+
+static void compile_statement(RegCompiler *c, ASTNode *stmt);
+static void compile_list(RegCompiler *c, ASTNodeList *list);
+static void compile_into(RegCompiler *c, ASTNode *expr, uint32_t dst);
+
+// Registers all variables and constants up front so the register layout
+// (variables, then constants, then temporaries) is fixed before emission.
+static void collect(ASTNode *n, Bytecode *pool) {
+    if (!n) return;
+    switch (n->type) {
+        case AST_PROGRAM:
+            for (ASTNodeList *l = n->as.program.statements; l; l = l->next) collect(l->node, pool);
+            break;
+        case AST_BLOCK:
+            for (ASTNodeList *l = n->as.block.statements; l; l = l->next) collect(l->node, pool);
+            break;
+        case AST_EXPR_STMT:
+            collect(n->as.expr_stmt.expr, pool);
+            break;
+        case AST_VAR_ASSIGN:
+            bytecode_resolve_var(pool, n->as.var_assign.name);
+            collect(n->as.var_assign.value, pool);
+            break;
+        case AST_IF:
+            collect(n->as.if_stmt.cond, pool);
+            collect(n->as.if_stmt.then_branch, pool);
+            collect(n->as.if_stmt.else_branch, pool);
+            break;
+        case AST_WHILE:
+            collect(n->as.while_stmt.cond, pool);
+            collect(n->as.while_stmt.body, pool);
+            break;
+        case AST_RETURN:
+            collect(n->as.return_stmt.value, pool);
+            break;
+        case AST_BINARY_OP:
+            collect(n->as.binary.left, pool);
+            collect(n->as.binary.right, pool);
+            break;
+        case AST_LITERAL: {
+            bytecode_add_constant(pool, n->as.literal.is_string ? value_str(n->as.literal.str)
+                                                                : value_int(n->as.literal.value));
+            break;
+        }
+        case AST_VAR_REF:
+            bytecode_resolve_var(pool, n->as.var_ref.name);
+            break;
+        case AST_FUNC_CALL:
+            if (strcmp(n->as.func_call.name, "print") != 0) {
+                error_raise("Compile error at %zu:%zu: user functions need the stack VM",
+                            n->line, n->column);
+            }
+            // print's result
+            bytecode_add_constant(pool, value_int(1));
+            for (size_t i = 0; i < n->as.func_call.arg_count; i++) collect(n->as.func_call.args[i], pool);
+            break;
+        default:
+            break;
+    }
+}
+
+RegProgram *reg_compile(ASTNode *ast) {
+    RegProgram *rp = regprogram_new();
+    ErrorTrap trap;
+    error_trap(&trap);
+    if (setjmp(trap.env)) {
+        regprogram_free(rp);
+        error_rethrow(&trap);
+    }
+    collect(ast, rp->pool);
+    RegCompiler c = { rp, (uint32_t)(rp->pool->var_count + rp->pool->const_count) };
+    rp->reg_count = c.temp_top;
+    compile_list(&c, ast->as.program.statements);
+    emit_reg(rp, ROP_HALT, 0, 0, 0);
+    error_untrap(&trap);
+    return rp;
+}
+
+static uint32_t alloc_temp(RegCompiler *c) {
+    uint32_t r = c->temp_top++;
+    if (c->temp_top > c->rp->reg_count) c->rp->reg_count = c->temp_top;
+    return r;
+}
+
+// Constants were all added by collect(), so this only finds their register
+static uint32_t literal_of(RegCompiler *c, Value v) {
+    return reg_of_const(c->rp, bytecode_add_constant(c->rp->pool, v));
+}
+
+static uint32_t literal_reg(RegCompiler *c, ASTNode *lit) {
+    return literal_of(c, lit->as.literal.is_string ? value_str(lit->as.literal.str)
+                                                   : value_int(lit->as.literal.value));
+}
+
+// Returns a register holding the value of expr. Variables and literals
+// already have one; anything else is evaluated into a new temporary.
+static uint32_t expr_to_reg(RegCompiler *c, ASTNode *expr) {
+    if (expr->type == AST_VAR_REF) return (uint32_t)bytecode_resolve_var(c->rp->pool, expr->as.var_ref.name);
+    if (expr->type == AST_LITERAL) return literal_reg(c, expr);
+    uint32_t r = alloc_temp(c);
+    compile_into(c, expr, r);
+    return r;
+}
+
+static RegOpCode binary_op(const ASTNode *expr) {
+    switch (expr->as.binary.op) {
+        case T_PLUS:  return ROP_ADD;
+        case T_MINUS: return ROP_SUB;
+        case T_STAR:  return ROP_MUL;
+        case T_SLASH: return ROP_DIV;
+        case T_MOD:   return ROP_MOD;
+        case T_GT:    return ROP_GT;
+        case T_LT:    return ROP_LT;
+        case T_GTE:   return ROP_GTE;
+        case T_LTE:   return ROP_LTE;
+        case T_EQ:    return ROP_EQ;
+        case T_NEQ:   return ROP_NEQ;
+        case T_DOT:   return ROP_CONCAT;
+        default:
+            error_raise("Compile error at %zu:%zu: unknown operator", expr->line, expr->column);
+    }
+}
+
+static int compare_jump_op(TokenType op, RegOpCode *out) {
+    switch (op) {
+        case T_GT:  *out = ROP_JMP_IF_NOT_GT;  return 1;
+        case T_LT:  *out = ROP_JMP_IF_NOT_LT;  return 1;
+        case T_GTE: *out = ROP_JMP_IF_NOT_GTE; return 1;
+        case T_LTE: *out = ROP_JMP_IF_NOT_LTE; return 1;
+        case T_EQ:  *out = ROP_JMP_IF_NOT_EQ;  return 1;
+        case T_NEQ: *out = ROP_JMP_IF_NOT_NEQ; return 1;
+        default:    return 0;
+    }
+}
+
+// Evaluates expr into dst. dst is written only by the final instruction,
+// so an assignment may safely target a variable the expression reads.
+static void compile_into(RegCompiler *c, ASTNode *expr, uint32_t dst) {
+    uint32_t saved = c->temp_top;
+    switch (expr->type) {
+        case AST_LITERAL:
+            emit_reg(c->rp, ROP_MOVE, dst, literal_reg(c, expr), 0);
+            break;
+        case AST_VAR_REF: {
+            uint32_t src = (uint32_t)bytecode_resolve_var(c->rp->pool, expr->as.var_ref.name);
+            if (src != dst) emit_reg(c->rp, ROP_MOVE, dst, src, 0);
+            break;
+        }
+        case AST_BINARY_OP: {
+            uint32_t b = expr_to_reg(c, expr->as.binary.left);
+            uint32_t r = expr_to_reg(c, expr->as.binary.right);
+            emit_reg(c->rp, binary_op(expr), dst, b, r);
+            break;
+        }
+        case AST_FUNC_CALL:
+            if (strcmp(expr->as.func_call.name, "print")==0 && expr->as.func_call.arg_count==1) {
+                emit_reg(c->rp, ROP_PRINT, expr_to_reg(c, expr->as.func_call.args[0]), 0, 0);
+                emit_reg(c->rp, ROP_MOVE, dst, literal_of(c, value_int(1)), 0);
+            }
+            break;
+        default:
+            break;
+    }
+    c->temp_top = saved;
+}
+
+// Emits a jump taken when cond is false and returns its index for patching
+static size_t compile_cond_jump(RegCompiler *c, ASTNode *cond) {
+    uint32_t saved = c->temp_top;
+    RegOpCode op;
+    size_t at;
+    if (cond->type == AST_BINARY_OP && compare_jump_op(cond->as.binary.op, &op)) {
+        uint32_t b = expr_to_reg(c, cond->as.binary.left);
+        uint32_t r = expr_to_reg(c, cond->as.binary.right);
+        at = emit_reg(c->rp, op, 0, b, r);
+    } else {
+        at = emit_reg(c->rp, ROP_JMP_IF_FALSE, 0, expr_to_reg(c, cond), 0);
+    }
+    c->temp_top = saved;
+    return at;
+}
+
+static void patch_to_here(RegCompiler *c, size_t at) {
+    c->rp->code[at].a = (uint32_t)c->rp->code_size;
+}
+
+static void compile_statement(RegCompiler *c, ASTNode *stmt) {
+    switch (stmt->type) {
+        case AST_EXPR_STMT: {
+            uint32_t saved = c->temp_top;
+            ASTNode *expr = stmt->as.expr_stmt.expr;
+            // A print statement drops its result, so skip storing it
+            if (expr->type == AST_FUNC_CALL && strcmp(expr->as.func_call.name, "print") == 0 &&
+                expr->as.func_call.arg_count == 1) {
+                emit_reg(c->rp, ROP_PRINT, expr_to_reg(c, expr->as.func_call.args[0]), 0, 0);
+                c->temp_top = saved;
+                break;
+            }
+            compile_into(c, expr, alloc_temp(c));
+            c->temp_top = saved;
+            break;
+        }
+        case AST_VAR_ASSIGN:
+            compile_into(c, stmt->as.var_assign.value,
+                         (uint32_t)bytecode_resolve_var(c->rp->pool, stmt->as.var_assign.name));
+            break;
+        case AST_IF: {
+            size_t jf = compile_cond_jump(c, stmt->as.if_stmt.cond);
+            compile_list(c, stmt->as.if_stmt.then_branch->as.block.statements);
+            if (stmt->as.if_stmt.else_branch) {
+                size_t jmp = emit_reg(c->rp, ROP_JMP, 0, 0, 0);
+                patch_to_here(c, jf);
+                compile_list(c, stmt->as.if_stmt.else_branch->as.block.statements);
+                patch_to_here(c, jmp);
+            } else {
+                patch_to_here(c, jf);
+            }
+            break;
+        }
+        case AST_WHILE: {
+            uint32_t start = (uint32_t)c->rp->code_size;
+            size_t jf = compile_cond_jump(c, stmt->as.while_stmt.cond);
+            compile_list(c, stmt->as.while_stmt.body->as.block.statements);
+            emit_reg(c->rp, ROP_JMP, start, 0, 0);
+            patch_to_here(c, jf);
+            break;
+        }
+        case AST_RETURN: {
+            uint32_t saved = c->temp_top;
+            compile_into(c, stmt->as.return_stmt.value, alloc_temp(c));
+            c->temp_top = saved;
+            emit_reg(c->rp, ROP_HALT, 0, 0, 0);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void compile_list(RegCompiler *c, ASTNodeList *list) {
+    for (; list; list = list->next) {
+        compile_statement(c, list->node);
+    }
+}
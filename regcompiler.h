@@ -0,0 +1,10 @@
+// regcompiler.h
+#ifndef REGCOMPILER_H
+#define REGCOMPILER_H
+
+#include "ast.h"
+#include "regcode.h"
+
+RegProgram *reg_compile(ASTNode *ast);
+
+#endif // REGCOMPILER_H
@@ -0,0 +1,134 @@
+// regvm.c
+#include "regvm.h"
+#include "rope.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Uses the same build-time dispatch choice as vm.c: computed goto unless
+// VM_DISPATCH_SWITCH is set or the compiler lacks labels-as-values.
+#if defined(__GNUC__) && !defined(VM_DISPATCH_SWITCH)
+#  define CASE(op)  L_##op:
+#  define NEXT      do { insn = pc++; goto *handlers[insn->op]; } while (0)
+#else
+#  define CASE(op)  case op:
+#  define NEXT      continue
+#endif
+
+#define R(n) regs[insn->n]
+// As in the stack VM, arithmetic reads strings with string_to_int and ==
+// follows loose_equal; nothing is quickened, so each operand is checked
+#define INT_OF(v) (value_is_int(v) ? value_as_int(v) : string_to_int(strings, v, NULL))
+#define BINARY_INT(oper) \
+    (R(a) = value_int(INT_OF(R(b)) oper INT_OF(R(c))))
+// A zero divisor ends the run; func is int_div or int_mod
+#define DIVIDE(func) do { \
+        int divisor_ = INT_OF(R(c)); \
+        if (divisor_ == 0) { \
+            error = "Division by zero"; \
+            goto done; \
+        } \
+        R(a) = value_int(func(INT_OF(R(b)), divisor_)); \
+    } while (0)
+#define COMPARE_JUMP(oper) \
+    do { if (!(INT_OF(R(b)) oper INT_OF(R(c)))) pc = code + insn->a; } while (0)
+#define EQUAL(x, y) (value_both_int(x, y) ? value_as_int(x) == value_as_int(y) \
+                                          : loose_equal(strings, x, y))
+
+int run_regprogram(const RegProgram *rp, const OutputSink *sink) {
+    Output *out = malloc(sizeof(Output));
+    output_init(out, sink);
+    Arena *strings = arena_new();
+    const Bytecode *pool = rp->pool;
+    Value *regs = calloc(rp->reg_count ? rp->reg_count : 1, sizeof(Value));
+    memcpy(&regs[reg_of_const(rp, 0)], pool->constants, pool->const_count * sizeof(Value));
+
+    const RegInsn *code = rp->code, *pc = code, *insn;
+    const char *error = NULL;
+
+#if defined(__GNUC__) && !defined(VM_DISPATCH_SWITCH)
+    static const void *const handlers[] = {
+        [ROP_MOVE] = &&L_ROP_MOVE,
+        [ROP_ADD] = &&L_ROP_ADD,
+        [ROP_SUB] = &&L_ROP_SUB,
+        [ROP_MUL] = &&L_ROP_MUL,
+        [ROP_DIV] = &&L_ROP_DIV,
+        [ROP_MOD] = &&L_ROP_MOD,
+        [ROP_GT] = &&L_ROP_GT,
+        [ROP_LT] = &&L_ROP_LT,
+        [ROP_GTE] = &&L_ROP_GTE,
+        [ROP_LTE] = &&L_ROP_LTE,
+        [ROP_EQ] = &&L_ROP_EQ,
+        [ROP_NEQ] = &&L_ROP_NEQ,
+        [ROP_CONCAT] = &&L_ROP_CONCAT,
+        [ROP_JMP] = &&L_ROP_JMP,
+        [ROP_JMP_IF_FALSE] = &&L_ROP_JMP_IF_FALSE,
+        [ROP_JMP_IF_NOT_GT] = &&L_ROP_JMP_IF_NOT_GT,
+        [ROP_JMP_IF_NOT_LT] = &&L_ROP_JMP_IF_NOT_LT,
+        [ROP_JMP_IF_NOT_GTE] = &&L_ROP_JMP_IF_NOT_GTE,
+        [ROP_JMP_IF_NOT_LTE] = &&L_ROP_JMP_IF_NOT_LTE,
+        [ROP_JMP_IF_NOT_EQ] = &&L_ROP_JMP_IF_NOT_EQ,
+        [ROP_JMP_IF_NOT_NEQ] = &&L_ROP_JMP_IF_NOT_NEQ,
+        [ROP_PRINT] = &&L_ROP_PRINT,
+        [ROP_HALT] = &&L_ROP_HALT,
+    };
+    NEXT;
+#else
+    for (;;) {
+        insn = pc++;
+        switch ((RegOpCode)insn->op) {
+#endif
+            CASE(ROP_MOVE) { R(a) = R(b); NEXT; }
+            CASE(ROP_ADD) { BINARY_INT(+);  NEXT; }
+            CASE(ROP_SUB) { BINARY_INT(-);  NEXT; }
+            CASE(ROP_MUL) { BINARY_INT(*);  NEXT; }
+            CASE(ROP_DIV) { DIVIDE(int_div); NEXT; }
+            CASE(ROP_MOD) { DIVIDE(int_mod); NEXT; }
+            CASE(ROP_GT)  { BINARY_INT(>);  NEXT; }
+            CASE(ROP_LT)  { BINARY_INT(<);  NEXT; }
+            CASE(ROP_GTE) { BINARY_INT(>=); NEXT; }
+            CASE(ROP_LTE) { BINARY_INT(<=); NEXT; }
+            CASE(ROP_EQ)  { R(a) = value_int(EQUAL(R(b), R(c)));  NEXT; }
+            CASE(ROP_NEQ) { R(a) = value_int(!EQUAL(R(b), R(c))); NEXT; }
+            CASE(ROP_CONCAT) { R(a) = rope_concat(strings, R(b), R(c)); NEXT; }
+            CASE(ROP_JMP) { pc = code + insn->a; NEXT; }
+            CASE(ROP_JMP_IF_FALSE) {
+                if (!value_as_int(R(b))) pc = code + insn->a;
+                NEXT;
+            }
+            CASE(ROP_JMP_IF_NOT_GT)  { COMPARE_JUMP(>);  NEXT; }
+            CASE(ROP_JMP_IF_NOT_LT)  { COMPARE_JUMP(<);  NEXT; }
+            CASE(ROP_JMP_IF_NOT_GTE) { COMPARE_JUMP(>=); NEXT; }
+            CASE(ROP_JMP_IF_NOT_LTE) { COMPARE_JUMP(<=); NEXT; }
+            CASE(ROP_JMP_IF_NOT_EQ)  { if (!EQUAL(R(b), R(c))) pc = code + insn->a; NEXT; }
+            CASE(ROP_JMP_IF_NOT_NEQ) { if (EQUAL(R(b), R(c))) pc = code + insn->a;  NEXT; }
+            CASE(ROP_PRINT) {
+                Value val = R(a);
+                if (value_is_int(val))
+                    output_int(out, value_as_int(val));
+                else if (value_type(val) == VAL_STR)
+                    output_str(out, value_as_str(val));
+                else
+                    rope_output(out, value_as_rope(val));
+                NEXT;
+            }
+            CASE(ROP_HALT) {
+                goto done;
+            }
+#if !defined(__GNUC__) || defined(VM_DISPATCH_SWITCH)
+        }
+    }
+#endif
+
+done:
+    output_flush(out);
+    free(out);
+    arena_free(strings);
+    free(regs);
+    // After the output, as run_bytecode reports its errors
+    if (error) {
+        fputs(error, stderr);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+// regvm.h
+#ifndef REGVM_H
+#define REGVM_H
+
+#include "regcode.h"
+#include "output.h"
+
+// Output is buffered as in run_bytecode. A runtime error (division by
+// zero) is printed to stderr and returns 1.
+int run_regprogram(const RegProgram *rp, const OutputSink *sink);
+
+#endif // REGVM_H
@@ -0,0 +1,239 @@
+// rope.c
+#include "rope.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Operands of at most this many bytes are appended by copying into a
+// growable leaf; longer ones are linked under a new node instead
+#define ROPE_SHORT 64
+
+// Leaves visited before walk() needs the heap for its stack
+#define WALK_STACK 64
+
+// Growable text shared by the leaves cut from it. Only the leaf covering
+// all of it may extend it; earlier leaves see a prefix that never changes.
+// Outgrown data is left in the arena for the leaves still pointing at it.
+struct RopeBuffer {
+    char *data;
+    size_t used, capacity;
+};
+
+// An operand of concatenation; chars is NULL only for a rope node
+typedef struct {
+    const char *chars;
+    size_t length;
+    Rope *rope;
+    char digits[INT_DIGITS_MAX];
+} Piece;
+
+static Rope *new_leaf(Arena *arena, const char *chars, size_t length, RopeBuffer *buf) {
+    Rope *r = arena_alloc(arena, sizeof(Rope));
+    *r = (Rope){ length, 0, chars, buf, NULL, NULL };
+    return r;
+}
+
+static Rope *new_node(Arena *arena, Rope *left, Rope *right) {
+    Rope *r = arena_alloc(arena, sizeof(Rope));
+    *r = (Rope){ left->length + right->length, 0, NULL, NULL, left, right };
+    return r;
+}
+
+// Visits the leaves in order. Long chains of nodes are walked with an
+// explicit stack rather than recursion.
+static void walk(const Rope *rope, void (*leaf)(void *ctx, const char *chars, size_t length),
+                 void *ctx) {
+    const Rope *small[WALK_STACK];
+    const Rope **stack = small;
+    size_t count = 0, capacity = WALK_STACK;
+    for (;;) {
+        while (!rope->chars) {
+            if (count == capacity) {
+                capacity *= 2;
+                if (stack == small) {
+                    stack = malloc(capacity * sizeof(Rope*));
+                    memcpy(stack, small, sizeof(small));
+                } else {
+                    stack = realloc(stack, capacity * sizeof(Rope*));
+                }
+            }
+            stack[count++] = rope->right;
+            rope = rope->left;
+        }
+        leaf(ctx, rope->chars, rope->length);
+        if (!count) break;
+        rope = stack[--count];
+    }
+    if (stack != small) free(stack);
+}
+
+static void copy_leaf(void *ctx, const char *chars, size_t length) {
+    char **dst = ctx;
+    memcpy(*dst, chars, length);
+    *dst += length;
+}
+
+static void output_leaf(void *ctx, const char *chars, size_t length) {
+    output_bytes(ctx, chars, length);
+}
+
+void rope_output(Output *out, const Rope *rope) {
+    walk(rope, output_leaf, out);
+}
+
+// Turns a node into a leaf holding its text, and hashes the text (FNV-1a)
+static const char *flatten(Arena *arena, Rope *rope) {
+    if (!rope->chars) {
+        char *text = arena_alloc(arena, rope->length), *dst = text;
+        walk(rope, copy_leaf, &dst);
+        rope->chars = text;
+        rope->left = rope->right = NULL;
+    }
+    if (!rope->hash) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < rope->length; i++) {
+            h = (h ^ (uint8_t)rope->chars[i]) * 16777619u;
+        }
+        rope->hash = h ? h : 1;
+    }
+    return rope->chars;
+}
+
+static void piece_of(Value v, Piece *p) {
+    p->rope = NULL;
+    if (value_type(v) == VAL_ROPE) {
+        p->rope = value_as_rope(v);
+        p->chars = p->rope->chars;
+        p->length = p->rope->length;
+    } else if (value_type(v) == VAL_STR) {
+        p->chars = value_as_str(v);
+        p->length = strlen(p->chars);
+    } else {
+        p->length = format_int(p->digits, value_as_int(v));
+        p->chars = p->digits;
+    }
+}
+
+// Literal text is referenced, not copied
+static Rope *piece_rope(Arena *arena, Piece *p) {
+    if (p->rope) return p->rope;
+    const char *chars = p->chars == p->digits ? arena_memdup(arena, p->digits, p->length) : p->chars;
+    return new_leaf(arena, chars, p->length, NULL);
+}
+
+static void piece_copy(const Piece *p, char *dst) {
+    if (p->chars) {
+        memcpy(dst, p->chars, p->length);
+    } else {
+        walk(p->rope, copy_leaf, &dst);
+    }
+}
+
+static int extendable(const Rope *r) {
+    return r && r->buf && r->buf->used == r->length;
+}
+
+// A leaf holding a's text (a may be NULL) followed by b's. Extends a's
+// buffer when a may, doubling it as needed, so repeated appends are linear.
+static Rope *append(Arena *arena, const Piece *a, const Piece *b) {
+    size_t a_length = a ? a->length : 0, length = a_length + b->length;
+    RopeBuffer *buf = a && extendable(a->rope) ? a->rope->buf : NULL;
+    if (!buf) {
+        buf = arena_alloc(arena, sizeof(RopeBuffer));
+        buf->capacity = length * 2;
+        buf->data = arena_alloc(arena, buf->capacity);
+        if (a) piece_copy(a, buf->data);
+        buf->used = a_length;
+    } else if (length > buf->capacity) {
+        buf->capacity = length * 2;
+        char *data = arena_alloc(arena, buf->capacity);
+        memcpy(data, buf->data, buf->used);
+        buf->data = data;
+    }
+    piece_copy(b, buf->data + buf->used);
+    buf->used = length;
+    return new_leaf(arena, buf->data, length, buf);
+}
+
+Value rope_concat(Arena *arena, Value av, Value bv) {
+    Piece a, b;
+    piece_of(av, &a);
+    piece_of(bv, &b);
+    if (!b.length && is_string(av)) return av;
+    if (!a.length && is_string(bv)) return bv;
+
+    Rope *r;
+    if (!b.length) {
+        r = piece_rope(arena, &a);
+    } else if (!a.length) {
+        r = piece_rope(arena, &b);
+    } else if (b.length > ROPE_SHORT) {
+        r = new_node(arena, piece_rope(arena, &a), piece_rope(arena, &b));
+    } else if (extendable(a.rope) || a.length <= ROPE_SHORT) {
+        r = append(arena, &a, &b);
+    } else if (!a.chars && extendable(a.rope->right)) {
+        // Keep extending the tail of a long string
+        Piece tail;
+        piece_of(value_rope(a.rope->right), &tail);
+        r = new_node(arena, a.rope->left, append(arena, &tail, &b));
+    } else {
+        r = new_node(arena, piece_rope(arena, &a), append(arena, NULL, &b));
+    }
+    return value_rope(r);
+}
+
+static const char *text_of(Arena *arena, Value v, size_t *length) {
+    if (value_type(v) == VAL_STR) {
+        *length = strlen(value_as_str(v));
+        return value_as_str(v);
+    }
+    *length = value_as_rope(v)->length;
+    return flatten(arena, value_as_rope(v));
+}
+
+static int string_equal(Arena *arena, Value a, Value b) {
+    if (value_type(a) == VAL_STR && value_type(b) == VAL_STR) {
+        return strcmp(value_as_str(a), value_as_str(b)) == 0;
+    }
+    if (value_type(a) == VAL_ROPE && value_type(b) == VAL_ROPE) {
+        Rope *ra = value_as_rope(a), *rb = value_as_rope(b);
+        if (ra == rb) return 1;
+        if (ra->length != rb->length) return 0;
+        flatten(arena, ra);
+        flatten(arena, rb);
+        if (ra->hash != rb->hash) return 0;
+    }
+    size_t a_length, b_length;
+    const char *a_text = text_of(arena, a, &a_length);
+    const char *b_text = text_of(arena, b, &b_length);
+    return a_length == b_length && memcmp(a_text, b_text, a_length) == 0;
+}
+
+// Space, \t \n \v \f \r
+static int is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Wraps past the int range like the arithmetic does
+int string_to_int(Arena *arena, Value s, int *whole) {
+    size_t length;
+    const char *p = text_of(arena, s, &length), *end = p + length;
+    while (p < end && is_space(*p)) p++;
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    const char *digits = p;
+    unsigned u = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) u = u * 10 + (unsigned)(*p - '0');
+    if (whole) {
+        int any = p > digits;
+        while (p < end && is_space(*p)) p++;
+        *whole = any && p == end;
+    }
+    return (int)(negative ? 0u - u : u);
+}
+
+int loose_equal(Arena *arena, Value a, Value b) {
+    if (is_string(a) && is_string(b)) return string_equal(arena, a, b);
+    if (!is_string(a) && !is_string(b)) return value_as_int(a) == value_as_int(b);
+    int whole, n = string_to_int(arena, is_string(a) ? a : b, &whole);
+    return whole && n == value_as_int(is_string(a) ? b : a);
+}
@@ -0,0 +1,43 @@
+// rope.h
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <stdint.h>
+#include "arena.h"
+#include "bytecode.h"
+#include "output.h"
+
+// Strings built at runtime by concatenation (VAL_ROPE). A rope is either a
+// leaf holding its text or a node joining two ropes; nodes are flattened
+// into leaves the first time a comparison needs the text. All of it lives
+// in the arena of the run that built it.
+typedef struct RopeBuffer RopeBuffer;
+
+typedef struct Rope {
+    size_t length;
+    uint32_t hash;          // of the text, 0 until the rope is flattened
+    const char *chars;      // leaf text, not NUL-terminated; NULL for nodes
+    RopeBuffer *buf;        // leaves that short appends may extend in place
+    struct Rope *left, *right;
+} Rope;
+
+// a . b, with ints converted to decimal
+Value rope_concat(Arena *arena, Value a, Value b);
+
+// Writes the text leaf by leaf, without flattening
+void rope_output(Output *out, const Rope *rope);
+
+// The int a string stands for in arithmetic, as PHP reads it: leading
+// whitespace, an optional sign and the digits that follow, 0 without any.
+// *whole, when not NULL, is set if nothing but whitespace came after.
+int string_to_int(Arena *arena, Value s, int *whole);
+
+// ==: two strings by content, an int and a string when the string is
+// wholly that number, two ints by value
+int loose_equal(Arena *arena, Value a, Value b);
+
+static inline int is_string(Value v) {
+    return !value_is_int(v);
+}
+
+#endif // ROPE_H
@@ -0,0 +1,264 @@
+// sampler.c
+#define _GNU_SOURCE
+#include "sampler.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Rows of the report's line table
+#define SAMPLER_TOP 20
+// Initial bucket count of the folded-stack map, a power of two
+#define FOLDED_INITIAL 64
+
+volatile sig_atomic_t sampler_due;
+
+typedef struct {
+    char *stack;        // "{main}:3;f:7", NULL = empty bucket
+    uint64_t count;
+} Folded;
+
+struct Sampler {
+    const Bytecode *bc;
+    uint64_t samples;
+    uint64_t *lines;            // source line -> samples
+    size_t line_slots;
+    uint32_t *by_entry;         // function indices sorted by entry offset
+    // Index func_count stands for the top level
+    uint64_t *self, *total;
+    uint64_t *seen;             // sample that last counted a function's total
+    Folded *folded;
+    size_t folded_count, folded_capacity;
+    char *buffer;               // folded stack under construction
+    size_t buffer_capacity;
+    struct sigaction old_action;
+    struct itimerval old_timer;
+};
+
+typedef struct {
+    uint64_t count;
+    size_t key;
+} Entry;
+
+static void on_sigprof(int sig) {
+    (void)sig;
+    sampler_due = 1;
+}
+
+static const Bytecode *sorting;
+
+static int by_entry(const void *a, const void *b) {
+    uint32_t x = sorting->functions[*(const uint32_t *)a].entry;
+    uint32_t y = sorting->functions[*(const uint32_t *)b].entry;
+    return x < y ? -1 : x > y;
+}
+
+Sampler *sampler_new(const Bytecode *bc) {
+    Sampler *s = calloc(1, sizeof(Sampler));
+    s->bc = bc;
+    size_t n = bc->func_count;
+    s->by_entry = malloc((n ? n : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) s->by_entry[i] = (uint32_t)i;
+    sorting = bc;
+    qsort(s->by_entry, n, sizeof(uint32_t), by_entry);
+    s->self = calloc(n + 1, sizeof(uint64_t));
+    s->total = calloc(n + 1, sizeof(uint64_t));
+    s->seen = calloc(n + 1, sizeof(uint64_t));
+    s->folded_capacity = FOLDED_INITIAL;
+    s->folded = calloc(s->folded_capacity, sizeof(Folded));
+    return s;
+}
+
+void sampler_free(Sampler *s) {
+    if (!s) return;
+    for (size_t i = 0; i < s->folded_capacity; i++) free(s->folded[i].stack);
+    free(s->folded);
+    free(s->buffer);
+    free(s->seen);
+    free(s->total);
+    free(s->self);
+    free(s->by_entry);
+    free(s->lines);
+    free(s);
+}
+
+int sampler_start(Sampler *s) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sampler_due = 0;
+    if (sigaction(SIGPROF, &sa, &s->old_action) != 0) return -1;
+    struct itimerval every = {
+        .it_interval = { 0, SAMPLE_INTERVAL_US },
+        .it_value = { 0, SAMPLE_INTERVAL_US },
+    };
+    if (setitimer(ITIMER_PROF, &every, &s->old_timer) != 0) {
+        int saved = errno;
+        sigaction(SIGPROF, &s->old_action, NULL);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+void sampler_stop(Sampler *s) {
+    setitimer(ITIMER_PROF, &s->old_timer, NULL);
+    sigaction(SIGPROF, &s->old_action, NULL);
+    sampler_due = 0;
+}
+
+// Function containing offset; func_count for the top level, which the
+// compiler emits ahead of every function body
+static size_t function_at(const Sampler *s, size_t offset) {
+    size_t lo = 0, hi = s->bc->func_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->bc->functions[s->by_entry[mid]].entry <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? s->by_entry[lo - 1] : s->bc->func_count;
+}
+
+static const char *function_name(const Sampler *s, size_t f) {
+    return f < s->bc->func_count ? s->bc->functions[f].name : "{main}";
+}
+
+static void append(Sampler *s, size_t *len, const char *text) {
+    size_t n = strlen(text);
+    if (*len + n + 1 > s->buffer_capacity) {
+        s->buffer_capacity = (*len + n + 1) * 2;
+        s->buffer = realloc(s->buffer, s->buffer_capacity);
+    }
+    memcpy(s->buffer + *len, text, n + 1);
+    *len += n;
+}
+
+// FNV-1a
+static uint64_t hash_string(const char *str) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *str; str++) h = (h ^ (uint8_t)*str) * 1099511628211ULL;
+    return h;
+}
+
+static Folded *folded_slot(Folded *table, size_t capacity, const char *stack) {
+    size_t i = hash_string(stack) & (capacity - 1);
+    while (table[i].stack && strcmp(table[i].stack, stack) != 0) i = (i + 1) & (capacity - 1);
+    return &table[i];
+}
+
+static void count_folded(Sampler *s) {
+    if ((s->folded_count + 1) * 2 > s->folded_capacity) {
+        size_t capacity = s->folded_capacity * 2;
+        Folded *table = calloc(capacity, sizeof(Folded));
+        for (size_t i = 0; i < s->folded_capacity; i++) {
+            if (s->folded[i].stack) *folded_slot(table, capacity, s->folded[i].stack) = s->folded[i];
+        }
+        free(s->folded);
+        s->folded = table;
+        s->folded_capacity = capacity;
+    }
+    Folded *slot = folded_slot(s->folded, s->folded_capacity, s->buffer);
+    if (!slot->stack) {
+        slot->stack = strdup(s->buffer);
+        s->folded_count++;
+    }
+    slot->count++;
+}
+
+void sampler_record(Sampler *s, const size_t *stack, size_t depth) {
+    sampler_due = 0;
+    uint64_t sample = ++s->samples;
+    size_t len = 0;
+    if (s->buffer) s->buffer[0] = '\0';
+    for (size_t i = 0; i < depth; i++) {
+        size_t f = function_at(s, stack[i]);
+        uint32_t line = bytecode_line_at(s->bc, stack[i]);
+        // Recursion counts once towards a function's total
+        if (s->seen[f] != sample) {
+            s->seen[f] = sample;
+            s->total[f]++;
+        }
+        char frame[32];
+        snprintf(frame, sizeof(frame), ":%u", (unsigned)line);
+        if (i) append(s, &len, ";");
+        append(s, &len, function_name(s, f));
+        append(s, &len, frame);
+        if (i + 1 < depth) continue;
+
+        s->self[f]++;
+        if (line >= s->line_slots) {
+            size_t slots = (size_t)line * 2 + 1;
+            s->lines = realloc(s->lines, slots * sizeof(uint64_t));
+            memset(s->lines + s->line_slots, 0, (slots - s->line_slots) * sizeof(uint64_t));
+            s->line_slots = slots;
+        }
+        s->lines[line]++;
+    }
+    if (len) count_folded(s);
+}
+
+static int by_count(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+void sampler_write_report(const Sampler *s, FILE *out) {
+    fprintf(out, "samples: %llu, every %d us of CPU time\n\n", (unsigned long long)s->samples,
+            SAMPLE_INTERVAL_US);
+
+    Entry *e = malloc((s->line_slots ? s->line_slots : 1) * sizeof(Entry));
+    size_t m = 0;
+    for (size_t i = 0; i < s->line_slots; i++) {
+        if (s->lines[i]) e[m++] = (Entry){ s->lines[i], i };
+    }
+    qsort(e, m, sizeof(Entry), by_count);
+    fprintf(out, "hottest lines\n%8s %10s %7s\n", "line", "samples", "%");
+    for (size_t i = 0; i < m && i < SAMPLER_TOP; i++) {
+        // Line 0 collects code the compiler emitted without a source position
+        if (e[i].key) fprintf(out, "%8zu", e[i].key);
+        else fprintf(out, "%8s", "?");
+        fprintf(out, " %10llu %7.2f\n", (unsigned long long)e[i].count, percent(e[i].count, s->samples));
+    }
+    free(e);
+
+    size_t n = s->bc->func_count + 1;
+    e = malloc(n * sizeof(Entry));
+    m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s->total[i]) e[m++] = (Entry){ s->self[i], i };
+    }
+    qsort(e, m, sizeof(Entry), by_count);
+    fprintf(out, "\n%-24s %10s %7s %10s %7s\n", "function", "self", "%", "total", "%");
+    for (size_t i = 0; i < m; i++) {
+        uint64_t total = s->total[e[i].key];
+        fprintf(out, "%-24s %10llu %7.2f %10llu %7.2f\n", function_name(s, e[i].key),
+                (unsigned long long)e[i].count, percent(e[i].count, s->samples),
+                (unsigned long long)total, percent(total, s->samples));
+    }
+    free(e);
+}
+
+static int by_stack(const void *a, const void *b) {
+    return strcmp(((const Folded *)a)->stack, ((const Folded *)b)->stack);
+}
+
+void sampler_write_folded(const Sampler *s, FILE *out) {
+    Folded *rows = malloc((s->folded_count ? s->folded_count : 1) * sizeof(Folded));
+    size_t m = 0;
+    for (size_t i = 0; i < s->folded_capacity; i++) {
+        if (s->folded[i].stack) rows[m++] = s->folded[i];
+    }
+    qsort(rows, m, sizeof(Folded), by_stack);
+    for (size_t i = 0; i < m; i++) {
+        fprintf(out, "%s %llu\n", rows[i].stack, (unsigned long long)rows[i].count);
+    }
+    free(rows);
+}
@@ -0,0 +1,39 @@
+// sampler.h
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "bytecode.h"
+
+// Microseconds of CPU time between samples
+#define SAMPLE_INTERVAL_US 1000
+
+// Statistical profile of a stack VM run (--sample). A SIGPROF timer raises
+// sampler_due; the VM notices at its next dispatch and records the call
+// stack there, so samples cost nothing between ticks and never run inside
+// the signal handler. Time is reported per source line and per function,
+// and can be exported as folded stacks for flame graphs.
+typedef struct Sampler Sampler;
+
+extern volatile sig_atomic_t sampler_due;
+
+Sampler *sampler_new(const Bytecode *bc);
+void sampler_free(Sampler *s);
+
+// Arms and disarms the timer; one sampler runs at a time. Start returns
+// -1 with errno set when the timer cannot be armed.
+int sampler_start(Sampler *s);
+void sampler_stop(Sampler *s);
+
+// stack holds code offsets, outermost first: the call sites of the
+// suspended callers, then the instruction about to run. Clears sampler_due.
+void sampler_record(Sampler *s, const size_t *stack, size_t depth);
+
+// Samples per line and per function, hottest first
+void sampler_write_report(const Sampler *s, FILE *out);
+// One line per distinct stack: "{main}:3;f:7;g:12 42"
+void sampler_write_folded(const Sampler *s, FILE *out);
+
+#endif // SAMPLER_H
@@ -0,0 +1,61 @@
+// source.c
+#define _POSIX_C_SOURCE 200809L
+#include "source.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reads a non-mappable file (pipe, empty file) into a heap buffer
+static int read_fallback(SourceFile *src, int fd) {
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len)) > 0) {
+        len += (size_t)n;
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    if (n < 0) {
+        free(buf);
+        return -1;
+    }
+    src->data = buf;
+    src->length = len;
+    src->mapped = 0;
+    return 0;
+}
+
+// Returns 0 on success, -1 with errno set on failure
+int source_open(SourceFile *src, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            src->data = p;
+            src->length = (size_t)st.st_size;
+            src->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+    int result = read_fallback(src, fd);
+    close(fd);
+    return result;
+}
+
+void source_close(SourceFile *src) {
+    if (src->mapped) {
+        munmap((void *)src->data, src->length);
+    } else {
+        free((void *)src->data);
+    }
+    src->data = NULL;
+    src->length = 0;
+}
@@ -0,0 +1,18 @@
+// source.h
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+
+// Script text, memory-mapped when possible. The buffer is not
+// NUL-terminated; always use length.
+typedef struct {
+    const char *data;
+    size_t length;
+    int mapped;
+} SourceFile;
+
+int source_open(SourceFile *src, const char *path);
+void source_close(SourceFile *src);
+
+#endif // SOURCE_H
@@ -3,9 +3,7 @@
 #define TOKENS_H
 
 #include <stddef.h>
-
-// Maximum length for identifiers and literals
-#define MAX_TOKEN_TEXT 64
+#include <stdint.h>
 
 typedef enum {
     // Special
@@ -34,6 +32,7 @@ typedef enum {
     T_STAR,     // *
     T_SLASH,    // /
     T_MOD,      // %
+    T_DOT,      // .
     T_ASSIGN,   // =
     T_GT,       // >
     T_LT,       // <
@@ -48,13 +47,38 @@ typedef enum {
     T_STRING      // string literals (e.g., "hello")
 } TokenType;
 
+// A single token, as produced on demand by lexer_next(). Text is the
+// (offset, length) slice of the source.
 typedef struct {
     TokenType type;
-    char text[MAX_TOKEN_TEXT];
-    size_t line;
-    size_t column;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t line;
+    uint32_t column;
 } Token;
 
+// Batch form: tokens are (offset, length) slices of the source, stored as parallel
+// arrays. String tokens exclude the quotes. Line/column are recovered from
+// the line table on demand.
+typedef struct {
+    const char *source;
+    uint8_t *types;         // TokenType
+    uint32_t *offsets;
+    uint32_t *lengths;
+    size_t count;
+    size_t capacity;
+    uint32_t *line_starts;  // offset of the first character of each line
+    size_t line_count;
+    size_t line_capacity;
+} TokenStream;
+
+static inline const char *token_text(const TokenStream *ts, size_t i) {
+    return ts->source + ts->offsets[i];
+}
+
+// 1-based line and column of token i
+void token_position(const TokenStream *ts, size_t i, size_t *line, size_t *column);
+
 // Utility to map TokenType → string (for debugging)
 const char *token_type_to_string(TokenType type);
 
@@ -0,0 +1,73 @@
+// value.h
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <stdint.h>
+
+// VAL_STR is a NUL-terminated literal; VAL_ROPE a string built at runtime
+typedef enum { VAL_INT, VAL_STR, VAL_ROPE } ValueType;
+
+// One 64-bit word: the type tag in the top 16 bits over either a 32-bit
+// int, zero-extended, or a pointer, which fits in the 48 bits user-space
+// addresses use on x86-64 and AArch64. VAL_INT is 0, so an all-zero word
+// is the int 0 and an int's high 32 bits are zero. Only the functions
+// below look inside; code generators may rely on the int layout.
+typedef struct {
+    uint64_t bits;
+} Value;
+
+#define VALUE_TAG_SHIFT 48
+#define VALUE_PAYLOAD_MASK (((uint64_t)1 << VALUE_TAG_SHIFT) - 1)
+
+struct Rope;
+
+static inline Value value_int(int i) {
+    return (Value){ (uint32_t)i };
+}
+
+static inline Value value_str(char *s) {
+    return (Value){ (uint64_t)VAL_STR << VALUE_TAG_SHIFT | (uintptr_t)s };
+}
+
+static inline Value value_rope(struct Rope *rope) {
+    return (Value){ (uint64_t)VAL_ROPE << VALUE_TAG_SHIFT | (uintptr_t)rope };
+}
+
+static inline ValueType value_type(Value v) {
+    return (ValueType)(v.bits >> VALUE_TAG_SHIFT);
+}
+
+static inline int value_is_int(Value v) {
+    return v.bits >> VALUE_TAG_SHIFT == VAL_INT;
+}
+
+// One test for both tags, since VAL_INT is 0
+static inline int value_both_int(Value a, Value b) {
+    return (a.bits | b.bits) >> VALUE_TAG_SHIFT == VAL_INT;
+}
+
+// Strings read this way give the low half of their address; arithmetic
+// reads them with string_to_int instead
+static inline int value_as_int(Value v) {
+    return (int)(uint32_t)v.bits;
+}
+
+// / and % for the interpreters, which check for a zero divisor first.
+// INT_MIN / -1 wraps to INT_MIN, as + - * wrap.
+static inline int int_div(int a, int b) {
+    return b == -1 ? (int)(0u - (unsigned)a) : a / b;
+}
+
+static inline int int_mod(int a, int b) {
+    return b == -1 ? 0 : a % b;
+}
+
+static inline char *value_as_str(Value v) {
+    return (char *)(uintptr_t)(v.bits & VALUE_PAYLOAD_MASK);
+}
+
+static inline struct Rope *value_as_rope(Value v) {
+    return (struct Rope *)(uintptr_t)(v.bits & VALUE_PAYLOAD_MASK);
+}
+
+#endif // VALUE_H
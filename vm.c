@@ -1,107 +1,728 @@
 // vm.c
 #include "vm.h"
+#include "jit.h"
+#include "rope.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
-#define STACK_MAX 256
-#define VAR_TABLE_SIZE 256
+// Operand stack slots. A call checks that the callee's locals and its
+// deepest expression (Function.max_depth) fit, so nothing pushes past it.
+#define STACK_MAX 65536
 
+// Dispatch engine, chosen at build time (see DISPATCH in the Makefile):
+//   VM_DISPATCH_SWITCH      portable switch loop
+//   VM_DISPATCH_THREADED    computed-goto direct threading over the byte stream
+//   VM_DISPATCH_PREDECODED  threading over handler/operand records built at load
+// Threaded forms need the GNU labels-as-values extension.
+#if !defined(VM_DISPATCH_SWITCH) && !defined(VM_DISPATCH_THREADED) && !defined(VM_DISPATCH_PREDECODED)
+#  if defined(__GNUC__)
+#    define VM_DISPATCH_THREADED
+#  else
+#    define VM_DISPATCH_SWITCH
+#  endif
+#endif
+#if !defined(__GNUC__) && !defined(VM_DISPATCH_SWITCH)
+#  error "threaded dispatch requires GCC or Clang; build with DISPATCH=SWITCH"
+#endif
+
+// A suspended caller. The callee's frame starts at its first argument on
+// the operand stack, so calls copy nothing and allocate nothing.
 typedef struct {
+    const void *ret;        // resume point in the caller
+    Value *fp;              // caller's frame; unused for the top level
+} CallFrame;
+
+// Everything here outlives a run, so a reused VM allocates nothing more
+// once its buffers have grown to the largest script it ran
+struct VM {
     const Bytecode *bc;
     size_t ip;
-    Value stack[STACK_MAX];
+    Value *stack;
     int sp;
-    struct { const char *name; Value value; } vars[VAR_TABLE_SIZE];
+    CallFrame frames[FRAMES_MAX];
+    Jit *jit;               // NULL when interpreting only
+    Profile *profile;       // NULL unless profiling
+    Sampler *sampler;       // NULL unless sampling
+    VmStats *stats;         // NULL unless counting
+    Output out;
+    Arena *strings;         // ropes built by this run
+    Value *vars;
+    const char **var_names;
     size_t var_count;
-} VM;
+    size_t var_capacity;
+    uint8_t *code;          // byte engines: the run's copy, for quickening
+    size_t code_capacity;
+    char error[ERROR_MESSAGE_MAX];
+};
 
-static void push(VM *vm, Value value) {
-    vm->stack[vm->sp++] = value;
-}
-static Value pop_(VM *vm) {
-    return vm->stack[--vm->sp];
-}
+#ifdef VM_DISPATCH_PREDECODED
+// One decoded instruction: handler address plus its operands. Jump operands
+// hold the target instruction index rather than a byte offset.
+typedef struct {
+    const void *handler;
+    int32_t args[2];
+} Insn;
+#endif
 
+// Name-based access for OP_LOAD/OP_STORE. Compiled code uses the slot
+// opcodes instead; this only serves dynamic lookups by name.
 static Value *lookup_var(VM *vm, int name_idx) {
-    const char *name = vm->bc->constants[name_idx].str_val;
+    const char *name = value_as_str(vm->bc->constants[name_idx]);
     for (size_t i=0; i<vm->var_count; i++) {
-        if (strcmp(vm->vars[i].name, name) == 0) {
-            return &vm->vars[i].value;
+        if (strcmp(vm->var_names[i], name) == 0) {
+            return &vm->vars[i];
+        }
+    }
+    if (vm->var_count >= vm->var_capacity) {
+        vm->var_capacity *= 2;
+        vm->vars = realloc(vm->vars, sizeof(Value) * vm->var_capacity);
+        vm->var_names = realloc(vm->var_names, sizeof(char*) * vm->var_capacity);
+    }
+    vm->var_names[vm->var_count] = name;
+    vm->vars[vm->var_count] = value_int(0);
+    return &vm->vars[vm->var_count++];
+}
+
+static int run(VM *vm);
+
+VM *vm_new(void) {
+    VM *vm = calloc(1, sizeof(VM));
+    vm->stack = malloc(sizeof(Value) * STACK_MAX);
+    vm->strings = arena_new();
+    vm->var_capacity = 1;
+    vm->vars = malloc(sizeof(Value) * vm->var_capacity);
+    vm->var_names = malloc(sizeof(char*) * vm->var_capacity);
+    return vm;
+}
+
+void vm_free(VM *vm) {
+    if (!vm) return;
+    arena_free(vm->strings);
+    free(vm->stack);
+    free(vm->vars);
+    free(vm->var_names);
+    free(vm->code);
+    free(vm);
+}
+
+void vm_reset(VM *vm) {
+    arena_reset(vm->strings);
+    vm->bc = NULL;
+    vm->ip = 0;
+    vm->sp = 0;
+    vm->var_count = 0;
+    vm->error[0] = '\0';
+}
+
+const char *vm_error(const VM *vm) {
+    return vm->error;
+}
+
+int vm_run(VM *vm, const Bytecode *bc, const VmOptions *options) {
+    static const VmOptions defaults = { 1, NULL, NULL, NULL, NULL, NULL };
+    if (!options) options = &defaults;
+    vm_reset(vm);
+    vm->bc = bc;
+    vm->profile = options->profile;
+    vm->sampler = options->sampler;
+    vm->stats = options->stats;
+    output_init(&vm->out, options->sink);
+    // Native loops would run unseen by the profile, sampler and counters
+    vm->jit = options->use_jit && !vm->profile && !vm->sampler && !vm->stats ? jit_new(bc) : NULL;
+    if (bc->var_count > vm->var_capacity) {
+        vm->var_capacity = bc->var_count;
+        vm->vars = realloc(vm->vars, sizeof(Value) * vm->var_capacity);
+        vm->var_names = realloc(vm->var_names, sizeof(char*) * vm->var_capacity);
+    }
+    vm->var_count = bc->var_count;
+    for (size_t i=0; i<bc->var_count; i++) {
+        vm->vars[i] = value_int(0);
+        vm->var_names[i] = bc->var_names[i];
+        // Strings in values are never written through
+        if (options->input && strcmp(bc->var_names[i], "$input") == 0) {
+            vm->vars[i] = value_str((char *)options->input);
         }
     }
-    if (vm->var_count >= VAR_TABLE_SIZE) {
-        fprintf(stderr, "Too many variables\n");
-        exit(EXIT_FAILURE);
+#ifndef VM_DISPATCH_PREDECODED
+    if (bc->code_size > vm->code_capacity) {
+        vm->code_capacity = bc->code_size;
+        free(vm->code);
+        vm->code = malloc(vm->code_capacity);
+    }
+#endif
+    int result;
+    if (bc->max_depth > STACK_MAX) {
+        snprintf(vm->error, sizeof(vm->error), "Stack overflow");
+        result = 1;
+    } else if (vm->sampler && sampler_start(vm->sampler) != 0) {
+        snprintf(vm->error, sizeof(vm->error), "Cannot start the sampler: %s", strerror(errno));
+        result = 1;
+    } else {
+        result = run(vm);
+        if (vm->sampler) sampler_stop(vm->sampler);
+    }
+    output_flush(&vm->out);
+    jit_free(vm->jit);
+    vm->jit = NULL;
+    return result;
+}
+
+int run_bytecode(const Bytecode *bc, int use_jit, const OutputSink *sink, Profile *profile,
+                 Sampler *sampler, VmStats *stats) {
+    VmOptions options = { use_jit, sink, profile, sampler, stats, NULL };
+    VM *vm = vm_new();
+    int result = vm_run(vm, bc, &options);
+    if (result) fputs(vm->error, stderr);
+    vm_free(vm);
+    return result;
+}
+
+#ifdef VM_DISPATCH_PREDECODED
+// Translates the byte stream into Insn records using the handler table of
+// run(). Also returns the byte offset <-> instruction index maps the JIT
+// needs to enter and leave native code. The caller frees all three arrays.
+static Insn *predecode(const Bytecode *bc, const void *const *handlers,
+                       size_t **index_at_out, size_t **offset_of_out) {
+    size_t *index_at = malloc((bc->code_size + 1) * sizeof(size_t));
+    size_t count = 0;
+    for (size_t ip = 0; ip < bc->code_size; ip += opcode_length(bc->code[ip])) {
+        index_at[ip] = count++;
+    }
+    index_at[bc->code_size] = count;
+    size_t *offset_of = malloc((count + 1) * sizeof(size_t));
+    for (size_t ip = 0; ip < bc->code_size; ip += opcode_length(bc->code[ip])) {
+        offset_of[index_at[ip]] = ip;
+    }
+    offset_of[count] = bc->code_size;
+    // Trailing OP_HALT so running off the end stops like the switch loop does
+    Insn *insns = malloc((count + 1) * sizeof(Insn));
+    for (size_t ip = 0, n = 0; ip < bc->code_size; ip += opcode_length(bc->code[ip]), n++) {
+        uint8_t op = bc->code[ip];
+        insns[n].handler = handlers[op];
+        insns[n].args[0] = insns[n].args[1] = 0;
+        if (opcode_is_jump(op)) {
+            insns[n].args[0] = (int32_t)index_at[jump_target(bc->code, ip)];
+        } else if (op == OP_CALL) {
+            // Function index, then its entry as an instruction index
+            insns[n].args[0] = read_u16(&bc->code[ip + 1]);
+            insns[n].args[1] = (int32_t)index_at[bc->functions[insns[n].args[0]].entry];
+        } else {
+            // Remaining operands are all 16-bit
+            for (size_t i = 0; 1 + 2*i < opcode_length(op); i++) {
+                insns[n].args[i] = read_u16(&bc->code[ip + 1 + 2*i]);
+            }
+        }
     }
-    vm->vars[vm->var_count].name = name;
-    vm->vars[vm->var_count].value.type = VAL_INT;
-    vm->vars[vm->var_count].value.int_val = 0;
-    return &vm->vars[vm->var_count++].value;
+    insns[count].handler = handlers[OP_HALT];
+    insns[count].args[0] = insns[count].args[1] = 0;
+    *index_at_out = index_at;
+    *offset_of_out = offset_of;
+    return insns;
 }
+#endif
 
-int run_bytecode(const Bytecode *bc) {
-    VM vm = { .bc=bc, .ip=0, .sp=0, .var_count=0 };
-    while (vm.ip < bc->code_size) {
-        OpCode op = (OpCode)bc->code[vm.ip++];
+// Handler bodies below are shared by all engines; these macros hide how
+// operands are fetched and how control moves to the next instruction.
+#define PUSH(v)  (*sp++ = (v))
+#define POP()    (*--sp)
+
+// Arithmetic and comparisons read a string as the number it starts with
+static inline int int_of(VM *vm, Value v) {
+    return value_is_int(v) ? value_as_int(v) : string_to_int(vm->strings, v, NULL);
+}
+
+// Arithmetic and comparisons are quickened. The generic form takes any
+// operands and rewrites itself into its _INT form once it sees two ints;
+// the _INT form checks both tags in one test and rewrites itself back when
+// a string turns up. SITE() names the running instruction for QUICKEN.
+#define BINARY(oper, quick) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) QUICKEN(quick); \
+        PUSH(value_int(int_of(vm, a) oper int_of(vm, b))); \
+    } while (0)
+#define BINARY_INT(oper, generic) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) { \
+            PUSH(value_int(value_as_int(a) oper value_as_int(b))); \
+        } else { \
+            QUICKEN(generic); \
+            PUSH(value_int(int_of(vm, a) oper int_of(vm, b))); \
+        } \
+    } while (0)
+// Division takes its function (int_div, int_mod) in place of an operator,
+// and fails the run on a zero divisor
+#define DIVISION_BY_ZERO() do { \
+        snprintf(vm->error, sizeof(vm->error), "Division by zero"); \
+        result = 1; \
+        goto done; \
+    } while (0)
+#define DIVIDE(func, quick) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) QUICKEN(quick); \
+        int divisor_ = int_of(vm, b); \
+        if (divisor_ == 0) DIVISION_BY_ZERO(); \
+        PUSH(value_int(func(int_of(vm, a), divisor_))); \
+    } while (0)
+#define DIVIDE_INT(func, generic) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        int dividend_, divisor_; \
+        if (value_both_int(a, b)) { \
+            dividend_ = value_as_int(a); \
+            divisor_ = value_as_int(b); \
+        } else { \
+            QUICKEN(generic); \
+            dividend_ = int_of(vm, a); \
+            divisor_ = int_of(vm, b); \
+        } \
+        if (divisor_ == 0) DIVISION_BY_ZERO(); \
+        PUSH(value_int(func(dividend_, divisor_))); \
+    } while (0)
+#define COMPARE_JUMP(oper, quick) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) QUICKEN(quick); \
+        if (!(int_of(vm, a) oper int_of(vm, b))) JUMP(); else SKIP_JUMP(); \
+    } while (0)
+#define COMPARE_JUMP_INT(oper, generic) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        int taken_; \
+        if (value_both_int(a, b)) { \
+            taken_ = !(value_as_int(a) oper value_as_int(b)); \
+        } else { \
+            QUICKEN(generic); \
+            taken_ = !(int_of(vm, a) oper int_of(vm, b)); \
+        } \
+        if (taken_) JUMP(); else SKIP_JUMP(); \
+    } while (0)
+
+// == and != follow loose_equal
+#define BINARY_EQUAL(want, quick) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) QUICKEN(quick); \
+        PUSH(value_int(loose_equal(vm->strings, a, b) == (want))); \
+    } while (0)
+#define BINARY_EQUAL_INT(want, generic) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) { \
+            PUSH(value_int((value_as_int(a) == value_as_int(b)) == (want))); \
+        } else { \
+            QUICKEN(generic); \
+            PUSH(value_int(loose_equal(vm->strings, a, b) == (want))); \
+        } \
+    } while (0)
+#define EQUAL_JUMP(want, quick) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        if (value_both_int(a, b)) QUICKEN(quick); \
+        if (loose_equal(vm->strings, a, b) != (want)) JUMP(); else SKIP_JUMP(); \
+    } while (0)
+#define EQUAL_JUMP_INT(want, generic) do { \
+        SITE(); \
+        Value b = POP(), a = POP(); \
+        int equal_; \
+        if (value_both_int(a, b)) { \
+            equal_ = value_as_int(a) == value_as_int(b); \
+        } else { \
+            QUICKEN(generic); \
+            equal_ = loose_equal(vm->strings, a, b); \
+        } \
+        if (equal_ != (want)) JUMP(); else SKIP_JUMP(); \
+    } while (0)
+
+#if defined(VM_DISPATCH_PREDECODED)
+#  define CASE(op)       L_##op:
+#  define NEXT           do { insn = pc++; argp = insn->args; goto *insn->handler; } while (0)
+#  define OPERAND_U16()  ((uint16_t)*argp++)
+#  define JUMP()         (pc = insns + *argp)
+#  define SKIP_JUMP()    ((void)0)
+#  define JUMP_LONG()    JUMP()
+#  define SKIP_JUMP_LONG() ((void)0)
+#  define ENTER(f)       (pc = insns + *argp)
+#  define RETURN_ADDR()  ((const void *)pc)
+#  define RETURN_TO(r)   (pc = (Insn *)(r))
+#  define RETURN_OFFSET(r) (offset_of[(const Insn *)(r) - insns])
+#  define CODE_OFFSET()  (offset_of[pc - insns])
+#  define LOOP_END(n)    CODE_OFFSET()
+#  define RESUME_AT(o)   (pc = insns + index_at[o])
+#  define SITE()         Insn *const site_ = insn
+#  define QUICKEN(op)    (site_->handler = dispatch[op])
+#else
+#  if defined(VM_DISPATCH_THREADED)
+#    define CASE(op)     L_##op:
+#    define NEXT         goto *dispatch[*ip++]
+#  else
+#    define CASE(op)     case op:
+#    define NEXT         continue
+#  endif
+#  define OPERAND_U16()  (ip += 2, read_u16(ip - 2))
+#  define JUMP()         do { int8_t offset_ = (int8_t)*ip++; ip += offset_; } while (0)
+#  define SKIP_JUMP()    (ip++)
+#  define JUMP_LONG()    do { int32_t offset_ = read_i32(ip); ip += 4 + offset_; } while (0)
+#  define SKIP_JUMP_LONG() (ip += 4)
+#  define ENTER(f)       (ip = code + (f)->entry)
+#  define RETURN_ADDR()  ((const void *)ip)
+#  define RETURN_TO(r)   (ip = (uint8_t *)(r))
+#  define RETURN_OFFSET(r) ((size_t)((const uint8_t *)(r) - code))
+#  define CODE_OFFSET()  ((size_t)(ip - code))
+#  define LOOP_END(n)    (CODE_OFFSET() + (n))
+#  define RESUME_AT(o)   (ip = code + (o))
+#  define SITE()         uint8_t *const site_ = ip - 1
+#  define QUICKEN(op)    (*site_ = (op))
+#endif
+
+// Work before an instruction of a profiled, sampled or counted run.
+// Samples are taken here, at the first dispatch after the timer fires,
+// where the call stack is consistent.
+#define INSTRUMENT(at) do { \
+        if (profile) profile_step(profile, bc->code, (at)); \
+        if (stats) { \
+            size_t depth_ = (size_t)(sp - vm->stack), calls_ = (size_t)(frame - vm->frames); \
+            stats->instructions++; \
+            if (depth_ > stats->peak_stack) stats->peak_stack = depth_; \
+            if (calls_ > stats->peak_frames) stats->peak_frames = calls_; \
+        } \
+        if (sampler && sampler_due) { \
+            size_t depth_ = 0; \
+            for (const CallFrame *f_ = vm->frames; f_ < frame; f_++) { \
+                sample_stack[depth_++] = RETURN_OFFSET(f_->ret) - opcode_length(OP_CALL); \
+            } \
+            sample_stack[depth_++] = (at); \
+            sampler_record(sampler, sample_stack, depth_); \
+        } \
+    } while (0)
+
+// Unconditional jumps backwards close a loop. Once the JIT has code for
+// the loop it runs natively until it leaves the loop or meets something it
+// does not handle; interpretation resumes where it stopped. n is the jump's
+// operand size.
+#define LOOP_JUMP(J, n) do { \
+        size_t end_ = LOOP_END(n); \
+        J(); \
+        size_t target_ = CODE_OFFSET(), resume_; \
+        int pushed_; \
+        if (target_ < end_ && vm->jit && \
+            jit_enter(vm->jit, target_, end_, fp, sp, &resume_, &pushed_)) { \
+            sp += pushed_; \
+            RESUME_AT(resume_); \
+        } \
+    } while (0)
+
+static int run(VM *vm) {
+    const Bytecode *bc = vm->bc;
+    Value *sp = vm->stack + vm->sp;
+    // Slot operands index fp: the globals at top level, the current
+    // function's arguments and locals otherwise
+    Value *fp = vm->vars;
+    CallFrame *frame = vm->frames;
+    Profile *profile = vm->profile;
+    Sampler *sampler = vm->sampler;
+    VmStats *stats = vm->stats;
+    int instrumented = profile || sampler || stats;
+    // Call sites of the suspended callers plus the current offset
+    size_t *sample_stack = sampler ? malloc((FRAMES_MAX + 1) * sizeof(size_t)) : NULL;
+    int result = 0;
+
+#if defined(VM_DISPATCH_THREADED) || defined(VM_DISPATCH_PREDECODED)
+    static const void *const handlers[] = {
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_LOAD] = &&L_OP_LOAD,
+        [OP_STORE] = &&L_OP_STORE,
+        [OP_LOAD_SLOT] = &&L_OP_LOAD_SLOT,
+        [OP_STORE_SLOT] = &&L_OP_STORE_SLOT,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_MOD] = &&L_OP_MOD,
+        [OP_GT] = &&L_OP_GT,
+        [OP_LT] = &&L_OP_LT,
+        [OP_GTE] = &&L_OP_GTE,
+        [OP_LTE] = &&L_OP_LTE,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NEQ] = &&L_OP_NEQ,
+        [OP_CONCAT] = &&L_OP_CONCAT,
+        [OP_JMP] = &&L_OP_JMP,
+        [OP_JMP_IF_FALSE] = &&L_OP_JMP_IF_FALSE,
+        [OP_JMP_LONG] = &&L_OP_JMP_LONG,
+        [OP_JMP_IF_FALSE_LONG] = &&L_OP_JMP_IF_FALSE_LONG,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RET] = &&L_OP_RET,
+        [OP_POP] = &&L_OP_POP,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_HALT] = &&L_OP_HALT,
+        [OP_INC_SLOT] = &&L_OP_INC_SLOT,
+        [OP_ADD_CONST] = &&L_OP_ADD_CONST,
+        [OP_JMP_IF_NOT_GT] = &&L_OP_JMP_IF_NOT_GT,
+        [OP_JMP_IF_NOT_LT] = &&L_OP_JMP_IF_NOT_LT,
+        [OP_JMP_IF_NOT_GTE] = &&L_OP_JMP_IF_NOT_GTE,
+        [OP_JMP_IF_NOT_LTE] = &&L_OP_JMP_IF_NOT_LTE,
+        [OP_JMP_IF_NOT_EQ] = &&L_OP_JMP_IF_NOT_EQ,
+        [OP_JMP_IF_NOT_NEQ] = &&L_OP_JMP_IF_NOT_NEQ,
+        [OP_ADD_INT] = &&L_OP_ADD_INT,
+        [OP_SUB_INT] = &&L_OP_SUB_INT,
+        [OP_MUL_INT] = &&L_OP_MUL_INT,
+        [OP_DIV_INT] = &&L_OP_DIV_INT,
+        [OP_MOD_INT] = &&L_OP_MOD_INT,
+        [OP_GT_INT] = &&L_OP_GT_INT,
+        [OP_LT_INT] = &&L_OP_LT_INT,
+        [OP_GTE_INT] = &&L_OP_GTE_INT,
+        [OP_LTE_INT] = &&L_OP_LTE_INT,
+        [OP_EQ_INT] = &&L_OP_EQ_INT,
+        [OP_NEQ_INT] = &&L_OP_NEQ_INT,
+        [OP_INC_SLOT_INT] = &&L_OP_INC_SLOT_INT,
+        [OP_ADD_CONST_INT] = &&L_OP_ADD_CONST_INT,
+        [OP_JMP_IF_NOT_GT_INT] = &&L_OP_JMP_IF_NOT_GT_INT,
+        [OP_JMP_IF_NOT_LT_INT] = &&L_OP_JMP_IF_NOT_LT_INT,
+        [OP_JMP_IF_NOT_GTE_INT] = &&L_OP_JMP_IF_NOT_GTE_INT,
+        [OP_JMP_IF_NOT_LTE_INT] = &&L_OP_JMP_IF_NOT_LTE_INT,
+        [OP_JMP_IF_NOT_EQ_INT] = &&L_OP_JMP_IF_NOT_EQ_INT,
+        [OP_JMP_IF_NOT_NEQ_INT] = &&L_OP_JMP_IF_NOT_NEQ_INT,
+    };
+    // Profiling, sampling and counting route every dispatch through
+    // L_PROFILE, so plain runs pay nothing for them
+    static const void *const profiling[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&L_PROFILE };
+    const void *const *dispatch = instrumented ? profiling : handlers;
+#endif
+
+#if defined(VM_DISPATCH_PREDECODED)
+    size_t *index_at, *offset_of;
+    Insn *insns = predecode(bc, dispatch, &index_at, &offset_of);
+    Insn *pc = insns, *insn;
+    const int32_t *argp;
+    NEXT;
+#else
+    // Quickening rewrites instructions, so each run has its own copy
+    uint8_t *code = vm->code;
+    memcpy(code, bc->code, bc->code_size);
+    uint8_t *ip = code + vm->ip;
+#  if defined(VM_DISPATCH_THREADED)
+    // The compiler always terminates code with OP_HALT, so no bounds check
+    NEXT;
+#  else
+    const uint8_t *end = code + bc->code_size;
+    while (ip < end) {
+        if (instrumented) INSTRUMENT(CODE_OFFSET());
+        OpCode op = (OpCode)*ip++;
         switch (op) {
-            case OP_CONSTANT: {
-                uint8_t idx = bc->code[vm.ip++];
-                push(&vm, bc->constants[idx]);
-                break;
-            }
-            case OP_LOAD: {
-                uint8_t idx = bc->code[vm.ip++];
-                Value *slot = lookup_var(&vm, idx);
-                push(&vm, *slot);
-                break;
-            }
-            case OP_STORE: {
-                uint8_t idx = bc->code[vm.ip++];
-                Value val = pop_(&vm);
-                Value *slot = lookup_var(&vm, idx);
-                *slot = val;
-                break;
-            }
-            case OP_ADD:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val+b.int_val}); break; }
-            case OP_SUB:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val-b.int_val}); break; }
-            case OP_MUL:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val*b.int_val}); break; }
-            case OP_DIV:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val/b.int_val}); break; }
-            case OP_MOD:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val%b.int_val}); break; }
-            case OP_GT:     { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val>b.int_val}); break; }
-            case OP_LT:     { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val<b.int_val}); break; }
-            case OP_GTE:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val>=b.int_val}); break; }
-            case OP_LTE:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val<=b.int_val}); break; }
-            case OP_EQ:     { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val==b.int_val}); break; }
-            case OP_NEQ:    { Value b=pop_(&vm), a=pop_(&vm); push(&vm, (Value){VAL_INT, .int_val=a.int_val!=b.int_val}); break; }
-            case OP_JMP: {
-                int8_t offset = (int8_t)bc->code[vm.ip++];
-                vm.ip += offset;
-                break;
-            }
-            case OP_JMP_IF_FALSE: {
-                int8_t offset = (int8_t)bc->code[vm.ip++];
-                Value cond = pop_(&vm);
-                if (!cond.int_val) vm.ip += offset;
-                break;
-            }
-            case OP_PRINT: {
-                Value val = pop_(&vm);
-                if (val.type == VAL_INT)
-                    printf("%d", val.int_val);
+#  endif
+#endif
+            CASE(OP_CONSTANT) {
+                uint16_t idx = OPERAND_U16();
+                PUSH(bc->constants[idx]);
+                NEXT;
+            }
+            CASE(OP_LOAD) {
+                uint16_t idx = OPERAND_U16();
+                Value *var = lookup_var(vm, idx);
+                if (frame == vm->frames) fp = vm->vars;  // may have moved
+                PUSH(*var);
+                NEXT;
+            }
+            CASE(OP_STORE) {
+                uint16_t idx = OPERAND_U16();
+                Value val = POP();
+                *lookup_var(vm, idx) = val;
+                if (frame == vm->frames) fp = vm->vars;
+                NEXT;
+            }
+            CASE(OP_LOAD_SLOT) {
+                uint16_t slot = OPERAND_U16();
+                PUSH(fp[slot]);
+                NEXT;
+            }
+            CASE(OP_STORE_SLOT) {
+                uint16_t slot = OPERAND_U16();
+                fp[slot] = POP();
+                NEXT;
+            }
+            CASE(OP_ADD) { BINARY(+,  OP_ADD_INT); NEXT; }
+            CASE(OP_SUB) { BINARY(-,  OP_SUB_INT); NEXT; }
+            CASE(OP_MUL) { BINARY(*,  OP_MUL_INT); NEXT; }
+            CASE(OP_DIV) { DIVIDE(int_div, OP_DIV_INT); NEXT; }
+            CASE(OP_MOD) { DIVIDE(int_mod, OP_MOD_INT); NEXT; }
+            CASE(OP_GT)  { BINARY(>,  OP_GT_INT);  NEXT; }
+            CASE(OP_LT)  { BINARY(<,  OP_LT_INT);  NEXT; }
+            CASE(OP_GTE) { BINARY(>=, OP_GTE_INT); NEXT; }
+            CASE(OP_LTE) { BINARY(<=, OP_LTE_INT); NEXT; }
+            CASE(OP_EQ)  { BINARY_EQUAL(1, OP_EQ_INT);  NEXT; }
+            CASE(OP_NEQ) { BINARY_EQUAL(0, OP_NEQ_INT); NEXT; }
+            CASE(OP_ADD_INT) { BINARY_INT(+,  OP_ADD); NEXT; }
+            CASE(OP_SUB_INT) { BINARY_INT(-,  OP_SUB); NEXT; }
+            CASE(OP_MUL_INT) { BINARY_INT(*,  OP_MUL); NEXT; }
+            CASE(OP_DIV_INT) { DIVIDE_INT(int_div, OP_DIV); NEXT; }
+            CASE(OP_MOD_INT) { DIVIDE_INT(int_mod, OP_MOD); NEXT; }
+            CASE(OP_GT_INT)  { BINARY_INT(>,  OP_GT);  NEXT; }
+            CASE(OP_LT_INT)  { BINARY_INT(<,  OP_LT);  NEXT; }
+            CASE(OP_GTE_INT) { BINARY_INT(>=, OP_GTE); NEXT; }
+            CASE(OP_LTE_INT) { BINARY_INT(<=, OP_LTE); NEXT; }
+            CASE(OP_EQ_INT)  { BINARY_EQUAL_INT(1, OP_EQ);  NEXT; }
+            CASE(OP_NEQ_INT) { BINARY_EQUAL_INT(0, OP_NEQ); NEXT; }
+            CASE(OP_CONCAT) {
+                Value b = POP(), a = POP();
+                PUSH(rope_concat(vm->strings, a, b));
+                NEXT;
+            }
+            CASE(OP_JMP) {
+                LOOP_JUMP(JUMP, 1);
+                NEXT;
+            }
+            CASE(OP_JMP_IF_FALSE) {
+                Value cond = POP();
+                if (!value_as_int(cond)) JUMP(); else SKIP_JUMP();
+                NEXT;
+            }
+            CASE(OP_JMP_LONG) {
+                LOOP_JUMP(JUMP_LONG, 4);
+                NEXT;
+            }
+            CASE(OP_JMP_IF_FALSE_LONG) {
+                Value cond = POP();
+                if (!value_as_int(cond)) JUMP_LONG(); else SKIP_JUMP_LONG();
+                NEXT;
+            }
+            CASE(OP_INC_SLOT) {
+                SITE();
+                uint16_t slot = OPERAND_U16();
+                Value k = bc->constants[OPERAND_U16()];
+                if (value_both_int(fp[slot], k)) QUICKEN(OP_INC_SLOT_INT);
+                fp[slot] = value_int(int_of(vm, fp[slot]) + int_of(vm, k));
+                NEXT;
+            }
+            CASE(OP_ADD_CONST) {
+                SITE();
+                Value k = bc->constants[OPERAND_U16()];
+                if (value_both_int(sp[-1], k)) QUICKEN(OP_ADD_CONST_INT);
+                sp[-1] = value_int(int_of(vm, sp[-1]) + int_of(vm, k));
+                NEXT;
+            }
+            // Quickened only for an int constant, so just the other side
+            // needs checking
+            CASE(OP_INC_SLOT_INT) {
+                SITE();
+                uint16_t slot = OPERAND_U16();
+                int k = value_as_int(bc->constants[OPERAND_U16()]);
+                if (value_is_int(fp[slot])) {
+                    fp[slot] = value_int(value_as_int(fp[slot]) + k);
+                } else {
+                    QUICKEN(OP_INC_SLOT);
+                    fp[slot] = value_int(int_of(vm, fp[slot]) + k);
+                }
+                NEXT;
+            }
+            CASE(OP_ADD_CONST_INT) {
+                SITE();
+                int k = value_as_int(bc->constants[OPERAND_U16()]);
+                if (value_is_int(sp[-1])) {
+                    sp[-1] = value_int(value_as_int(sp[-1]) + k);
+                } else {
+                    QUICKEN(OP_ADD_CONST);
+                    sp[-1] = value_int(int_of(vm, sp[-1]) + k);
+                }
+                NEXT;
+            }
+            CASE(OP_JMP_IF_NOT_GT)  { COMPARE_JUMP(>,  OP_JMP_IF_NOT_GT_INT);  NEXT; }
+            CASE(OP_JMP_IF_NOT_LT)  { COMPARE_JUMP(<,  OP_JMP_IF_NOT_LT_INT);  NEXT; }
+            CASE(OP_JMP_IF_NOT_GTE) { COMPARE_JUMP(>=, OP_JMP_IF_NOT_GTE_INT); NEXT; }
+            CASE(OP_JMP_IF_NOT_LTE) { COMPARE_JUMP(<=, OP_JMP_IF_NOT_LTE_INT); NEXT; }
+            CASE(OP_JMP_IF_NOT_EQ)  { EQUAL_JUMP(1, OP_JMP_IF_NOT_EQ_INT);  NEXT; }
+            CASE(OP_JMP_IF_NOT_NEQ) { EQUAL_JUMP(0, OP_JMP_IF_NOT_NEQ_INT); NEXT; }
+            CASE(OP_JMP_IF_NOT_GT_INT)  { COMPARE_JUMP_INT(>,  OP_JMP_IF_NOT_GT);  NEXT; }
+            CASE(OP_JMP_IF_NOT_LT_INT)  { COMPARE_JUMP_INT(<,  OP_JMP_IF_NOT_LT);  NEXT; }
+            CASE(OP_JMP_IF_NOT_GTE_INT) { COMPARE_JUMP_INT(>=, OP_JMP_IF_NOT_GTE); NEXT; }
+            CASE(OP_JMP_IF_NOT_LTE_INT) { COMPARE_JUMP_INT(<=, OP_JMP_IF_NOT_LTE); NEXT; }
+            CASE(OP_JMP_IF_NOT_EQ_INT)  { EQUAL_JUMP_INT(1, OP_JMP_IF_NOT_EQ);  NEXT; }
+            CASE(OP_JMP_IF_NOT_NEQ_INT) { EQUAL_JUMP_INT(0, OP_JMP_IF_NOT_NEQ); NEXT; }
+            CASE(OP_PRINT) {
+                Value val = sp[-1];
+                sp[-1] = value_int(1);
+                if (value_is_int(val))
+                    output_int(&vm->out, value_as_int(val));
+                else if (value_type(val) == VAL_STR)
+                    output_str(&vm->out, value_as_str(val));
                 else
-                    printf("%s", val.str_val);
-                break;
+                    rope_output(&vm->out, value_as_rope(val));
+                NEXT;
+            }
+            CASE(OP_POP) {
+                sp--;
+                NEXT;
+            }
+            CASE(OP_CALL) {
+                const Function *f = &bc->functions[OPERAND_U16()];
+                if (frame == vm->frames + FRAMES_MAX ||
+                    sp + f->local_count + f->max_depth > vm->stack + STACK_MAX) {
+                    snprintf(vm->error, sizeof(vm->error), "Stack overflow calling %s", f->name);
+                    result = 1;
+                    goto done;
+                }
+                frame->ret = RETURN_ADDR();
+                frame->fp = fp;
+                frame++;
+                fp = sp - f->param_count;
+                for (Value *end = fp + f->local_count; sp < end; sp++) {
+                    *sp = value_int(0);
+                }
+                ENTER(f);
+                NEXT;
+            }
+            CASE(OP_RET) {
+                // A top-level return ends the script
+                if (frame == vm->frames) goto done;
+                Value val = POP();
+                sp = fp;
+                frame--;
+                fp = frame == vm->frames ? vm->vars : frame->fp;
+                PUSH(val);
+                RETURN_TO(frame->ret);
+                NEXT;
             }
-            case OP_RET:
-            case OP_HALT:
-                return 0;
+            CASE(OP_HALT) {
+                goto done;
+            }
+#if defined(VM_DISPATCH_PREDECODED)
+            L_PROFILE: {
+                // Dispatches on the compiled opcode, so instrumented runs
+                // keep to the generic forms
+                size_t at = offset_of[insn - insns];
+                INSTRUMENT(at);
+                goto *handlers[at < bc->code_size ? bc->code[at] : OP_HALT];
+            }
+#elif defined(VM_DISPATCH_THREADED)
+            L_PROFILE:
+                INSTRUMENT(CODE_OFFSET() - 1);
+                goto *handlers[ip[-1]];
+#endif
+#if defined(VM_DISPATCH_SWITCH)
             default:
-                fprintf(stderr, "Unknown opcode %d at %zu", op, vm.ip-1);
-                return 1;
+                snprintf(vm->error, sizeof(vm->error), "Unknown opcode %d at %zu", op,
+                         (size_t)(ip - code) - 1);
+                result = 1;
+                goto done;
         }
     }
-    return 0;
+#endif
+
+done:
+    if (profile) profile_stop(profile);
+    free(sample_stack);
+#if defined(VM_DISPATCH_PREDECODED)
+    free(insns);
+    free(index_at);
+    free(offset_of);
+#else
+    vm->ip = (size_t)(ip - code);
+#endif
+    vm->sp = (int)(sp - vm->stack);
+    return result;
 }
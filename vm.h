@@ -3,7 +3,54 @@
 #define VM_H
 
 #include "bytecode.h"
+#include "output.h"
+#include "profile.h"
+#include "sampler.h"
+#include "error.h"
 
-int run_bytecode(const Bytecode *bc);
+// Deepest call nesting; one more call fails with a stack overflow
+#define FRAMES_MAX 4096
+
+// Counters of a --stats run
+typedef struct {
+    uint64_t instructions;  // as dispatched, fused ones counting once
+    size_t peak_stack;      // deepest operand stack, in values
+    size_t peak_frames;     // deepest call nesting
+} VmStats;
+
+// How to run a script. use_jit compiles hot loops to native code where
+// supported. Printed output is buffered and goes to sink, or stdout when
+// sink is NULL; it is flushed before the run returns. A profile, when
+// given, records every instruction executed, a sampler the call stack
+// every few ticks of CPU time, and stats the counters above; any of them
+// turns the JIT off. input, when set, is the initial value of the global
+// $input, and must outlive the run.
+typedef struct {
+    int use_jit;
+    const OutputSink *sink;
+    Profile *profile;
+    Sampler *sampler;
+    VmStats *stats;
+    const char *input;
+} VmOptions;
+
+// A stack VM that can run any number of scripts, one at a time. Its stack,
+// frames and buffers are allocated once and reused.
+typedef struct VM VM;
+
+VM *vm_new(void);
+void vm_free(VM *vm);
+// Runs bc from the start with fresh variables; NULL options run with the
+// JIT and print to stdout. Returns 0, or 1 after a runtime error or when
+// the sampler cannot be started, with a message vm_error() returns until
+// the next run. Nothing is printed to stderr and the process never exits.
+int vm_run(VM *vm, const Bytecode *bc, const VmOptions *options);
+// Releases what the last run built (strings) short of the VM's buffers
+void vm_reset(VM *vm);
+const char *vm_error(const VM *vm);
+
+// One run on a VM of its own; a runtime error is printed to stderr
+int run_bytecode(const Bytecode *bc, int use_jit, const OutputSink *sink, Profile *profile,
+                 Sampler *sampler, VmStats *stats);
 
 #endif // VM_H